@@ -0,0 +1,294 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Backup and restore benchmark: generates synthetic images with sfs_imggen, then backs
+ * every one of them up with sfsz and restores it with sfsuz for every atomic block size,
+ * all of them being run from the directory of this binary. Every run prints a JSON line:
+ * wall time, throughput (image bytes per second), read and write syscalls (from
+ * /proc/<pid>/io, counting every read and write flavour, but neither fallocate nor
+ * splice calls), syscalls per GB of image and peak RSS.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sfs.h>
+
+#define BENCH_MAX_ARGS  64
+#define BENCH_OPTS_SIZE 1024
+
+typedef struct bench_run {
+    double seconds;
+    u_int64_t syscr;
+    u_int64_t syscw;
+    long max_rss;           // KiB
+} bench_run_t;
+
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Value of key in /proc/<pid>/io, 0 if not found
+static u_int64_t proc_io(pid_t pid, const char *key) {
+    char path[64], line[128];
+    size_t klen = strlen(key);
+    u_int64_t v = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    f = fopen(path, "r");
+    if(f == NULL)
+        return 0;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(strncmp(line, key, klen) == 0 && line[klen] == ':')
+            v = strtoull(line + klen + 1, NULL, 10);
+    }
+    fclose(f);
+    return v;
+}
+
+
+/* Run argv with stdout sent to out (if not NULL) and stderr discarded. Its counters are
+ * read while it is a zombie, before reaping it. Returns 0 if it succeeded, -1 otherwise
+ */
+static int bench_exec(char **argv, const char *out, bench_run_t *run) {
+    struct rusage ru;
+    siginfo_t si;
+    double start;
+    pid_t pid;
+    int status, fd;
+
+    start = now();
+    pid = fork();
+    if(pid < 0)
+        return -1;
+    if(pid == 0) {
+        fd = open("/dev/null", O_WRONLY);
+        if(fd >= 0)
+            dup2(fd, STDERR_FILENO);
+        if(out != NULL) {
+            fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0)
+                _exit(127);
+            dup2(fd, STDOUT_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    while(waitid(P_PID, pid, &si, WEXITED | WNOWAIT) != 0) {
+        if(errno != EINTR)
+            return -1;
+    }
+    run->seconds = now() - start;
+    run->syscr = proc_io(pid, "syscr");
+    run->syscw = proc_io(pid, "syscw");
+    if(wait4(pid, &status, 0, &ru) != pid)
+        return -1;
+    run->max_rss = ru.ru_maxrss;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Append the space separated words of opts to argv
+static int split_opts(char **argv, int argc, char *opts) {
+    char *word;
+
+    for(word=strtok(opts, " "); word!=NULL && argc<BENCH_MAX_ARGS-4; word=strtok(NULL, " "))
+        argv[argc++] = word;
+    return argc;
+}
+
+
+static void print_run(const char *tool, const char *layout, size_t size, size_t block_size,
+                      size_t stream, const bench_run_t *run) {
+    double gb = size / 1e9;
+
+    fprintf(stdout, "{\"tool\":\"%s\",\"layout\":\"%s\",\"size\":%li,\"block_size\":%li,"
+            "\"stream\":%li,\"seconds\":%.3f,\"throughput\":%.0f,\"read_syscalls\":%lu,"
+            "\"write_syscalls\":%lu,\"syscalls_per_gb\":%.0f,\"peak_rss\":%li}\n",
+            tool, layout, size, block_size, stream, run->seconds,
+            run->seconds > 0 ? size / run->seconds : 0, run->syscr, run->syscw,
+            gb > 0 ? (run->syscr + run->syscw) / gb : 0, run->max_rss * 1024);
+    fflush(stdout);
+}
+
+
+static void print_usage() {
+    fprintf(stderr, "sfs_bench [-s image_size_bytes] [-d data_percent] [-e extent_bytes] "
+            "[-l layout[,layout...]] [-b block_size[,block_size...]] [-w work_dir] "
+            "[-z \"sfsz options\"] [-u \"sfsuz options\"] [-H] [-k]\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    char *layouts = "alternate,regular,random", *blocks = "1048576,16777216,268435456";
+    char *work_dir = "/tmp", *zopts = "", *uopts = "";
+    char bin_dir[PATH_MAX], exe[PATH_MAX], tools[3][PATH_MAX + 16];
+    char img[PATH_MAX], stream[PATH_MAX], restored[PATH_MAX];
+    char size_arg[32], density_arg[8] = "50", extent_arg[32] = "1048576", block_arg[32];
+    char zbuf[BENCH_OPTS_SIZE], ubuf[BENCH_OPTS_SIZE];
+    char *largs, *bargs, *layout, *block, *lsave, *bsave;
+    char *gen[BENCH_MAX_ARGS], *z[BENCH_MAX_ARGS], *u[BENCH_MAX_ARGS];
+    size_t size = 1073741824, block_size;
+    int holes = 0, keep = 0, rc = 0, n, zn, c;
+    bench_run_t run;
+    struct stat st;
+    ssize_t len;
+
+    while((c = getopt(argc, argv, ":s:d:e:l:b:w:z:u:Hk")) != -1) {
+        switch(c) {
+            case 's':
+                size = (size_t) atol(optarg);
+                break;
+            case 'd':
+                snprintf(density_arg, sizeof(density_arg), "%s", optarg);
+                break;
+            case 'e':
+                snprintf(extent_arg, sizeof(extent_arg), "%s", optarg);
+                break;
+            case 'l':
+                layouts = optarg;
+                break;
+            case 'b':
+                blocks = optarg;
+                break;
+            case 'w':
+                work_dir = optarg;
+                break;
+            case 'z':
+                zopts = optarg;
+                break;
+            case 'u':
+                uopts = optarg;
+                break;
+            case 'H':
+                holes = 1;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // The tools are next to this binary
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if(len <= 0)
+        DIE("Unable to locate the benchmark binary\n");
+    exe[len] = '\0';
+    snprintf(bin_dir, sizeof(bin_dir), "%s", dirname(exe));
+    snprintf(tools[0], sizeof(tools[0]), "%s/sfs_imggen", bin_dir);
+    snprintf(tools[1], sizeof(tools[1]), "%s/sfsz", bin_dir);
+    snprintf(tools[2], sizeof(tools[2]), "%s/sfsuz", bin_dir);
+    snprintf(img, sizeof(img), "%s/sfs_bench.img", work_dir);
+    snprintf(stream, sizeof(stream), "%s/sfs_bench.sfs", work_dir);
+    snprintf(restored, sizeof(restored), "%s/sfs_bench.restored", work_dir);
+    snprintf(size_arg, sizeof(size_arg), "%li", size);
+
+    largs = strdup(layouts);
+    if(largs == NULL)
+        DIE("Unable to allocate memory\n");
+    for(layout=strtok_r(largs, ",", &lsave); layout!=NULL && rc==0; layout=strtok_r(NULL, ",", &lsave)) {
+        n = 0;
+        gen[n++] = tools[0];
+        gen[n++] = "-s";
+        gen[n++] = size_arg;
+        gen[n++] = "-d";
+        gen[n++] = density_arg;
+        gen[n++] = "-e";
+        gen[n++] = extent_arg;
+        gen[n++] = "-l";
+        gen[n++] = layout;
+        if(holes)
+            gen[n++] = "-H";
+        gen[n++] = img;
+        gen[n] = NULL;
+        if(bench_exec(gen, "/dev/null", &run) != 0) {
+            rc = -1;
+            break;
+        }
+
+        bargs = strdup(blocks);
+        if(bargs == NULL)
+            DIE("Unable to allocate memory\n");
+        for(block=strtok_r(bargs, ",", &bsave); block!=NULL; block=strtok_r(NULL, ",", &bsave)) {
+            block_size = (size_t) atol(block);
+            snprintf(block_arg, sizeof(block_arg), "%li", block_size);
+
+            // Options are split again for every run, strtok writing into them
+            zn = 0;
+            z[zn++] = tools[1];
+            z[zn++] = "-b";
+            z[zn++] = block_arg;
+            snprintf(zbuf, sizeof(zbuf), "%s", zopts);
+            zn = split_opts(z, zn, zbuf);
+            z[zn++] = img;
+            z[zn++] = stream;
+            z[zn] = NULL;
+            if(bench_exec(z, NULL, &run) != 0 || stat(stream, &st) != 0) {
+                rc = -1;
+                break;
+            }
+            print_run("sfsz", layout, size, block_size, st.st_size, &run);
+
+            unlink(restored);
+            n = 0;
+            u[n++] = tools[2];
+            snprintf(ubuf, sizeof(ubuf), "%s", uopts);
+            n = split_opts(u, n, ubuf);
+            u[n++] = stream;
+            u[n++] = restored;
+            u[n] = NULL;
+            if(bench_exec(u, NULL, &run) != 0) {
+                rc = -1;
+                break;
+            }
+            print_run("sfsuz", layout, size, block_size, st.st_size, &run);
+        }
+        free(bargs);
+    }
+    free(largs);
+
+    if(!keep) {
+        unlink(img);
+        unlink(stream);
+        unlink(restored);
+    }
+    exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,186 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Synthetic image generator for the backup/restore benchmarks: writes an image of the
+ * given size where a given share of the bytes is data, laid out as:
+ * - alternate: 4 KiB of data, 4 KiB of zeros, repeated (worst case, one boundary pair
+ *   per granule, density and extent size being ignored)
+ * - regular: every extent starts with its share of data, the rest being zeros
+ * - random: every extent is either data or zeros, data with the given probability
+ * Small extents mean a fragmented image, big ones a few long runs. Data is made of
+ * pseudo random bytes, so that no granule of it is zero. Zeros are written as such,
+ * like on a block device, unless -H leaves them as holes of a sparse file.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sfs.h>
+#include <zeroscan.h>
+
+#define IMGGEN_BUF_SIZE     1048576
+#define IMGGEN_UNIT         4096     // Data and zero ranges are multiples of it
+
+#define LAYOUT_ALTERNATE    0
+#define LAYOUT_REGULAR      1
+#define LAYOUT_RANDOM       2
+
+
+typedef struct imggen {
+    int layout;
+    size_t extent;
+    int density;
+    u_int64_t state;        // xorshift state, never zero
+    int extent_data;        // Whether the current random extent is data
+} imggen_t;
+
+
+static u_int64_t imggen_rand(imggen_t *g) {
+    g->state ^= g->state << 13;
+    g->state ^= g->state >> 7;
+    g->state ^= g->state << 17;
+    return g->state;
+}
+
+
+// Whether the unit at off holds data. Units are asked in order
+static int imggen_is_data(imggen_t *g, size_t off) {
+    size_t unit = off % g->extent / IMGGEN_UNIT;
+
+    switch(g->layout) {
+        case LAYOUT_ALTERNATE:
+            return (off / IMGGEN_UNIT) % 2 == 0;
+        case LAYOUT_REGULAR:
+            return unit < (g->extent / IMGGEN_UNIT * g->density + 99) / 100;
+        default:
+            // Drawn once per extent, on its first unit
+            if(unit == 0)
+                g->extent_data = imggen_rand(g) % 100 < (u_int64_t) g->density;
+            return g->extent_data;
+    }
+}
+
+
+static void imggen_write(int fd, const char *buf, size_t len, off_t off) {
+    ssize_t wb;
+
+    while(len > 0) {
+        wb = pwrite(fd, buf, len, off);
+        if(wb <= 0)
+            DIE("Unable to write the image\n");
+        buf += wb;
+        len -= wb;
+        off += wb;
+    }
+}
+
+
+static void print_usage() {
+    fprintf(stderr, "sfs_imggen [-s size_bytes] [-d data_percent] [-e extent_bytes] "
+            "[-l alternate|regular|random] [-S seed] [-H] dst_path\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    imggen_t g = {LAYOUT_ALTERNATE, 1048576, 50, 1, 0};
+    size_t size = 1073741824, data = 0, off, n, i, run;
+    int holes = 0, fd, c;
+    u_int64_t *w;
+    char *buf;
+
+    while((c = getopt(argc, argv, ":s:d:e:l:S:H")) != -1) {
+        switch(c) {
+            case 's':
+                size = (size_t) atol(optarg);
+                break;
+            case 'd':
+                g.density = atoi(optarg);
+                if(g.density < 0 || g.density > 100)
+                    DIE("Data share must be between 0 and 100 percent\n");
+                break;
+            case 'e':
+                g.extent = (size_t) atol(optarg);
+                if(g.extent == 0 || g.extent % IMGGEN_UNIT != 0)
+                    DIE("Extent size must be a positive multiple of 4096 bytes\n");
+                break;
+            case 'l':
+                if(strcmp(optarg, "alternate") == 0)
+                    g.layout = LAYOUT_ALTERNATE;
+                else if(strcmp(optarg, "regular") == 0)
+                    g.layout = LAYOUT_REGULAR;
+                else if(strcmp(optarg, "random") == 0)
+                    g.layout = LAYOUT_RANDOM;
+                else
+                    DIE("Layout must be alternate, regular or random\n");
+                break;
+            case 'S':
+                g.state = (u_int64_t) atol(optarg) | 1;
+                break;
+            case 'H':
+                holes = 1;
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(argc - optind != 1 || size % IMGGEN_UNIT != 0) {
+        print_usage();
+        DIE("Missing destination, or size not a multiple of 4096 bytes\n");
+    }
+
+    buf = aligned_alloc(IMGGEN_UNIT, IMGGEN_BUF_SIZE);
+    if(buf == NULL)
+        DIE("Unable to allocate the image buffer\n");
+    fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        DIE("Unable to create the image\n");
+
+    for(off=0; off<size; off+=n) {
+        n = size - off < IMGGEN_BUF_SIZE ? size - off : IMGGEN_BUF_SIZE;
+        memset(buf, 0, n);
+        for(i=0; i<n; i+=IMGGEN_UNIT) {
+            if(!imggen_is_data(&g, off + i))
+                continue;
+            // xorshift never returns 0: no data granule is zero, whatever the granularity
+            for(w=(u_int64_t *) (buf + i); w<(u_int64_t *) (buf + i + IMGGEN_UNIT); w++)
+                *w = imggen_rand(&g);
+            data += IMGGEN_UNIT;
+        }
+        if(!holes) {
+            imggen_write(fd, buf, n, off);
+            continue;
+        }
+        // Only the data runs are written, zeros being left as holes
+        for(i=0; i<n; i+=run) {
+            for(run=0; i+run<n && !zs_is_zero(buf + i + run, IMGGEN_UNIT); run+=IMGGEN_UNIT);
+            if(run > 0) {
+                imggen_write(fd, buf + i, run, off + i);
+                continue;
+            }
+            run = IMGGEN_UNIT;
+        }
+    }
+    if(ftruncate(fd, size) != 0)
+        DIE("Unable to set the image size\n");
+    close(fd);
+    free(buf);
+    fprintf(stdout, "{\"size\":%li,\"data\":%li}\n", size, data);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,106 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Zero scan microbenchmark: reports the throughput of every zero detection
+ * kernel supported by the running CPU, on a few buffer patterns:
+ * - zeros: only zero blocks, the kernel has to read every byte
+ * - dense: random data, the kernel exits on the first bytes of every block
+ * - late: a single non-zero byte at the end of every block (worst case)
+ * - alternate: zero and random blocks alternate, maximum number of runs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sfs.h>
+#include <zeroscan.h>
+
+#define MIN_BENCH_SECONDS 0.5
+
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void fill(char *buf, size_t len, size_t blk_size, const char *pattern) {
+    size_t i;
+
+    memset(buf, 0, len);
+    if(strcmp(pattern, "zeros") == 0)
+        return;
+    for(i=0; i<len; i+=blk_size) {
+        if(strcmp(pattern, "dense") == 0)
+            memset(buf + i, (int) (i / blk_size) % 255 + 1, blk_size);
+        else if(strcmp(pattern, "late") == 0)
+            buf[i + blk_size - 1] = 1;
+        else if((i / blk_size) % 2)
+            memset(buf + i, 0xa5, blk_size);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *patterns[] = { "zeros", "dense", "late", "alternate", NULL };
+    const zs_kernel_t * const *kernels = zs_kernels();
+    size_t len = 256 * 1024 * 1024;
+    size_t blk_size = BLK_SIZE;
+    size_t scanned, nruns = 0;
+    sfs_run_t *runs;
+    char *buf;
+    double start, elapsed;
+    int i, k;
+
+    if(argc > 1)
+        len = (size_t) atol(argv[1]);
+    if(argc > 2)
+        blk_size = (size_t) atol(argv[2]);
+    if(blk_size == 0 || len < blk_size || len % blk_size != 0)
+        DIE("usage: zeroscan_bench [buffer_size_bytes [block_size_bytes]], "
+            "buffer size being a multiple of block size\n");
+
+    buf = aligned_alloc(4096, len);
+    runs = malloc(len / blk_size * sizeof(sfs_run_t));
+    if(buf == NULL || runs == NULL)
+        DIE("Unable to allocate benchmark buffers\n");
+
+    fprintf(stdout, "%-10s %-10s %12s %10s\n", "kernel", "pattern", "GB/s", "runs");
+    for(i=0; patterns[i] != NULL; i++) {
+        fill(buf, len, blk_size, patterns[i]);
+        for(k=0; kernels[k] != NULL; k++) {
+            if(zs_select(kernels[k]->name) != 0)
+                continue;
+            // Warm up caches and TLB once
+            zs_scan(buf, len, blk_size, runs);
+            scanned = 0;
+            start = now();
+            do {
+                nruns = zs_scan(buf, len, blk_size, runs);
+                scanned += len;
+                elapsed = now() - start;
+            } while(elapsed < MIN_BENCH_SECONDS);
+            fprintf(stdout, "%-10s %-10s %12.2f %10li\n", kernels[k]->name, patterns[i],
+                    scanned / elapsed / 1e9, nruns);
+        }
+    }
+
+    free(runs);
+    free(buf);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,160 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* nbdkit plugin serving sfs images read-only, as the file or drive they restore:
+ *
+ *   nbdkit ./build/nbdkit-sfs-plugin.so file=drive.img [cache=4]
+ *
+ * Holes are reported through NBD block status, so that clients like
+ * qemu-img convert or nbdcopy skip them.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include <image.h>
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+
+static char *sfs_file = NULL;
+static size_t sfs_cache_blocks = DEFAULT_IMAGE_CACHE_BLOCKS;
+
+
+static void sfs_unload(void) {
+    free(sfs_file);
+}
+
+
+static int sfs_config(const char *key, const char *value) {
+    if(strcmp(key, "file") == 0) {
+        free(sfs_file);
+        sfs_file = nbdkit_realpath(value);
+        if(sfs_file == NULL)
+            return -1;
+    }
+    else if(strcmp(key, "cache") == 0) {
+        sfs_cache_blocks = (size_t) atol(value);
+        if(sfs_cache_blocks < 1) {
+            nbdkit_error("cache must be at least 1 atomic block");
+            return -1;
+        }
+    }
+    else {
+        nbdkit_error("unknown parameter '%s'", key);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int sfs_config_complete(void) {
+    if(sfs_file == NULL) {
+        nbdkit_error("the file parameter is required");
+        return -1;
+    }
+    return 0;
+}
+
+
+#define sfs_config_help \
+    "file=<IMAGE>     (required) The sfs image to serve.\n" \
+    "cache=<N>        Atomic blocks kept in memory, per connection (default 4)."
+
+
+// Every connection has its own image, the block map being built here
+static void *sfs_open(int readonly) {
+    sfs_image_t *img;
+
+    img = malloc(sizeof(sfs_image_t));
+    if(img == NULL) {
+        nbdkit_error("malloc: %m");
+        return NULL;
+    }
+    if(sfs_image_open(img, sfs_file, sfs_cache_blocks) != 0) {
+        nbdkit_error("unable to open sfs image %s", sfs_file);
+        sfs_image_close(img);
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+
+static void sfs_close(void *handle) {
+    sfs_image_close((sfs_image_t *) handle);
+    free(handle);
+}
+
+
+static int64_t sfs_get_size(void *handle) {
+    return (int64_t) sfs_image_size((sfs_image_t *) handle);
+}
+
+
+static int sfs_pread(void *handle, void *buf, uint32_t count, uint64_t offset, uint32_t flags) {
+    if(sfs_image_pread((sfs_image_t *) handle, buf, count, offset) != 0) {
+        nbdkit_error("unable to read %u bytes at offset %lu", count, offset);
+        nbdkit_set_error(EIO);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int sfs_can_extents(void *handle) {
+    return 1;
+}
+
+
+static int sfs_add_extent(void *ctx, size_t off, size_t len, int zero) {
+    return nbdkit_add_extent((struct nbdkit_extents *) ctx, off, len,
+                             zero ? NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO : 0);
+}
+
+
+static int sfs_extents(void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+                       struct nbdkit_extents *extents) {
+    if(sfs_image_extents((sfs_image_t *) handle, offset, count, sfs_add_extent, extents) != 0) {
+        nbdkit_error("unable to describe %u bytes at offset %lu", count, offset);
+        nbdkit_set_error(EIO);
+        return -1;
+    }
+    return 0;
+}
+
+
+static struct nbdkit_plugin plugin = {
+    .name               = "sfs",
+    .longname           = "sparse file stripper images",
+    .description        = "Serves sfs images read-only, as the file they restore",
+    .unload             = sfs_unload,
+    .config             = sfs_config,
+    .config_complete    = sfs_config_complete,
+    .config_help        = sfs_config_help,
+    .open               = sfs_open,
+    .close              = sfs_close,
+    .get_size           = sfs_get_size,
+    .pread              = sfs_pread,
+    .can_extents        = sfs_can_extents,
+    .extents            = sfs_extents,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
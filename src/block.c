@@ -0,0 +1,529 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <block.h>
+#include <codec.h>
+#include <hash.h>
+#include <sfs.h>
+
+
+// Add len bytes of the block, as read from the stream, to its checksum
+static void block_sum(const sfs_header_t *hdr, sfs_block_t *blk, const void *buf, size_t len) {
+    if(hdr->flags & SFS_FLAG_CHECKSUM)
+        blk->checksum = sfs_hash64(buf, len, blk->checksum);
+}
+
+
+u_int64_t sfs_block_sum_data(const sfs_header_t *hdr, const void *buf, size_t len, u_int64_t check) {
+    size_t i, n;
+
+    if(!(hdr->flags & SFS_FLAG_BOUNDARIES_FIRST))
+        return sfs_hash64(buf, len, check);
+    for(i=0; i<len; i+=n) {
+        n = len - i < SFS_DATA_PIECE_SIZE ? len - i : SFS_DATA_PIECE_SIZE;
+        check = sfs_hash64((const char *) buf + i, n, check);
+    }
+    return check;
+}
+
+
+static int block_read_typed(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    size_t i, rb;
+    void *p;
+
+    rb = fread(&blk->ntyped, sizeof(size_t), 1, sfp);
+    if(rb != 1) {
+        fprintf(stderr, "Unable to extract typed ranges number\n");
+        return -1;
+    }
+    blk->stream_bytes += sizeof(size_t);
+    block_sum(hdr, blk, &blk->ntyped, sizeof(size_t));
+
+    // Every typed range is at least one granule long
+    if(blk->ntyped > MAX_ATOMIC_BLOCK_SIZE / hdr->granularity) {
+        fprintf(stderr, "Unconsistent data: %li typed ranges in a block\n", blk->ntyped);
+        return -1;
+    }
+    if(blk->ntyped > blk->typed_cap) {
+        p = realloc(blk->typed, blk->ntyped * sizeof(sfs_typed_range_t));
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %li typed ranges\n", blk->ntyped);
+            return -1;
+        }
+        blk->typed = p;
+        blk->typed_cap = blk->ntyped;
+    }
+
+    rb = fread(blk->typed, sizeof(sfs_typed_range_t), blk->ntyped, sfp);
+    if(rb != blk->ntyped) {
+        fprintf(stderr, "Read: %li typed ranges. Differs from expected: %li\n", rb, blk->ntyped);
+        return -1;
+    }
+    blk->stream_bytes += sizeof(sfs_typed_range_t) * blk->ntyped;
+    block_sum(hdr, blk, blk->typed, sizeof(sfs_typed_range_t) * blk->ntyped);
+
+    for(i=0; i<blk->ntyped; i++) {
+        if(blk->typed[i].kind != SFS_RANGE_PATTERN &&
+           !(blk->typed[i].kind == SFS_RANGE_COPY && (hdr->flags & SFS_FLAG_DEDUP)) &&
+           !(blk->typed[i].kind == SFS_RANGE_BASE && (hdr->flags & SFS_FLAG_BASE))) {
+            fprintf(stderr, "Unsupported typed range kind %li\n", blk->typed[i].kind);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Read the compressed data, if the block data was compressed
+static int block_read_stored(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    size_t rb;
+    void *p;
+
+    rb = fread(&blk->stored_len, sizeof(size_t), 1, sfp);
+    if(rb != 1) {
+        fprintf(stderr, "Unable to read compressed block size\n");
+        return -1;
+    }
+    blk->stream_bytes += sizeof(size_t);
+    block_sum(hdr, blk, &blk->stored_len, sizeof(size_t));
+
+    if(blk->stored_len > blk->size) {
+        fprintf(stderr, "Unconsistent data: %li compressed bytes for %li bytes\n",
+                blk->stored_len, blk->size);
+        return -1;
+    }
+    // Stored as is
+    if(blk->stored_len == blk->size)
+        return 0;
+
+    if(blk->stored_cap < blk->stored_len) {
+        p = realloc(blk->stored, blk->stored_len);
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate %li bytes of memory for compressed data\n",
+                    blk->stored_len);
+            return -1;
+        }
+        blk->stored = p;
+        blk->stored_cap = blk->stored_len;
+    }
+    rb = fread(blk->stored, 1, blk->stored_len, sfp);
+    if(rb != blk->stored_len) {
+        fprintf(stderr, "Read bytes: %li. Differs from expected compressed size: %li bytes.\n",
+                rb, blk->stored_len);
+        return -1;
+    }
+    blk->stream_bytes += blk->stored_len;
+    if(hdr->flags & SFS_FLAG_CHECKSUM)
+        blk->checksum = sfs_block_sum_data(hdr, blk->stored, blk->stored_len, blk->checksum);
+    blk->encoded = 1;
+    return 0;
+}
+
+
+int sfs_block_decode(const sfs_header_t *hdr, sfs_block_t *blk) {
+    if(!blk->encoded)
+        return BLOCK_OK;
+    if(sfs_codec_decompress(hdr->codec, blk->stored, blk->stored_len, blk->data, blk->size) != 0)
+        return BLOCK_ERROR;
+    blk->encoded = 0;
+    return BLOCK_OK;
+}
+
+
+size_t sfs_boundaries_encode(const size_t *boundaries, size_t n, size_t granularity, unsigned char *out) {
+    size_t i, len = 0;
+    u_int64_t v;
+
+    for(i=0; i<n; i++) {
+        if(boundaries[i] % granularity == 0)
+            v = (u_int64_t) (boundaries[i] / granularity) << 1;
+        else
+            v = (u_int64_t) boundaries[i] << 1 | 1;
+        while(v >= 0x80) {
+            out[len++] = (unsigned char) (v | 0x80);
+            v >>= 7;
+        }
+        out[len++] = (unsigned char) v;
+    }
+    return len;
+}
+
+
+int sfs_boundaries_decode(const unsigned char *in, size_t len, size_t granularity, size_t *boundaries,
+                          size_t n) {
+    size_t i, pos = 0;
+    unsigned shift;
+    u_int64_t v, c;
+
+    for(i=0; i<n; i++) {
+        // Most boundaries fit in a single byte
+        if(pos < len && in[pos] < 0x80) {
+            v = in[pos++];
+        }
+        else {
+            v = 0;
+            shift = 0;
+            do {
+                if(pos == len || shift >= 64)
+                    return -1;
+                c = in[pos++];
+                // The 10th byte only has the highest bit left to set
+                if(shift == 63 && (c & 0x7f) > 1)
+                    return -1;
+                v |= (c & 0x7f) << shift;
+                shift += 7;
+            } while(c & 0x80);
+        }
+        if(v & 1)
+            boundaries[i] = v >> 1;
+        else if((v >> 1) > (size_t) -1 / granularity)
+            return -1;
+        else
+            boundaries[i] = (v >> 1) * granularity;
+    }
+    return pos == len ? 0 : -1;
+}
+
+
+// Read and unpack the boundaries of a stream with compact boundaries
+static int block_read_packed(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    size_t packed_len;
+    void *p;
+
+    if(fread(&packed_len, sizeof(size_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to extract packed offsets array size\n");
+        return -1;
+    }
+    blk->stream_bytes += sizeof(size_t);
+    block_sum(hdr, blk, &packed_len, sizeof(size_t));
+
+    if(packed_len < blk->meta_idx || packed_len > blk->meta_idx * SFS_VARINT_MAX_BYTES) {
+        fprintf(stderr, "Unconsistent data: %li bytes of packed offsets for %li offsets\n",
+                packed_len, blk->meta_idx);
+        return -1;
+    }
+    if(packed_len > blk->packed_cap) {
+        p = realloc(blk->packed, packed_len);
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate %li bytes of memory for packed offsets\n", packed_len);
+            return -1;
+        }
+        blk->packed = p;
+        blk->packed_cap = packed_len;
+    }
+    if(fread(blk->packed, 1, packed_len, sfp) != packed_len) {
+        fprintf(stderr, "Unable to read %li bytes of packed offsets\n", packed_len);
+        return -1;
+    }
+    blk->stream_bytes += packed_len;
+    block_sum(hdr, blk, blk->packed, packed_len);
+
+    if(sfs_boundaries_decode(blk->packed, packed_len, hdr->granularity, blk->boundaries, blk->meta_idx) != 0) {
+        fprintf(stderr, "Unconsistent data: invalid packed offsets array\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Seek len bytes further in the stream
+static int block_skip(FILE *sfp, size_t len, sfs_block_t *blk) {
+    if(fseeko(sfp, len, SEEK_CUR) != 0) {
+        fprintf(stderr, "Unable to seek past %li bytes of atomic block\n", len);
+        return -1;
+    }
+    blk->stream_bytes += len;
+    return 0;
+}
+
+
+// Read the data of the block, or seek past it without data
+static int block_read_data(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk, int with_data) {
+    size_t rb;
+    void *p;
+
+    blk->encoded = 0;
+    if(!with_data) {
+        if(hdr->flags & SFS_FLAG_CODEC) {
+            if(fread(&blk->stored_len, sizeof(size_t), 1, sfp) != 1 || blk->stored_len > blk->size) {
+                fprintf(stderr, "Unable to read compressed block size\n");
+                return -1;
+            }
+            blk->stream_bytes += sizeof(size_t);
+        }
+        return block_skip(sfp, (hdr->flags & SFS_FLAG_CODEC) ? blk->stored_len : blk->size, blk);
+    }
+
+    if(blk->data_cap < blk->size) {
+        fprintf(stderr, "Extending atomic block buffer by %li bytes\n",
+                blk->size - blk->data_cap);
+        p = realloc(blk->data, blk->size);
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate %li bytes of memory for buffer. "
+                    "Block size was too big when compressing for this server to "
+                    "be able to inflate data\n", blk->size);
+            return -1;
+        }
+        blk->data = p;
+        blk->data_cap = blk->size;
+    }
+
+    if(hdr->flags & SFS_FLAG_CODEC) {
+        if(block_read_stored(sfp, hdr, blk) != 0)
+            return -1;
+    }
+
+    if(!blk->encoded) {
+        rb = fread(blk->data, 1, blk->size, sfp);
+        if(rb != blk->size) {
+            fprintf(stderr, "Read bytes: %li. Differs from expected atomic block size: "
+                    "%li bytes.\n", rb, blk->size);
+            return -1;
+        }
+        blk->stream_bytes += blk->size;
+        if(hdr->flags & SFS_FLAG_CHECKSUM)
+            blk->checksum = sfs_block_sum_data(hdr, blk->data, blk->size, blk->checksum);
+    }
+    return 0;
+}
+
+
+// Read the typed ranges and the boundaries of the block, and check them
+static int block_read_bounds(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    size_t i, rb, idx_upper_bound;
+    sfs_typed_range_t *t;
+    void *p;
+
+    blk->ntyped = 0;
+    if(hdr->flags & SFS_FLAG_TYPED_RANGES) {
+        if(block_read_typed(sfp, hdr, blk) != 0)
+            return -1;
+    }
+
+    // Now load offsets
+    rb = fread(&blk->meta_idx, sizeof(size_t), 1, sfp);
+    if(rb != 1) {
+        fprintf(stderr, "Unable to extract offsets array length\n");
+        return -1;
+    }
+    blk->stream_bytes += sizeof(size_t);
+    block_sum(hdr, blk, &blk->meta_idx, sizeof(size_t));
+
+    /* TODO: improve data integrity checks.
+     */
+    // The last block of the stream may end with less than a granule of data
+    // and every typed range may add zero length data ranges before and after it
+    idx_upper_bound = ((blk->size + hdr->granularity - 1) / hdr->granularity + 1 + 2 * blk->ntyped) * 2;
+    if(
+        (blk->meta_idx <= 0) ||
+        (blk->meta_idx % 2 != 0) ||
+        (blk->meta_idx > idx_upper_bound)
+    ) {
+        fprintf(stderr,
+                "Unconsistent data: current_meta_max_index (%li) does not meet "
+                "expected requirements (positive and even integer lower than %li)\n",
+                blk->meta_idx, idx_upper_bound);
+        return -1;
+    }
+
+    if(blk->meta_idx > blk->meta_cap) {
+        fprintf(stderr, "Extending offsets array by %li bytes\n",
+                (blk->meta_idx - blk->meta_cap) * sizeof(size_t));
+        p = realloc(blk->boundaries, blk->meta_idx * sizeof(size_t));
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate %li bytes of memory for data boundaries. "
+                    "Block size was too big when compressing for this server to "
+                    "be able to inflate data\n", blk->meta_idx);
+            return -1;
+        }
+        blk->boundaries = p;
+        blk->meta_cap = blk->meta_idx;
+    }
+
+    if(hdr->flags & SFS_FLAG_COMPACT_BOUNDARIES) {
+        if(block_read_packed(sfp, hdr, blk) != 0)
+            return -1;
+    }
+    else {
+        rb = fread(blk->boundaries, sizeof(size_t), blk->meta_idx, sfp);
+        if(rb != blk->meta_idx) {
+            fprintf(stderr, "Read: %li longs. Differs from expected: %li longs\n",
+                    rb, blk->meta_idx);
+            return -1;
+        }
+        blk->stream_bytes += sizeof(size_t) * blk->meta_idx;
+        block_sum(hdr, blk, blk->boundaries, sizeof(size_t) * blk->meta_idx);
+    }
+
+    //TODO: once again, improve data integrity checks here
+    if(blk->boundaries[0] != 0) {
+        fprintf(stderr, "Unconsistent data: unexpected offset array\n");
+        return -1;
+    }
+
+    for(i=0; i<blk->ntyped; i++) {
+        t = &blk->typed[i];
+        if(t->slot < 2 || t->slot % 2 != 0 || t->slot >= blk->meta_idx ||
+           (i > 0 && t->slot <= blk->typed[i-1].slot) || blk->boundaries[t->slot] == 0 ||
+           (t->kind == SFS_RANGE_PATTERN && blk->boundaries[t->slot] % sizeof(u_int64_t) != 0) ||
+           (t->kind != SFS_RANGE_PATTERN && blk->boundaries[t->slot] % hdr->granularity != 0)) {
+            fprintf(stderr, "Unconsistent data: invalid typed range %li (slot %li)\n", i, t->slot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Read the checksum ending the block, if any, and compare it to the parts read
+static int block_read_check(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk, int verify) {
+    u_int64_t check;
+
+    if(!(hdr->flags & SFS_FLAG_CHECKSUM))
+        return 0;
+    if(fread(&check, sizeof(u_int64_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read atomic block checksum\n");
+        return -1;
+    }
+    blk->stream_bytes += sizeof(u_int64_t);
+    if(verify && check != blk->checksum) {
+        fprintf(stderr, "Unconsistent data: atomic block checksum mismatch (%016lx, expected %016lx)\n",
+                blk->checksum, check);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Read the size word and the random buffer, discarded (or seeked past without data)
+static int block_read_start(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk,
+                            int with_data) {
+    size_t rb;
+
+    blk->stream_bytes = 0;
+    blk->checksum = 0;
+    rb = fread(&blk->size, sizeof(size_t), 1, sfp);
+    if(rb != 1) {
+        fprintf(stderr, "Unable to read atomic block size from source \n");
+        return BLOCK_ERROR;
+    }
+    blk->stream_bytes += sizeof(size_t);
+
+    if(blk->size == -1L) {
+        fprintf(stderr, "All atomic blocks read. Footer remaining\n");
+        return BLOCK_END;
+    }
+    block_sum(hdr, blk, &blk->size, sizeof(size_t));
+
+    // Streams made with sfsz -C also carry a checksum, verified once the block is read.
+    // Only blocks with typed ranges can be made of them alone, without any data
+    if((blk->size <= 0 && !(hdr->flags & SFS_FLAG_TYPED_RANGES)) || (blk->size > MAX_ATOMIC_BLOCK_SIZE)) {
+        fprintf(stderr, "Unexpected atomic block size %li, should be > 0 and < 4294967296\n",
+                blk->size);
+        return BLOCK_ERROR;
+    }
+
+    if(!with_data)
+        return block_skip(sfp, hdr->random_size_bytes, blk) == 0 ? BLOCK_OK : BLOCK_ERROR;
+
+    // Discard random buffer if any
+    if(hdr->random_size_bytes > 0) {
+        rb = fread(random_buf, hdr->random_size_bytes, 1, sfp);
+        if(rb != 1) {
+            fprintf(stderr, "Unable to discard random buffer from block \n");
+            return BLOCK_ERROR;
+        }
+        blk->stream_bytes += hdr->random_size_bytes;
+        block_sum(hdr, blk, random_buf, hdr->random_size_bytes);
+    }
+    return BLOCK_OK;
+}
+
+
+// Without data, the random buffer and the data are seeked past instead of being read
+static int block_read(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk,
+                      int with_data) {
+    int rc;
+
+    rc = block_read_start(sfp, hdr, random_buf, blk, with_data);
+    if(rc != BLOCK_OK)
+        return rc;
+
+    // Boundaries first streams carry the data after the boundaries
+    if(!(hdr->flags & SFS_FLAG_BOUNDARIES_FIRST) && block_read_data(sfp, hdr, blk, with_data) != 0)
+        return BLOCK_ERROR;
+    if(block_read_bounds(sfp, hdr, blk) != 0)
+        return BLOCK_ERROR;
+    if((hdr->flags & SFS_FLAG_BOUNDARIES_FIRST) && block_read_data(sfp, hdr, blk, with_data) != 0)
+        return BLOCK_ERROR;
+
+    // Checksum of the whole block, only known once its data was read
+    if(block_read_check(sfp, hdr, blk, with_data) != 0)
+        return BLOCK_ERROR;
+    return BLOCK_OK;
+}
+
+
+int sfs_block_read(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk) {
+    return block_read(sfp, hdr, random_buf, blk, 1);
+}
+
+
+int sfs_block_read_meta(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    return block_read(sfp, hdr, NULL, blk, 0);
+}
+
+
+int sfs_block_read_head(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk) {
+    int rc;
+
+    rc = block_read_start(sfp, hdr, random_buf, blk, 1);
+    if(rc != BLOCK_OK)
+        return rc;
+    blk->encoded = 0;
+    if(block_read_bounds(sfp, hdr, blk) != 0)
+        return BLOCK_ERROR;
+    return BLOCK_OK;
+}
+
+
+void sfs_block_sum(const sfs_header_t *hdr, sfs_block_t *blk, const void *buf, size_t len) {
+    blk->stream_bytes += len;
+    block_sum(hdr, blk, buf, len);
+}
+
+
+int sfs_block_read_tail(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk) {
+    return block_read_check(sfp, hdr, blk, 1) == 0 ? BLOCK_OK : BLOCK_ERROR;
+}
+
+
+void sfs_block_free(sfs_block_t *blk) {
+    free_all_mem(5, (void *) blk->data, (void *) blk->boundaries, (void *) blk->typed, (void *) blk->stored,
+                 (void *) blk->packed);
+    blk->packed = NULL;
+    blk->packed_cap = 0;
+    blk->data = NULL;
+    blk->stored = NULL;
+    blk->stored_cap = 0;
+    blk->boundaries = NULL;
+    blk->typed = NULL;
+    blk->data_cap = 0;
+    blk->meta_cap = 0;
+    blk->typed_cap = 0;
+}
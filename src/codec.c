@@ -0,0 +1,283 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SFS_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SFS_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include <codec.h>
+#include <sfs.h>
+
+static const char *codec_names[] = {"none", "zstd", "lz4"};
+
+
+int sfs_codec_available(int codec) {
+    switch(codec) {
+#ifdef SFS_WITH_ZSTD
+        case SFS_CODEC_ZSTD:
+            return 1;
+#endif
+#ifdef SFS_WITH_LZ4
+        case SFS_CODEC_LZ4:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+
+int sfs_codec_by_name(const char *name) {
+    int codec;
+
+    for(codec=SFS_CODEC_ZSTD; codec<=SFS_CODEC_LZ4; codec++) {
+        if(strcmp(name, codec_names[codec]) == 0)
+            return sfs_codec_available(codec) ? codec : -1;
+    }
+    return -1;
+}
+
+
+const char *sfs_codec_name(int codec) {
+    if(codec < SFS_CODEC_NONE || codec > SFS_CODEC_LZ4)
+        return "unknown";
+    return codec_names[codec];
+}
+
+
+int sfs_codec_default_level(int codec) {
+    // Fast levels: the codec is meant to keep up with the drive
+    return (codec == SFS_CODEC_ZSTD) ? 1 : 0;
+}
+
+
+size_t sfs_codec_bound(int codec, size_t len) {
+    switch(codec) {
+#ifdef SFS_WITH_ZSTD
+        case SFS_CODEC_ZSTD:
+            return ZSTD_compressBound(len);
+#endif
+#ifdef SFS_WITH_LZ4
+        case SFS_CODEC_LZ4:
+            // Bigger inputs are stored as is
+            return (len > LZ4_MAX_INPUT_SIZE) ? 0 : (size_t) LZ4_compressBound((int) len);
+#endif
+        default:
+            return 0;
+    }
+}
+
+
+size_t sfs_codec_compress(int codec, int level, const void *src, size_t len, void *dst, size_t cap) {
+    size_t n = 0;
+
+    switch(codec) {
+#ifdef SFS_WITH_ZSTD
+        case SFS_CODEC_ZSTD:
+            n = ZSTD_compress(dst, cap, src, len, level);
+            if(ZSTD_isError(n))
+                n = 0;
+            break;
+#endif
+#ifdef SFS_WITH_LZ4
+        case SFS_CODEC_LZ4:
+            if(len > LZ4_MAX_INPUT_SIZE || cap < (size_t) LZ4_compressBound((int) len))
+                return 0;
+            // Levels as for the lz4 tool: 3 and up use LZ4HC (same format), negative ones
+            // accelerate the fast mode. Not LZ4HC_CLEVEL_MIN, lowered to 2 in lz4 1.10
+            if(level >= LZ4_HC_MIN_LEVEL)
+                n = LZ4_compress_HC(src, dst, (int) len, (int) cap, level);
+            else
+                n = LZ4_compress_fast(src, dst, (int) len, (int) cap, level < 0 ? -level : 1);
+            break;
+#endif
+        default:
+            break;
+    }
+    return (n < len) ? n : 0;
+}
+
+
+int sfs_codec_decompress(int codec, const void *src, size_t len, void *dst, size_t raw_len) {
+    size_t n;
+
+    switch(codec) {
+#ifdef SFS_WITH_ZSTD
+        case SFS_CODEC_ZSTD:
+            n = ZSTD_decompress(dst, raw_len, src, len);
+            if(ZSTD_isError(n)) {
+                fprintf(stderr, "zstd decompression failed: %s\n", ZSTD_getErrorName(n));
+                return -1;
+            }
+            break;
+#endif
+#ifdef SFS_WITH_LZ4
+        case SFS_CODEC_LZ4:
+            if(len > LZ4_MAX_INPUT_SIZE || raw_len > LZ4_MAX_INPUT_SIZE) {
+                fprintf(stderr, "lz4 block too big\n");
+                return -1;
+            }
+            n = LZ4_decompress_safe(src, dst, (int) len, (int) raw_len);
+            if((int) n < 0) {
+                fprintf(stderr, "lz4 decompression failed\n");
+                return -1;
+            }
+            break;
+#endif
+        default:
+            fprintf(stderr, "Codec %s not supported by this build\n", sfs_codec_name(codec));
+            return -1;
+    }
+    if(n != raw_len) {
+        fprintf(stderr, "Unconsistent data: %li bytes decompressed instead of %li\n", n, raw_len);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void *codec_worker(void *arg) {
+    sfs_codec_pool_t *pool = (sfs_codec_pool_t *) arg;
+    sfs_codec_slot_t *slot;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->stop && pool->next_job == pool->next_fill)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if(pool->stop)
+            break;
+        slot = &pool->slots[pool->next_job % pool->nslots];
+        pool->next_job++;
+        slot->state = CODEC_SLOT_COMPRESSING;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->out_len = sfs_codec_compress(pool->codec, pool->level, slot->raw, slot->raw_len,
+                                           slot->out, sfs_codec_bound(pool->codec, slot->raw_len));
+
+        pthread_mutex_lock(&pool->lock);
+        slot->state = CODEC_SLOT_DONE;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+int sfs_codec_pool_start(sfs_codec_pool_t *pool, int codec, int level, int nthreads, size_t raw_size) {
+    size_t i;
+
+    memset(pool, 0, sizeof(sfs_codec_pool_t));
+    pool->codec = codec;
+    pool->level = level;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    // One more slot than workers, for the one being filled
+    pool->nslots = nthreads + 1;
+    pool->slots = calloc(pool->nslots, sizeof(sfs_codec_slot_t));
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if(pool->slots == NULL || pool->threads == NULL) {
+        fprintf(stderr, "Unable to allocate compression slots\n");
+        return -1;
+    }
+    for(i=0; i<pool->nslots; i++) {
+        pool->slots[i].raw = malloc(raw_size);
+        pool->slots[i].out = malloc(sfs_codec_bound(codec, raw_size) + 1);
+        if(pool->slots[i].raw == NULL || pool->slots[i].out == NULL) {
+            fprintf(stderr, "Unable to allocate compression buffers. Try decreasing atomic block "
+                    "size or compression threads.\n");
+            return -1;
+        }
+    }
+
+    for(; pool->nthreads<nthreads; pool->nthreads++) {
+        if(pthread_create(&pool->threads[pool->nthreads], NULL, codec_worker, pool) != 0) {
+            fprintf(stderr, "Unable to start compression thread\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+sfs_codec_slot_t *sfs_codec_pool_next(sfs_codec_pool_t *pool) {
+    sfs_codec_slot_t *slot = &pool->slots[pool->next_fill % pool->nslots];
+
+    // Only the calling thread frees slots, no need to lock
+    if(pool->next_fill - pool->next_done == pool->nslots)
+        return NULL;
+    return slot;
+}
+
+
+void sfs_codec_pool_submit(sfs_codec_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->slots[pool->next_fill % pool->nslots].state = CODEC_SLOT_QUEUED;
+    pool->next_fill++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+sfs_codec_slot_t *sfs_codec_pool_retire(sfs_codec_pool_t *pool) {
+    sfs_codec_slot_t *slot = &pool->slots[pool->next_done % pool->nslots];
+
+    if(pool->next_done == pool->next_fill)
+        return NULL;
+    pthread_mutex_lock(&pool->lock);
+    while(slot->state != CODEC_SLOT_DONE)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+
+void sfs_codec_pool_release(sfs_codec_pool_t *pool) {
+    pool->slots[pool->next_done % pool->nslots].state = CODEC_SLOT_FREE;
+    pool->next_done++;
+}
+
+
+void sfs_codec_pool_stop(sfs_codec_pool_t *pool) {
+    size_t i;
+    int t;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(t=0; t<pool->nthreads; t++)
+        pthread_join(pool->threads[t], NULL);
+    pool->nthreads = 0;
+
+    if(pool->slots != NULL) {
+        for(i=0; i<pool->nslots; i++)
+            free_all_mem(2, (void *) pool->slots[i].raw, (void *) pool->slots[i].out);
+    }
+    free_all_mem(2, (void *) pool->slots, (void *) pool->threads);
+    pool->slots = NULL;
+    pool->threads = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
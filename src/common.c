@@ -13,9 +13,12 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
 
+#include <codec.h>
 #include <sfs.h>
 
 
@@ -48,6 +51,107 @@ sfs_footer_t *extract_footer(FILE* sfp, int skip_repositionning) {
 }
 
 
+void sfs_header_init(sfs_header_t *hdr) {
+    hdr->magic = SFS_MAGIC;
+    hdr->version = SFS_FORMAT_LEGACY;
+    hdr->header_size = sizeof(size_t);
+    hdr->granularity = BLK_SIZE;
+    hdr->random_size_bytes = 0;
+    hdr->flags = 0;
+    hdr->codec = SFS_CODEC_NONE;
+    hdr->shard_offset = 0;
+    hdr->shard_index = 0;
+    hdr->shard_count = 1;
+}
+
+
+size_t sfs_header_write(FILE *dfp, const sfs_header_t *hdr) {
+    // Legacy streams only start with the random buffer size
+    if(hdr->version == SFS_FORMAT_LEGACY) {
+        if(fwrite(&hdr->random_size_bytes, sizeof(size_t), 1, dfp) != 1)
+            return 0;
+        return sizeof(size_t);
+    }
+    if(fwrite(hdr, hdr->header_size, 1, dfp) != 1)
+        return 0;
+    return hdr->header_size;
+}
+
+
+size_t sfs_header_read(FILE *sfp, sfs_header_t *hdr) {
+    size_t first, known, skip;
+    char c;
+
+    sfs_header_init(hdr);
+    if(fread(&first, sizeof(size_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read stream header\n");
+        return 0;
+    }
+    if(first != SFS_MAGIC) {
+        hdr->random_size_bytes = first;
+    }
+    else {
+        if(fread(&hdr->version, sizeof(size_t), 2, sfp) != 2) {
+            fprintf(stderr, "Unable to read stream header\n");
+            return 0;
+        }
+        if(hdr->version != SFS_FORMAT_VERSION) {
+            fprintf(stderr, "Unsupported stream format version %li\n", hdr->version);
+            return 0;
+        }
+        if(hdr->header_size < SFS_HEADER_MIN_SIZE) {
+            fprintf(stderr, "Unconsistent data: header size %li\n", hdr->header_size);
+            return 0;
+        }
+        known = hdr->header_size < sizeof(sfs_header_t) ? hdr->header_size : sizeof(sfs_header_t);
+        if(fread(&hdr->granularity, known - 3 * sizeof(size_t), 1, sfp) != 1) {
+            fprintf(stderr, "Unable to read stream header\n");
+            return 0;
+        }
+        // Skip the fields added after this reader was written
+        for(skip = hdr->header_size - known; skip > 0; skip--) {
+            if(fread(&c, 1, 1, sfp) != 1) {
+                fprintf(stderr, "Unable to read stream header\n");
+                return 0;
+            }
+        }
+        if(hdr->flags & ~((size_t) SFS_FLAGS_KNOWN)) {
+            fprintf(stderr, "Unsupported stream features (flags 0x%lx)\n", hdr->flags);
+            return 0;
+        }
+        if((hdr->flags & (SFS_FLAG_DEDUP | SFS_FLAG_BASE)) && !(hdr->flags & SFS_FLAG_TYPED_RANGES)) {
+            fprintf(stderr, "Unconsistent data: deduplicated or incremental stream without typed ranges\n");
+            return 0;
+        }
+        if((hdr->flags & SFS_FLAG_SHARD) && (hdr->header_size < sizeof(sfs_header_t) ||
+                                             hdr->shard_index >= hdr->shard_count)) {
+            fprintf(stderr, "Unconsistent data: shard %li of %li\n", hdr->shard_index, hdr->shard_count);
+            return 0;
+        }
+        if(!(hdr->flags & SFS_FLAG_CODEC) != (hdr->codec == SFS_CODEC_NONE)) {
+            fprintf(stderr, "Unconsistent data: codec %li\n", hdr->codec);
+            return 0;
+        }
+        if((hdr->flags & SFS_FLAG_CODEC) && !sfs_codec_available(hdr->codec)) {
+            fprintf(stderr, "Stream compressed with %s, which this build does not support\n",
+                    sfs_codec_name(hdr->codec));
+            return 0;
+        }
+    }
+
+    if(hdr->random_size_bytes > MAX_RANDOM_BUFFER_SIZE) {
+        fprintf(stderr, "Unconsistent data: random buffer size %li\n", hdr->random_size_bytes);
+        return 0;
+    }
+    if(hdr->granularity < MIN_GRANULARITY || hdr->granularity > MAX_GRANULARITY ||
+       (hdr->granularity & (hdr->granularity - 1)) != 0) {
+        fprintf(stderr, "Unconsistent data: granularity %li\n", hdr->granularity);
+        return 0;
+    }
+    return hdr->header_size;
+}
+
+
 void close_all_files(int fp_number, ...) {
     va_list valist;
     int i;
@@ -77,3 +181,78 @@ void free_all_mem(int voidp_number, ...) {
     }
     va_end(valist);
 }
+
+
+const char *sfs_strerror(int rc) {
+    switch(rc) {
+        case SFS_OK:
+            return "success";
+        case SFS_ERR_IO:
+            return "I/O error";
+        case SFS_ERR_NOMEM:
+            return "out of memory";
+        case SFS_ERR_FORMAT:
+            return "invalid stream";
+        case SFS_ERR_ARG:
+            return "invalid argument";
+        default:
+            return "unknown error";
+    }
+}
+
+
+typedef struct sfs_callbacks {
+    void *ctx;
+    sfs_read_cb_t read;
+    sfs_write_cb_t write;
+} sfs_callbacks_t;
+
+
+static ssize_t callbacks_read(void *cookie, char *buf, size_t len) {
+    sfs_callbacks_t *cb = (sfs_callbacks_t *) cookie;
+
+    return cb->read(cb->ctx, buf, len);
+}
+
+
+static ssize_t callbacks_write(void *cookie, const char *buf, size_t len) {
+    sfs_callbacks_t *cb = (sfs_callbacks_t *) cookie;
+    ssize_t wb;
+    size_t done;
+
+    // stdio expects the whole buffer written, or a failure
+    for(done=0; done<len; done+=wb) {
+        wb = cb->write(cb->ctx, buf + done, len - done);
+        if(wb <= 0)
+            return done > 0 ? (ssize_t) done : -1;
+    }
+    return done;
+}
+
+
+static int callbacks_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+
+FILE *sfs_fopen_callbacks(void *ctx, sfs_read_cb_t read, sfs_write_cb_t write) {
+    cookie_io_functions_t io = {NULL, NULL, NULL, callbacks_close};
+    sfs_callbacks_t *cb;
+    FILE *fp;
+
+    cb = malloc(sizeof(sfs_callbacks_t));
+    if(cb == NULL)
+        return NULL;
+    cb->ctx = ctx;
+    cb->read = read;
+    cb->write = write;
+    if(read != NULL)
+        io.read = callbacks_read;
+    if(write != NULL)
+        io.write = callbacks_write;
+    fp = fopencookie(cb, read != NULL ? (write != NULL ? "r+" : "r") : "w", io);
+    if(fp == NULL)
+        free(cb);
+    return fp;
+}
@@ -0,0 +1,450 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <block.h>
+#include <decoder.h>
+#include <dst.h>
+#include <index.h>
+#include <prefetch.h>
+#include <restore.h>
+#include <sfs.h>
+#include <stats.h>
+
+#define VERIFY_INFLIGHT_BLOCKS 8
+
+
+void sfs_decoder_opts_init(sfs_decoder_opts_t *opts) {
+    memset(opts, 0, sizeof(sfs_decoder_opts_t));
+    opts->inflight = DEFAULT_INFLIGHT_BLOCKS;
+    opts->win.end = (size_t) -1;
+}
+
+
+int sfs_decoder_open(sfs_decoder_t *dec, const sfs_decoder_opts_t *opts, FILE *sfp, const char *dst_path) {
+    struct stat st;
+    size_t rb;
+
+    memset(dec, 0, sizeof(sfs_decoder_t));
+    dec->dst.fd = -1;
+    dec->opts = *opts;
+    dec->sfp = sfp;
+    dec->dst_path = dst_path;
+
+    // Pipes are read unbuffered, so that the data of boundaries first streams can be spliced
+    // from them: nothing is left behind in the stdio buffer
+    dec->piped = fstat(fileno(sfp), &st) == 0 && S_ISFIFO(st.st_mode);
+    if(dec->piped)
+        setvbuf(sfp, NULL, _IONBF, 0);
+
+    // The destination is not truncated if it already exists
+    if(sfs_dst_open(&dec->dst, dst_path, opts->uring_depth, opts->merge_size) != 0) {
+        fprintf(stderr, "Unable to open destination file for writing\n");
+        return SFS_ERR_IO;
+    }
+    if(dec->dst.uring)
+        fprintf(stderr, "Writing through io_uring, queue depth %u\n", opts->uring_depth);
+    dec->dst.stats = opts->stats;
+    dec->dst.diff = opts->diff;
+
+    // First: read the stream header, telling whether the random buffer in every atomic block
+    // is activated or not and the granularity used
+    rb = sfs_header_read(sfp, &dec->hdr);
+    if(rb == 0) {
+        fprintf(stderr, "Unable to read stream header from source \n");
+        return SFS_ERR_FORMAT;
+    }
+    dec->total_read += rb;
+    sfs_stats_add(opts->stats, SFS_STAT_READ, rb);
+    if(dec->hdr.granularity != BLK_SIZE)
+        fprintf(stderr, "Stream granularity %li\n", dec->hdr.granularity);
+
+    // Back-references may point anywhere before the range
+    if(opts->ranged && (dec->hdr.flags & SFS_FLAG_DEDUP)) {
+        fprintf(stderr, "Ranges of deduplicated streams cannot be restored on their own\n");
+        return SFS_ERR_ARG;
+    }
+
+    // Unchanged ranges are left as they are on the destination
+    if((dec->hdr.flags & SFS_FLAG_BASE) && !opts->onto_base) {
+        fprintf(stderr, "Incremental stream: restore it with --onto-base, on a destination holding its base image\n");
+        return SFS_ERR_ARG;
+    }
+    if(opts->ranged && (dec->hdr.flags & SFS_FLAG_BASE)) {
+        fprintf(stderr, "Ranges of incremental streams cannot be restored\n");
+        return SFS_ERR_ARG;
+    }
+
+    // Every shard is restored on its own, where it starts on the source
+    if(dec->hdr.flags & SFS_FLAG_SHARD) {
+        if(opts->ranged) {
+            fprintf(stderr, "Ranges of shards cannot be restored\n");
+            return SFS_ERR_ARG;
+        }
+        fprintf(stderr, "Shard %li of %li, restored from offset %li on\n", dec->hdr.shard_index + 1,
+                dec->hdr.shard_count, dec->hdr.shard_offset);
+        dec->dst.base = dec->hdr.shard_offset;
+    }
+
+    // Parallel restores need to seek to every block and copies need the blocks before them
+    dec->seekable = opts->src_path != NULL && fseeko(sfp, 0, SEEK_CUR) == 0;
+    if(dec->opts.jobs > 0 && !dec->seekable) {
+        fprintf(stderr, "WARNING: source is not seekable, restoring it sequentially\n");
+        dec->opts.jobs = 0;
+    }
+    if(dec->opts.jobs > 0 && (dec->hdr.flags & SFS_FLAG_DEDUP)) {
+        fprintf(stderr, "WARNING: deduplicated streams cannot be restored in parallel, restoring sequentially\n");
+        dec->opts.jobs = 0;
+    }
+
+    // Compressed blocks can only be decompressed whole
+    dec->streamed = (dec->hdr.flags & SFS_FLAG_BOUNDARIES_FIRST) && !(dec->hdr.flags & SFS_FLAG_CODEC) &&
+                    dec->opts.jobs == 0;
+    if(dec->streamed)
+        fprintf(stderr, "Boundaries first stream: restoring data as it comes%s\n",
+                dec->piped && !dec->opts.diff && !(dec->hdr.flags & SFS_FLAG_CHECKSUM) ?
+                ", spliced from the pipe" : "");
+
+    // The footer is known from the index (built from the block metadata when missing
+    // for a parallel restore)
+    if(dec->opts.jobs > 0 || (opts->ranged && (dec->hdr.flags & SFS_FLAG_INDEX) && dec->seekable)) {
+        dec->footp = malloc(sizeof(sfs_footer_t));
+        if(dec->footp == NULL || sfs_index_open(sfp, &dec->hdr, rb, &dec->idx, dec->footp) != 0) {
+            fprintf(stderr, "Unable to load the block index\n");
+            return SFS_ERR_FORMAT;
+        }
+    }
+    return SFS_OK;
+}
+
+
+// Restore the blocks on jobs threads, the footer being known from the index
+static int decoder_run_parallel(sfs_decoder_t *dec, size_t *cursor, int *stopped) {
+    const sfs_index_t *idx = &dec->idx;
+    size_t first, last;
+
+    fprintf(stderr, "Restoring %li atomic blocks with %i jobs\n", idx->n, dec->opts.jobs);
+    if(sfs_restore_parallel(dec->opts.src_path, dec->dst_path, &dec->hdr, idx, &dec->opts.win, dec->opts.jobs,
+                            dec->opts.uring_depth, dec->opts.merge_size, dec->opts.diff, dec->opts.stats) != 0) {
+        fprintf(stderr, "Unable to restore atomic blocks\n");
+        return SFS_ERR_IO;
+    }
+    // Last restored block: the range may end before the last one
+    first = sfs_index_find(idx, dec->opts.win.start);
+    for(last=first; last<idx->n && idx->entries[last].offset < dec->opts.win.end; last++);
+    if(last > 0)
+        *cursor = idx->entries[last-1].offset + idx->entries[last-1].len;
+    dec->atomic_blocks = idx->n;
+    *stopped = last < idx->n;
+    return SFS_OK;
+}
+
+
+// Restore the blocks in order, as they are read
+static int decoder_run_sequential(sfs_decoder_t *dec, size_t *cursor, int *stopped) {
+    const sfs_index_t *idx = &dec->idx;
+    const sfs_window_t *win = &dec->opts.win;
+    sfs_stats_t *stats = dec->opts.stats;
+    sfs_block_t *blk = NULL;
+    size_t first;
+    u_int64_t start;
+    int end, rc;
+
+    // Seek straight to the first block of the range. Streams read from a pipe are read
+    // up to the range instead
+    if(dec->footp != NULL) {
+        first = sfs_index_find(idx, win->start);
+        if(first < idx->n)
+            *cursor = idx->entries[first].offset;
+        else if(idx->n > 0)
+            *cursor = idx->entries[idx->n-1].offset + idx->entries[idx->n-1].len;
+        if(fseeko(dec->sfp, first < idx->n ? idx->entries[first].stream_offset : idx->blocks_end, SEEK_SET) != 0) {
+            fprintf(stderr, "Unable to seek to the first block of the range\n");
+            return SFS_ERR_IO;
+        }
+        fprintf(stderr, "Restoring [%li, %li[ from atomic block %li on\n", win->start, win->end, first);
+    }
+    else if(dec->opts.ranged) {
+        fprintf(stderr, "WARNING: no block index in the stream or not seekable, reading it up to the range\n");
+    }
+
+    // The data of boundaries first streams is restored as it is read, in small chunks,
+    // whatever the atomic block size
+    if(dec->streamed) {
+        // Spliced data could not be compared with the destination
+        rc = sfs_restore_stream(dec->sfp, &dec->dst, &dec->hdr, cursor, win, dec->piped && !dec->opts.diff,
+                                &dec->atomic_blocks, &dec->total_read);
+        if(rc == BLOCK_ERROR) {
+            fprintf(stderr, "Unable to restore atomic blocks\n");
+            return SFS_ERR_IO;
+        }
+        *stopped = rc == BLOCK_OK;
+        return SFS_OK;
+    }
+
+    // Atomic blocks are read (and prefetched) by the prefetcher, one being restored
+    // while the next ones are downloaded
+    if(sfs_prefetch_start(&dec->pf, dec->sfp, &dec->hdr, dec->opts.inflight) != 0) {
+        fprintf(stderr, "Unable to setup atomic block reading\n");
+        return SFS_ERR_NOMEM;
+    }
+    // Read atomic blocks one by one
+    for(;;) {
+        start = sfs_stats_start(stats);
+        blk = sfs_prefetch_next(&dec->pf, &end);
+        sfs_stats_time(stats, SFS_STAT_READ_NS, start);
+        if(blk == NULL)
+            break;
+        dec->atomic_blocks++;
+        sfs_stats_add(stats, SFS_STAT_READ, blk->stream_bytes);
+        sfs_stats_block(stats, blk->size);
+        if(sfs_restore_block(&dec->dst, &dec->hdr, blk, cursor, win) != 0)
+            return SFS_ERR_IO;
+
+        // The rest of the stream is out of the range
+        if(*cursor >= win->end)
+            break;
+    }
+
+    // Stopped at the end of the range: the rest of the stream and its footer are not read
+    *stopped = dec->opts.ranged && blk != NULL;
+    if(!end && !*stopped) {
+        fprintf(stderr, "Unable to read atomic block from source\n");
+        return SFS_ERR_FORMAT;
+    }
+    dec->total_read += dec->pf.total_read;
+    return SFS_OK;
+}
+
+
+// Check what was restored against the footer
+static int decoder_check_footer(sfs_decoder_t *dec, int stopped) {
+    const sfs_footer_t *footp = dec->footp;
+
+    // Only a whole stream read sequentially can be checked against the footer
+    if(!dec->opts.ranged && dec->opts.jobs == 0) {
+        fprintf(stderr, "Check footer info consistency\n");
+
+        fprintf(stderr, "total read %li\n", dec->total_read);
+        fprintf(stderr, "Inflated %li\n", dec->inflated);
+
+        if(footp->written != dec->total_read) {
+            fprintf(stderr, "Unconsistent data: footer info (%li) differs from what was really read (%li)\n",
+                    footp->written, dec->total_read);
+            return SFS_ERR_FORMAT;
+        }
+
+        if(footp->atomic_blocks != dec->atomic_blocks)
+        {
+            fprintf(stderr, "Unconsistent data: footer atomic blocks (%li) differs from reality (%li)\n",
+                    footp->atomic_blocks, dec->atomic_blocks);
+            return SFS_ERR_FORMAT;
+        }
+    }
+
+    // If footp->read < inflated then it means that we have some unconsistency between the footer and the offsets array
+    if(!stopped && footp->read < dec->inflated) {
+        /* Note(rg): if we created a header per atomic block instead of a final footer, this would deteriorate
+         * the compression ratio and the inflate overall performances, but this would allow to control the inflated
+         * size more quickly, not only at the very end (resource exhaustion protection)
+         */
+        fprintf(stderr,
+                "Unconsistent data: inflated volume (%li) bigger than what is reported in footer (%li)\n",
+                dec->inflated, footp->read
+        );
+        return SFS_ERR_FORMAT;
+    }
+    return SFS_OK;
+}
+
+
+int sfs_decoder_run(sfs_decoder_t *dec) {
+    const sfs_window_t *win = &dec->opts.win;
+    size_t cursor = 0, off, len, data_seek, rb;
+    off_t end_cursor;
+    int stopped, rc;
+
+    if(dec->opts.jobs > 0)
+        rc = decoder_run_parallel(dec, &cursor, &stopped);
+    else
+        rc = decoder_run_sequential(dec, &cursor, &stopped);
+    sfs_index_free(&dec->idx);
+    if(rc != SFS_OK)
+        return rc;
+    dec->inflated = cursor;
+
+    // The footer of an indexed range or of a parallel restore is already known
+    if(!stopped && dec->footp == NULL) {
+        // The block index, if any, is between the blocks and the footer
+        if(dec->hdr.flags & SFS_FLAG_INDEX) {
+            rb = sfs_index_skip(dec->sfp, dec->atomic_blocks);
+            if(rb == 0) {
+                fprintf(stderr, "Unable to read block index\n");
+                return SFS_ERR_FORMAT;
+            }
+            dec->total_read += rb;
+        }
+
+        fprintf(stderr, "All non-zero data written. Extracting final footer\n");
+
+        dec->footp = extract_footer(dec->sfp, 1);
+        if(dec->footp == NULL) {
+            fprintf(stderr,
+                    "Unable to extract footer correctly\n");
+            return SFS_ERR_FORMAT;
+        }
+        dec->total_read += sizeof(sfs_footer_t);
+    }
+
+    rc = decoder_check_footer(dec, stopped);
+    if(rc != SFS_OK)
+        return rc;
+
+    data_seek = stopped ? 0 : dec->footp->read - dec->inflated;
+
+    // This trick is to make sure the final inflated file is at least as big as the source one
+    // in the specific case when the source files ends with zeros: the very last bytes are written
+    if(data_seek > 0)
+        fprintf(stderr, "Remaining number of zeros to write: %li bytes\n", data_seek);
+    off = cursor;
+    len = data_seek;
+    sfs_window_clip(win, &off, &len);
+    sfs_stats_add(dec->opts.stats, SFS_STAT_STRIPPED, len);
+    // Destination size
+    cursor += data_seek;
+    if(cursor > win->end)
+        cursor = win->end;
+    cursor = cursor > win->start ? cursor - win->start : 0;
+    if(sfs_dst_zero(&dec->dst, off, len) != 0 || sfs_dst_finish(&dec->dst, cursor) != 0) {
+        fprintf(stderr, "Unable to write end of file\n");
+        return SFS_ERR_IO;
+    }
+
+    fprintf(stderr, "All data written. Zeroing any left space in file if any\n");
+
+    end_cursor = sfs_dst_size(&dec->dst);
+    if(end_cursor == -1) {
+        fprintf(stderr, "Unable to get current position on destination\n");
+        return SFS_ERR_IO;
+    }
+
+    // An empty shard writes nothing, the destination may end before it starts
+    if(cursor > 0 && (size_t) end_cursor < cursor + dec->hdr.shard_offset) {
+        fprintf(stderr, "WARNING: dst file was smaller than source, "
+                "%li zeros could not be written. Ignoring.\n",
+                cursor + dec->hdr.shard_offset - end_cursor);
+    }
+    return SFS_OK;
+}
+
+
+void sfs_decoder_close(sfs_decoder_t *dec) {
+    sfs_dst_close(&dec->dst);
+    sfs_prefetch_stop(&dec->pf);
+    sfs_index_free(&dec->idx);
+    free_all_mem(1, (void *) dec->footp);
+    dec->footp = NULL;
+}
+
+
+// The checks of a restore, without writing anything
+static int verify_block(const sfs_block_t *blk, size_t *cursor) {
+    const sfs_typed_range_t *typed;
+    size_t i, t = 0, data = 0;
+
+    for(i=0; i<blk->meta_idx; i+=2) {
+        typed = (t < blk->ntyped && blk->typed[t].slot == i) ? &blk->typed[t++] : NULL;
+        if(typed != NULL && typed->kind == SFS_RANGE_COPY && typed->arg + blk->boundaries[i] > *cursor) {
+            fprintf(stderr, "Unconsistent data: copy of [%li, %li[ at offset %li, not restored yet\n",
+                    typed->arg, typed->arg + blk->boundaries[i], *cursor);
+            return -1;
+        }
+        *cursor += blk->boundaries[i] + blk->boundaries[i+1];
+        data += blk->boundaries[i+1];
+    }
+    if(data != blk->size) {
+        fprintf(stderr, "Unconsistent data: atomic read (%li) differs from expected (%li)\n",
+                data, blk->size);
+        return -1;
+    }
+    return 0;
+}
+
+
+int sfs_decoder_verify(FILE *sfp, const sfs_footer_t *footerp) {
+    sfs_header_t hdr;
+    sfs_prefetch_t pf;
+    sfs_block_t *blk;
+    sfs_footer_t *footp;
+    size_t rb, total_read, atomic_blocks = 0, inflated = 0;
+    int end, rc = SFS_ERR_FORMAT;
+
+    memset(&pf, 0, sizeof(sfs_prefetch_t));
+    rb = sfs_header_read(sfp, &hdr);
+    if(rb == 0)
+        return SFS_ERR_FORMAT;
+    total_read = rb;
+    if(!(hdr.flags & SFS_FLAG_CHECKSUM))
+        fprintf(stderr, "WARNING: no block checksums in this stream (sfsz -C), only its structure is verified\n");
+
+    if(sfs_prefetch_start(&pf, sfp, &hdr, VERIFY_INFLIGHT_BLOCKS) != 0)
+        return SFS_ERR_NOMEM;
+    while((blk = sfs_prefetch_next(&pf, &end)) != NULL) {
+        if(verify_block(blk, &inflated) != 0) {
+            fprintf(stderr, "Atomic block %li is corrupted\n", atomic_blocks);
+            sfs_prefetch_stop(&pf);
+            return SFS_ERR_FORMAT;
+        }
+        atomic_blocks++;
+    }
+    total_read += pf.total_read;
+    sfs_prefetch_stop(&pf);
+    if(!end) {
+        fprintf(stderr, "Atomic block %li is corrupted\n", atomic_blocks);
+        return SFS_ERR_FORMAT;
+    }
+
+    if(hdr.flags & SFS_FLAG_INDEX) {
+        rb = sfs_index_skip(sfp, atomic_blocks);
+        if(rb == 0)
+            return SFS_ERR_FORMAT;
+        total_read += rb;
+    }
+    footp = extract_footer(sfp, 1);
+    if(footp == NULL)
+        return SFS_ERR_FORMAT;
+    total_read += sizeof(sfs_footer_t);
+
+    if(footp->written != total_read || footp->written != footerp->written)
+        fprintf(stderr, "Unconsistent data: footer info (%li) differs from what was really read (%li)\n",
+                footp->written, total_read);
+    else if(footp->atomic_blocks != atomic_blocks)
+        fprintf(stderr, "Unconsistent data: footer atomic blocks (%li) differs from reality (%li)\n",
+                footp->atomic_blocks, atomic_blocks);
+    else if(footp->read < inflated)
+        fprintf(stderr, "Unconsistent data: inflated volume (%li) bigger than what is reported in footer (%li)\n",
+                inflated, footp->read);
+    else
+        rc = SFS_OK;
+    free(footp);
+    return rc;
+}
@@ -0,0 +1,895 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <dst.h>
+#include <hash.h>
+#include <zeroscan.h>
+
+#define PUNCH_MODE  (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)
+#define ZERO_MODE   (FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE)
+
+static const char *zero_method_names[] = {
+    "hole punching", "zero range", "BLKZEROOUT", "zero writes"
+};
+
+
+static int dst_alloc_zeros(sfs_dst_t *dst) {
+    if(dst->zeros != NULL)
+        return 0;
+    // Slack for writes resumed in the middle of a pattern word
+    dst->zeros = calloc(DST_ZERO_BUF_SIZE + DST_FILL_WORD_SIZE, 1);
+    if(dst->zeros == NULL) {
+        fprintf(stderr, "Unable to allocate memory for zeroing\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Get the pattern buffer ready for word, once whatever still uses it is done
+static int dst_alloc_fill(sfs_dst_t *dst, u_int64_t word) {
+    size_t i;
+
+    if(dst->fill != NULL && dst->fill_word == word)
+        return 0;
+    if(dst->fill == NULL) {
+        dst->fill = malloc(DST_FILL_BUF_SIZE + DST_FILL_WORD_SIZE);
+        if(dst->fill == NULL) {
+            fprintf(stderr, "Unable to allocate memory for patterns\n");
+            return -1;
+        }
+    }
+    else if(sfs_dst_drain(dst) != 0) {
+        return -1;
+    }
+    for(i=0; i<DST_FILL_BUF_SIZE + DST_FILL_WORD_SIZE; i+=DST_FILL_WORD_SIZE)
+        memcpy(dst->fill + i, &word, DST_FILL_WORD_SIZE);
+    dst->fill_word = word;
+    return 0;
+}
+
+
+// First method after the given one applying to the destination
+static int dst_next_zero_method(sfs_dst_t *dst, int method) {
+    for(method++; method < DST_ZERO_WRITE; method++) {
+        if(method == DST_ZERO_BLKZEROOUT && !dst->info.block_device)
+            continue;
+        break;
+    }
+    return method;
+}
+
+
+/* The given method failed on a range: move the destination on to the next one.
+ * Ranges in flight may fail with the same method, only the first one does it.
+ * Returns -1 if the zero buffer needed by the next method cannot be allocated
+ */
+static int dst_zero_failed(sfs_dst_t *dst, int method, off_t off, size_t len, int err) {
+    int next;
+
+    if(method != dst->info.zero_method)
+        return 0;
+    next = dst_next_zero_method(dst, method);
+    fprintf(stderr, "WARNING: %s failed on range [%li, %li[ (%s). Falling back on %s%s\n",
+            zero_method_names[method], off, off + len, strerror(err), zero_method_names[next],
+            next == DST_ZERO_WRITE ? ", perf will be degraded" : "");
+    dst->info.zero_method = next;
+    sfs_stats_add(dst->stats, SFS_STAT_ZERO_FALLBACKS, 1);
+    if(next == DST_ZERO_WRITE)
+        return dst_alloc_zeros(dst);
+    return 0;
+}
+
+
+/* With fill_size > 0, buf is a zero or pattern buffer written over and over,
+ * at most fill_size bytes at once
+ */
+static int dst_pwrite(sfs_dst_t *dst, off_t off, const char *buf, size_t len, size_t fill_size) {
+    ssize_t wb;
+    size_t n, phase = 0;
+    u_int64_t start;
+
+    while(len > 0) {
+        n = fill_size > 0 && len > fill_size ? fill_size : len;
+        start = sfs_stats_start(dst->stats);
+        wb = pwrite(dst->fd, buf + phase, n, off);
+        sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+        if(wb < 0 && errno == EINTR)
+            continue;
+        if(wb <= 0) {
+            fprintf(stderr, "Unable to write %li bytes at offset %li on destination: %s\n",
+                    n, off, wb < 0 ? strerror(errno) : "no space left");
+            return -1;
+        }
+        off += wb;
+        len -= wb;
+        if(fill_size > 0)
+            phase = (phase + wb) % DST_FILL_WORD_SIZE;
+        else
+            buf += wb;
+    }
+    return 0;
+}
+
+
+// Move an iovec array forward by n written bytes
+static void dst_iov_advance(struct iovec *iov, int *idx, size_t n) {
+    while(n > 0) {
+        if(n >= iov[*idx].iov_len) {
+            n -= iov[*idx].iov_len;
+            (*idx)++;
+        }
+        else {
+            iov[*idx].iov_base = (char *) iov[*idx].iov_base + n;
+            iov[*idx].iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+
+static int dst_pwritev(sfs_dst_t *dst, off_t off, struct iovec *iov, int niov, size_t len) {
+    ssize_t wb;
+    int idx = 0;
+    u_int64_t start;
+
+    while(len > 0) {
+        start = sfs_stats_start(dst->stats);
+        wb = pwritev(dst->fd, iov + idx, niov - idx, off);
+        sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+        if(wb < 0 && errno == EINTR)
+            continue;
+        if(wb <= 0) {
+            fprintf(stderr, "Unable to write %li bytes at offset %li on destination: %s\n",
+                    len, off, wb < 0 ? strerror(errno) : "no space left");
+            return -1;
+        }
+        off += wb;
+        len -= wb;
+        dst_iov_advance(iov, &idx, wb);
+    }
+    return 0;
+}
+
+
+// Zero a range synchronously, moving down the methods until one works
+static int dst_zero_sync(sfs_dst_t *dst, off_t off, size_t len) {
+    u_int64_t range[2] = {off, len};
+    u_int64_t start;
+    int method, rc = 0;
+
+    for(;;) {
+        method = dst->info.zero_method;
+        start = sfs_stats_start(dst->stats);
+        switch(method) {
+            case DST_ZERO_PUNCH:
+                rc = fallocate(dst->fd, PUNCH_MODE, off, len);
+                break;
+            case DST_ZERO_RANGE:
+                rc = fallocate(dst->fd, ZERO_MODE, off, len);
+                break;
+            case DST_ZERO_BLKZEROOUT:
+                rc = ioctl(dst->fd, BLKZEROOUT, range);
+                break;
+            default:
+                sfs_stats_add(dst->stats, SFS_STAT_ZERO_WRITTEN, len);
+                return dst_pwrite(dst, off, dst->zeros, len, DST_ZERO_BUF_SIZE);
+        }
+        sfs_stats_zero(dst->stats, method, start);
+        sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+        if(rc == 0)
+            return 0;
+        if(errno == EINTR)
+            continue;
+        if(dst_zero_failed(dst, method, off, len, errno) != 0)
+            return -1;
+    }
+}
+
+
+// Prepare the next submission of an operation. There is always room in the ring for it
+static void dst_op_prep(sfs_dst_t *dst, unsigned idx) {
+    dst_op_t *op = &dst->ops[idx];
+    struct io_uring_sqe *sqe = sfs_uring_get_sqe(&dst->ring);
+
+    sqe->fd = dst->fd;
+    sqe->off = op->off;
+    sqe->user_data = idx;
+    if(op->kind == DST_OP_FALLOCATE) {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = op->len;
+        sqe->len = (op->method == DST_ZERO_PUNCH) ? PUNCH_MODE : ZERO_MODE;
+        op->submitted = op->len;
+        op->issued = sfs_stats_start(dst->stats);
+    }
+    else if(op->kind == DST_OP_WRITE) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (unsigned long) (op->iov + op->iov_idx);
+        sqe->len = op->niov - op->iov_idx;
+        op->submitted = op->len;
+    }
+    else {
+        op->submitted = op->len < op->fill_size ? op->len : op->fill_size;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (unsigned long) (op->buf + op->phase);
+        sqe->len = op->submitted;
+    }
+}
+
+
+// Handle a completion: the operation is either done or resubmitted for what remains
+static void dst_op_complete(sfs_dst_t *dst, struct io_uring_cqe *cqe) {
+    unsigned idx = cqe->user_data;
+    dst_op_t *op = &dst->ops[idx];
+
+    if(cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        dst_op_prep(dst, idx);
+        return;
+    }
+
+    if(op->kind == DST_OP_FALLOCATE) {
+        // Queued zeroings are timed from their submission to their completion being reaped
+        sfs_stats_zero(dst->stats, op->method, op->issued);
+        if(cqe->res < 0) {
+            // Zero the range again with the next method
+            if(dst_zero_failed(dst, op->method, op->off, op->len, -cqe->res) != 0) {
+                dst->error = 1;
+            }
+            else if(dst->info.zero_method <= DST_ZERO_RANGE) {
+                op->method = dst->info.zero_method;
+                dst_op_prep(dst, idx);
+                return;
+            }
+            else if(dst->info.zero_method == DST_ZERO_WRITE) {
+                sfs_stats_add(dst->stats, SFS_STAT_ZERO_WRITTEN, op->len);
+                op->kind = DST_OP_FILL;
+                op->buf = dst->zeros;
+                op->fill_size = DST_ZERO_BUF_SIZE;
+                op->phase = 0;
+                dst_op_prep(dst, idx);
+                return;
+            }
+            // Block device ioctls cannot be queued
+            else if(dst_zero_sync(dst, op->off, op->len) != 0) {
+                dst->error = 1;
+            }
+        }
+    }
+    else if(cqe->res <= 0) {
+        fprintf(stderr, "Unable to write %li bytes at offset %li on destination: %s\n",
+                op->submitted, op->off, cqe->res < 0 ? strerror(-cqe->res) : "no space left");
+        dst->error = 1;
+    }
+    else {
+        // Short writes are resubmitted for the remaining part
+        op->off += cqe->res;
+        op->len -= cqe->res;
+        if(op->kind == DST_OP_WRITE)
+            dst_iov_advance(op->iov, &op->iov_idx, cqe->res);
+        else
+            op->phase = (op->phase + cqe->res) % DST_FILL_WORD_SIZE;
+        if(op->len > 0) {
+            dst_op_prep(dst, idx);
+            return;
+        }
+    }
+    dst->free_ops[dst->nfree++] = idx;
+}
+
+
+// Get a free operation slot, waiting for in-flight ones to complete if needed
+static int dst_op_get(sfs_dst_t *dst, unsigned *idx) {
+    struct io_uring_cqe cqe;
+    u_int64_t start;
+
+    while(dst->nfree == 0) {
+        start = sfs_stats_start(dst->stats);
+        if(sfs_uring_wait(&dst->ring, &cqe) != 0)
+            return -1;
+        sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+        dst_op_complete(dst, &cqe);
+    }
+    *idx = dst->free_ops[--dst->nfree];
+    return dst->error ? -1 : 0;
+}
+
+
+static int dst_queue(sfs_dst_t *dst, off_t off, const char *buf, size_t len, int kind, int method,
+                     size_t fill_size) {
+    unsigned idx;
+
+    if(dst_op_get(dst, &idx) != 0) {
+        dst->error = 1;
+        return -1;
+    }
+    dst->ops[idx].off = off;
+    dst->ops[idx].buf = buf;
+    dst->ops[idx].len = len;
+    dst->ops[idx].kind = kind;
+    dst->ops[idx].method = method;
+    dst->ops[idx].fill_size = fill_size;
+    dst->ops[idx].phase = 0;
+    dst_op_prep(dst, idx);
+    return 0;
+}
+
+
+// Read a number from the sysfs directory of a block device, 0 if it is missing
+static unsigned long dst_sysfs_read(dev_t dev, const char *attr) {
+    char path[128];
+    unsigned long value = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), attr);
+    f = fopen(path, "r");
+    if(f == NULL)
+        return 0;
+    if(fscanf(f, "%lu", &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
+
+
+/* Aligned offsets given the discard granularity and alignment: the device reports the
+ * offset of its first aligned boundary, aligned offsets being granularity * k + alignment
+ */
+static void dst_set_discard(sfs_dst_t *dst, unsigned long granularity, unsigned long alignment) {
+    dst->info.zero_align = granularity;
+    dst->info.zero_shift = (granularity - alignment % granularity) % granularity;
+}
+
+
+// Alignment of the ranges given to the zeroing methods, see dst_info_t
+static void dst_init_zero_align(sfs_dst_t *dst, const struct stat *st) {
+    struct statfs sfs;
+    unsigned long granularity, alignment;
+    int sector_size;
+    char *forced = getenv("SFS_DISCARD");
+
+    dst->info.zero_align = 1;
+    dst->info.zero_shift = 0;
+    if(forced != NULL && *forced != '\0') {
+        if(sscanf(forced, "%lu:%lu", &granularity, &alignment) == 2 && granularity > 0 &&
+           granularity <= DST_MAX_ZERO_ALIGN) {
+            dst_set_discard(dst, granularity, alignment);
+            return;
+        }
+        fprintf(stderr, "WARNING: SFS_DISCARD must be granularity:alignment. Ignoring\n");
+    }
+    if(!dst->info.block_device) {
+        if(fstatfs(dst->fd, &sfs) == 0 && sfs.f_bsize > 0 && sfs.f_bsize <= DST_MAX_ZERO_ALIGN &&
+           (sfs.f_bsize & (sfs.f_bsize - 1)) == 0)
+            dst->info.zero_align = sfs.f_bsize;
+        return;
+    }
+
+    if(ioctl(dst->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+        dst->info.zero_align = sector_size;
+    // Partitions have no queue of their own
+    granularity = dst_sysfs_read(st->st_rdev, "queue/discard_granularity");
+    if(granularity == 0)
+        granularity = dst_sysfs_read(st->st_rdev, "../queue/discard_granularity");
+    if(granularity <= dst->info.zero_align || granularity > DST_MAX_ZERO_ALIGN ||
+       granularity % dst->info.zero_align != 0)
+        return;
+    alignment = dst_sysfs_read(st->st_rdev, "discard_alignment");
+    dst_set_discard(dst, granularity, alignment);
+    fprintf(stderr, "Destination discard granularity %lu, alignment %lu: unaligned zeros are written\n",
+            granularity, alignment);
+}
+
+
+int sfs_dst_open(sfs_dst_t *dst, const char *path, unsigned uring_depth, size_t merge_size) {
+    struct stat st;
+    unsigned i;
+
+    memset(dst, 0, sizeof(sfs_dst_t));
+
+    // No O_TRUNC: an existing destination (typically a block device) is written over
+    dst->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(dst->fd == -1) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // We always start with hole punching, and move down the zeroing methods
+    // whenever one fails
+    dst->info.zero_method = DST_ZERO_PUNCH;
+    if(fstat(dst->fd, &st) == 0 && S_ISBLK(st.st_mode))
+        dst->info.block_device = 1;
+    dst_init_zero_align(dst, &st);
+
+    dst->merge_size = merge_size;
+    if(merge_size > 0 && dst_alloc_zeros(dst) != 0)
+        return -1;
+
+    if(uring_depth == 0)
+        return 0;
+
+    if(sfs_uring_init(&dst->ring, uring_depth) != 0) {
+        fprintf(stderr, "WARNING: io_uring is not available (%s), falling back on "
+                "synchronous writes\n", strerror(errno));
+        return 0;
+    }
+    dst->ops = calloc(uring_depth, sizeof(dst_op_t));
+    dst->free_ops = malloc(uring_depth * sizeof(unsigned));
+    if(dst->ops == NULL || dst->free_ops == NULL) {
+        fprintf(stderr, "Unable to allocate io_uring operations\n");
+        return -1;
+    }
+    for(i=0; i<uring_depth; i++)
+        dst->free_ops[i] = i;
+    dst->nfree = uring_depth;
+    dst->uring_depth = uring_depth;
+    dst->uring = 1;
+    return 0;
+}
+
+
+static void dst_write_append(sfs_dst_t *dst, off_t off, const char *buf, size_t len) {
+    if(dst->write_niov == 0)
+        dst->write_off = off;
+    dst->write_iov[dst->write_niov].iov_base = (void *) buf;
+    dst->write_iov[dst->write_niov].iov_len = len;
+    dst->write_niov++;
+    dst->write_len += len;
+}
+
+
+static int dst_issue_write(sfs_dst_t *dst) {
+    dst_op_t *op;
+    unsigned idx;
+    int rc = 0;
+
+    if(dst->write_niov == 0)
+        return 0;
+    if(!dst->uring) {
+        rc = dst_pwritev(dst, dst->write_off, dst->write_iov, dst->write_niov, dst->write_len);
+    }
+    else if(dst_op_get(dst, &idx) != 0) {
+        dst->error = 1;
+        rc = -1;
+    }
+    else {
+        op = &dst->ops[idx];
+        op->off = dst->write_off;
+        op->len = dst->write_len;
+        op->kind = DST_OP_WRITE;
+        memcpy(op->iov, dst->write_iov, dst->write_niov * sizeof(struct iovec));
+        op->iov_idx = 0;
+        op->niov = dst->write_niov;
+        dst_op_prep(dst, idx);
+    }
+    dst->write_niov = 0;
+    dst->write_len = 0;
+    return rc;
+}
+
+
+// Write len zeros at off, queued with io_uring
+static int dst_zero_write(sfs_dst_t *dst, off_t off, size_t len) {
+    if(len == 0)
+        return 0;
+    if(dst_alloc_zeros(dst) != 0)
+        return -1;
+    sfs_stats_add(dst->stats, SFS_STAT_ZERO_WRITTEN, len);
+    if(!dst->uring)
+        return dst_pwrite(dst, off, dst->zeros, len, DST_ZERO_BUF_SIZE);
+    return dst_queue(dst, off, dst->zeros, len, DST_OP_FILL, DST_ZERO_WRITE, DST_ZERO_BUF_SIZE);
+}
+
+
+// Zero [off, off+len[ with the current method
+static int dst_zero_range(sfs_dst_t *dst, off_t off, size_t len) {
+    off_t start, end;
+    size_t align = dst->info.zero_align, shift = dst->info.zero_shift;
+
+    // Misaligned ranges would fail, moving the whole restore down to a slower method, or
+    // be ignored by the device: only the aligned part is zeroed, the edges are written
+    if(dst->info.zero_method != DST_ZERO_WRITE && align > 1) {
+        start = (off + shift + align - 1) / align * align - shift;
+        end = (off + len + shift) / align * align - shift;
+        if(end <= start)
+            return dst_zero_write(dst, off, len);
+        if(dst_alloc_zeros(dst) != 0 || dst_zero_write(dst, off, start - off) != 0)
+            return -1;
+        // The last edge goes along with the data following the range
+        if(end < off + (off_t) len && dst->write_niov == 0) {
+            sfs_stats_add(dst->stats, SFS_STAT_ZERO_WRITTEN, off + len - end);
+            dst_write_append(dst, end, dst->zeros, off + len - end);
+        }
+        else if(dst_zero_write(dst, end, off + len - end) != 0) {
+            return -1;
+        }
+        off = start;
+        len = end - start;
+    }
+
+    if(!dst->uring || dst->info.zero_method == DST_ZERO_BLKZEROOUT)
+        return dst_zero_sync(dst, off, len);
+    if(dst->info.zero_method == DST_ZERO_WRITE)
+        return dst_zero_write(dst, off, len);
+    return dst_queue(dst, off, NULL, len, DST_OP_FALLOCATE, dst->info.zero_method, 0);
+}
+
+
+/* Read up to len destination bytes at off into the diff buffer, less past the end
+ * of a file. Returns the number of bytes read, -1 on failure
+ */
+static ssize_t dst_diff_read(sfs_dst_t *dst, off_t off, size_t len) {
+    ssize_t rb;
+    size_t done;
+    u_int64_t start;
+
+    if(dst->diff_buf == NULL) {
+        dst->diff_buf = malloc(DST_DIFF_BUF_SIZE);
+        if(dst->diff_buf == NULL) {
+            fprintf(stderr, "Unable to allocate memory for comparisons\n");
+            return -1;
+        }
+    }
+    start = sfs_stats_start(dst->stats);
+    for(done=0; done<len; done+=rb) {
+        rb = pread(dst->fd, dst->diff_buf + done, len - done, off + done);
+        if(rb < 0 && errno == EINTR) {
+            rb = 0;
+            continue;
+        }
+        if(rb < 0) {
+            fprintf(stderr, "Unable to read %li bytes at offset %li on destination: %s\n",
+                    len - done, off + done, strerror(errno));
+            return -1;
+        }
+        if(rb == 0)
+            break;
+    }
+    sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+    return (ssize_t) done;
+}
+
+
+// Zero the blocks of [off, off+len[ that do not read back as zeros yet
+static int dst_diff_zero(sfs_dst_t *dst, off_t off, size_t len) {
+    off_t end = off + len, data, run_off = off;
+    size_t n, i, blk, run = 0, unchanged = 0;
+    ssize_t rb;
+
+    while(off < end) {
+        // Holes of a file read back as zeros, and so does what lies after its end
+        data = dst->info.block_device ? off : lseek(dst->fd, off, SEEK_DATA);
+        if(data == -1)
+            data = errno == ENXIO ? end : off;
+        if(data > off) {
+            data = data < end ? data : end;
+            if(run > 0 && dst_zero_range(dst, run_off, run) != 0)
+                return -1;
+            run = 0;
+            unchanged += data - off;
+            off = data;
+            continue;
+        }
+
+        n = end - off < DST_DIFF_BUF_SIZE ? end - off : DST_DIFF_BUF_SIZE;
+        rb = dst_diff_read(dst, off, n);
+        if(rb < 0)
+            return -1;
+        for(i=0; i<n; i+=blk) {
+            blk = n - i < DST_DIFF_BLOCK_SIZE ? n - i : DST_DIFF_BLOCK_SIZE;
+            if(i + blk > (size_t) rb || zs_is_zero(dst->diff_buf + i, blk)) {
+                if(run > 0 && dst_zero_range(dst, run_off, run) != 0)
+                    return -1;
+                run = 0;
+                unchanged += blk;
+            }
+            else {
+                if(run == 0)
+                    run_off = off + i;
+                run += blk;
+            }
+        }
+        off += n;
+    }
+    if(run > 0 && dst_zero_range(dst, run_off, run) != 0)
+        return -1;
+    sfs_stats_add(dst->stats, SFS_STAT_UNCHANGED, unchanged);
+    return 0;
+}
+
+
+static int dst_issue_zero(sfs_dst_t *dst) {
+    off_t off = dst->zero_off;
+    size_t len = dst->zero_len;
+
+    if(len == 0)
+        return 0;
+    dst->zero_len = 0;
+    if(dst->diff)
+        return dst_diff_zero(dst, off, len);
+    return dst_zero_range(dst, off, len);
+}
+
+
+// Write buf at off (base included) along with the pending write, if contiguous
+static int dst_append(sfs_dst_t *dst, off_t off, const char *buf, size_t len) {
+    if(dst_issue_zero(dst) != 0)
+        return -1;
+    if(dst->write_niov > 0 &&
+       (off != dst->write_off + (off_t) dst->write_len || dst->write_niov == DST_MAX_IOV)) {
+        if(dst_issue_write(dst) != 0)
+            return -1;
+    }
+    dst_write_append(dst, off, buf, len);
+    return 0;
+}
+
+
+// Write the blocks of buf that differ from the destination at off (base included)
+static int dst_diff_write(sfs_dst_t *dst, off_t off, const char *buf, size_t len) {
+    size_t n, i, blk, run, unchanged = 0;
+    ssize_t rb;
+
+    while(len > 0) {
+        n = len < DST_DIFF_BUF_SIZE ? len : DST_DIFF_BUF_SIZE;
+        rb = dst_diff_read(dst, off, n);
+        if(rb < 0)
+            return -1;
+        for(run=0, i=0; i<n; i+=blk) {
+            blk = n - i < DST_DIFF_BLOCK_SIZE ? n - i : DST_DIFF_BLOCK_SIZE;
+            if(i + blk <= (size_t) rb && memcmp(buf + i, dst->diff_buf + i, blk) == 0) {
+                if(run > 0 && dst_append(dst, off + i - run, buf + i - run, run) != 0)
+                    return -1;
+                run = 0;
+                unchanged += blk;
+            }
+            else {
+                run += blk;
+            }
+        }
+        if(run > 0 && dst_append(dst, off + n - run, buf + n - run, run) != 0)
+            return -1;
+        off += n;
+        buf += n;
+        len -= n;
+    }
+    sfs_stats_add(dst->stats, SFS_STAT_UNCHANGED, unchanged);
+    return 0;
+}
+
+
+int sfs_dst_write(sfs_dst_t *dst, off_t off, const char *buf, size_t len) {
+    if(len == 0)
+        return 0;
+    off += dst->base;
+    if(dst->diff)
+        return dst_diff_write(dst, off, buf, len);
+    return dst_append(dst, off, buf, len);
+}
+
+
+int sfs_dst_zero(sfs_dst_t *dst, off_t off, size_t len) {
+    if(len == 0)
+        return 0;
+    off += dst->base;
+
+    // A small hole right after some data is written along with it, and with the next data
+    if(!dst->diff && len <= dst->merge_size && dst->write_niov > 0 && dst->write_niov < DST_MAX_IOV &&
+       off == dst->write_off + (off_t) dst->write_len) {
+        dst_write_append(dst, off, dst->zeros, len);
+        return 0;
+    }
+
+    if(dst_issue_write(dst) != 0)
+        return -1;
+    if(dst->zero_len > 0 && off == dst->zero_off + (off_t) dst->zero_len) {
+        dst->zero_len += len;
+        return 0;
+    }
+    if(dst_issue_zero(dst) != 0)
+        return -1;
+    dst->zero_off = off;
+    dst->zero_len = len;
+    return 0;
+}
+
+
+int sfs_dst_fill(sfs_dst_t *dst, off_t off, size_t len, u_int64_t word) {
+    size_t n;
+
+    if(len == 0)
+        return 0;
+    if(word == 0)
+        return sfs_dst_zero(dst, off, len);
+    if(dst_alloc_fill(dst, word) != 0)
+        return -1;
+
+    // Small patterns are gathered with the surrounding data
+    if(len <= DST_FILL_BUF_SIZE)
+        return sfs_dst_write(dst, off, dst->fill, len);
+    off += dst->base;
+    // Compared piece by piece, the pattern buffer holding whole words
+    for(; dst->diff && len > 0; off += n, len -= n) {
+        n = len < DST_FILL_BUF_SIZE ? len : DST_FILL_BUF_SIZE;
+        if(dst_diff_write(dst, off, dst->fill, n) != 0)
+            return -1;
+    }
+    if(len == 0)
+        return 0;
+    if(dst_issue_zero(dst) != 0 || dst_issue_write(dst) != 0)
+        return -1;
+    if(!dst->uring)
+        return dst_pwrite(dst, off, dst->fill, len, DST_FILL_BUF_SIZE);
+    return dst_queue(dst, off, dst->fill, len, DST_OP_FILL, DST_ZERO_WRITE, DST_FILL_BUF_SIZE);
+}
+
+
+int sfs_dst_copy(sfs_dst_t *dst, off_t off, off_t src, size_t len, size_t granularity,
+                 u_int64_t *check) {
+    ssize_t rb;
+    size_t n, done, i;
+
+    *check = 0;
+    if(dst->copy == NULL) {
+        dst->copy = malloc(DST_COPY_BUF_SIZE);
+        if(dst->copy == NULL) {
+            fprintf(stderr, "Unable to allocate memory for copies\n");
+            return -1;
+        }
+    }
+    // The source range may still be pending or in flight
+    if(sfs_dst_drain(dst) != 0)
+        return -1;
+    off += dst->base;
+    src += dst->base;
+
+    // Copies are synchronous: they are rare enough not to be worth queuing
+    while(len > 0) {
+        n = len < DST_COPY_BUF_SIZE ? len : DST_COPY_BUF_SIZE;
+        for(done=0; done<n; done+=rb) {
+            rb = pread(dst->fd, dst->copy + done, n - done, src + done);
+            if(rb < 0 && errno == EINTR) {
+                rb = 0;
+                continue;
+            }
+            if(rb <= 0) {
+                fprintf(stderr, "Unable to read %li bytes at offset %li on destination: %s\n",
+                        n - done, src + done, rb < 0 ? strerror(errno) : "end of file");
+                return -1;
+            }
+        }
+        for(i=0; i<n; i+=granularity)
+            *check = sfs_hash_fold(*check, sfs_hash64(dst->copy + i, granularity, 0));
+        // The copy buffer is reused right after
+        if(dst->diff ? dst_diff_write(dst, off, dst->copy, n) != 0 || sfs_dst_drain(dst) != 0 :
+                       dst_pwrite(dst, off, dst->copy, n, 0) != 0)
+            return -1;
+        off += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int sfs_dst_drain(sfs_dst_t *dst) {
+    struct io_uring_cqe cqe;
+    u_int64_t start;
+
+    if(dst_issue_write(dst) != 0)
+        return -1;
+    if(!dst->uring)
+        return 0;
+    start = sfs_stats_start(dst->stats);
+    while(dst->nfree < dst->uring_depth) {
+        if(sfs_uring_wait(&dst->ring, &cqe) != 0)
+            return -1;
+        dst_op_complete(dst, &cqe);
+    }
+    sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+    return dst->error ? -1 : 0;
+}
+
+
+int sfs_dst_splice(sfs_dst_t *dst, int fd, off_t off, size_t len, size_t *spliced) {
+    loff_t pos = off + dst->base;
+    ssize_t n;
+    u_int64_t start;
+
+    *spliced = 0;
+    // Splices are synchronous and bypass the queue: issue everything before them
+    if(dst_issue_zero(dst) != 0 || sfs_dst_drain(dst) != 0)
+        return -1;
+    while(*spliced < len) {
+        start = sfs_stats_start(dst->stats);
+        n = splice(fd, NULL, dst->fd, &pos, len - *spliced, SPLICE_F_MOVE | SPLICE_F_MORE);
+        sfs_stats_time(dst->stats, SFS_STAT_WRITE_NS, start);
+        if(n < 0 && errno == EINTR)
+            continue;
+        // Nothing was consumed from the pipe by the failed call
+        if(n < 0 && (errno == EINVAL || errno == ENOSYS))
+            return 1;
+        if(n <= 0) {
+            fprintf(stderr, "Unable to splice %li bytes at offset %li on destination: %s\n",
+                    len - *spliced, (off_t) pos, n < 0 ? strerror(errno) : "end of stream");
+            return -1;
+        }
+        *spliced += n;
+    }
+    return 0;
+}
+
+
+int sfs_dst_finish(sfs_dst_t *dst, off_t end) {
+    size_t tail;
+
+    end += dst->base;
+    if(dst_issue_write(dst) != 0)
+        return -1;
+    if(dst->zero_len > 0 && dst->zero_off + (off_t) dst->zero_len == end) {
+        tail = (dst->zero_len - 1) % BLK_SIZE + 1;
+        dst->zero_len -= tail;
+        if(dst_issue_zero(dst) != 0 || dst_alloc_zeros(dst) != 0)
+            return -1;
+        if(!dst->diff)
+            dst_write_append(dst, end - tail, dst->zeros, tail);
+        else if(dst_diff_write(dst, end - tail, dst->zeros, tail) != 0)
+            return -1;
+    }
+    if(dst_issue_zero(dst) != 0)
+        return -1;
+    return sfs_dst_drain(dst);
+}
+
+
+off_t sfs_dst_size(sfs_dst_t *dst) {
+    return lseek(dst->fd, 0, SEEK_END);
+}
+
+
+void sfs_dst_close(sfs_dst_t *dst) {
+    if(dst->uring) {
+        // Buffers may be released right after: nothing can be left in flight
+        dst->write_niov = 0;
+        sfs_dst_drain(dst);
+        sfs_uring_exit(&dst->ring);
+        dst->uring = 0;
+    }
+    free_all_mem(6, (void *) dst->ops, (void *) dst->free_ops, (void *) dst->zeros, (void *) dst->fill,
+                 (void *) dst->copy, (void *) dst->diff_buf);
+    dst->ops = NULL;
+    dst->free_ops = NULL;
+    dst->zeros = NULL;
+    dst->fill = NULL;
+    dst->copy = NULL;
+    dst->diff_buf = NULL;
+    if(dst->fd != -1)
+        close(dst->fd);
+    dst->fd = -1;
+}
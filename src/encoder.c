@@ -0,0 +1,1366 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <codec.h>
+#include <encoder.h>
+#include <hash.h>
+#include <index.h>
+#include <scanpipe.h>
+#include <sfs.h>
+#include <signature.h>
+#include <stats.h>
+#include <zeroscan.h>
+
+#define FIVE_GIB  (long) (5 * pow(2, 30))
+#define SPLICE_MIN_SIZE 4194304 // Smaller blocks data is copied to the output pipe
+
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t wb;
+
+    while(len > 0) {
+        wb = write(fd, buf, len);
+        if(wb < 0 && errno != EINTR)
+            return -1;
+        if(wb > 0) {
+            buf += wb;
+            len -= wb;
+        }
+    }
+    return 0;
+}
+
+
+/* Hand len bytes to the pipe dfp writes to, by reference: the whole pages of buf are
+ * gifted to the pipe (vmsplice with SPLICE_F_GIFT), then replaced in our address space by
+ * fresh pages. The pipe holds the only references to the pages spliced, which are never
+ * written again, however long the reader keeps them (splicing them further, resizing the
+ * pipe...). The unaligned head and tail are copied. buf must be private anonymous memory
+ * (malloc), its whole pages reading back as zeros afterwards.
+ * Returns 0 on success, -1 on failure
+ */
+static int splice_data(FILE *dfp, char *buf, size_t len) {
+    struct iovec iov;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *start = (char *) (((uintptr_t) buf + page - 1) / page * page);
+    char *end = (char *) ((uintptr_t) (buf + len) / page * page);
+    char *p;
+    ssize_t wb;
+    int fd = fileno(dfp);
+
+    if(fflush(dfp) != 0)
+        return -1;
+    if(end <= start)
+        return write_all(fd, buf, len);
+    if(write_all(fd, buf, start - buf) != 0)
+        return -1;
+    for(p=start; p<end; p+=wb) {
+        iov.iov_base = p;
+        iov.iov_len = end - p;
+        wb = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+        if(wb < 0 && errno != EINTR)
+            return -1;
+        if(wb < 0)
+            wb = 0;
+    }
+    if(mmap(start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+            -1, 0) == MAP_FAILED)
+        return -1;
+    return write_all(fd, end, buf + len - end);
+}
+
+
+/* Push the block data, adding it to the block checksum if check is not NULL. With vmsplice,
+ * dfp being a pipe, big blocks are spliced into it rather than copied, the pages of stored
+ * being given away: its content is lost
+ */
+static int flush_data(const void *stored, size_t stored_size, sfs_footer_t *footerp, FILE *dfp,
+                      const sfs_header_t *hdr, u_int64_t *check, int vmsplice) {
+    if(check != NULL)
+        *check = sfs_block_sum_data(hdr, stored, stored_size, *check);
+    if(vmsplice && stored_size >= SPLICE_MIN_SIZE) {
+        // Block buffers are owned by the encoder, only read-only for the other writers
+        if(splice_data(dfp, (char *) stored, stored_size) != 0) {
+            fprintf(stderr, "Unable to splice buffer to the output: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    else if(fwrite(stored, 1, stored_size, dfp) != stored_size) {
+        fprintf(stderr, "Unable to write buffer correctly\n");
+        return 1;
+    }
+    footerp->written += stored_size;
+    return 0;
+}
+
+
+static int flush_block(void* buffer, size_t buf_offset, sfs_footer_t* footerp,
+                 FILE *dfp, size_t meta_idx, size_t* data_boundaries,
+                 size_t closure_offset, size_t random_size, int* random_buf,
+                 const sfs_typed_range_t *typed, size_t ntyped,
+                 const void *stored, size_t stored_size, const sfs_header_t *hdr,
+                 struct random_data *random, int vmsplice) {
+    size_t written, packed_len;
+    unsigned char *packed;
+    u_int64_t check = 0;
+    int checksum = (hdr->flags & SFS_FLAG_CHECKSUM) != 0;
+    int i;
+
+    // Push next block size (not counting the additional random if any)
+    written = fwrite(&buf_offset, sizeof(size_t), 1, dfp);
+    if(written != 1) {
+        fprintf(stderr, "Write next block size error\n");
+        return 1;
+    }
+    footerp->written += sizeof(size_t);
+    if(checksum)
+        check = sfs_hash64(&buf_offset, sizeof(size_t), check);
+
+    // Push random
+    if(random_buf != NULL)
+    {
+        for(i=0; i<random_size; i++){
+            random_r(random, &random_buf[i]);
+        }
+        //fprintf(stderr, "Block random %d\n", random);
+        written = fwrite((void *) random_buf, sizeof(int), random_size, dfp);
+        if(written != random_size) {
+            fprintf(stderr, "Write random in next block error\n");
+            return 1;
+        }
+        footerp->written += sizeof(int) * random_size;
+        if(checksum)
+            check = sfs_hash64(random_buf, sizeof(int) * random_size, check);
+    }
+
+    // Push the compressed block size, if the stream is compressed. The data is stored
+    // as is when stored_size is buf_offset
+    if(stored != NULL) {
+        written = fwrite(&stored_size, sizeof(size_t), 1, dfp);
+        if(written != 1) {
+            fprintf(stderr, "Write compressed block size error\n");
+            return 1;
+        }
+        footerp->written += sizeof(size_t);
+        if(checksum)
+            check = sfs_hash64(&stored_size, sizeof(size_t), check);
+    }
+    else {
+        stored = buffer;
+        stored_size = buf_offset;
+    }
+
+    // Push block data, unless the stream has it after the boundaries
+    if(!(hdr->flags & SFS_FLAG_BOUNDARIES_FIRST) &&
+       flush_data(stored, stored_size, footerp, dfp, hdr, checksum ? &check : NULL, vmsplice) != 0)
+        return 1;
+
+    // Push the typed range table, if the stream has one
+    if(typed != NULL) {
+        written = fwrite(&ntyped, sizeof(size_t), 1, dfp);
+        if(written != 1) {
+            fprintf(stderr, "Write typed ranges number error\n");
+            return 1;
+        }
+        written = fwrite((void *) typed, sizeof(sfs_typed_range_t), ntyped, dfp);
+        if(written != ntyped) {
+            fprintf(stderr, "Write typed ranges error\n");
+            return 1;
+        }
+        footerp->written += sizeof(size_t) + ntyped * sizeof(sfs_typed_range_t);
+        if(checksum) {
+            check = sfs_hash64(&ntyped, sizeof(size_t), check);
+            check = sfs_hash64(typed, ntyped * sizeof(sfs_typed_range_t), check);
+        }
+    }
+
+    // Close the data range if we were in copy mode, i.e if meta_idx % 2 != 0
+    if(meta_idx % 2 != 0) {
+        data_boundaries[meta_idx] = closure_offset;
+        meta_idx++;
+    }
+
+    //fprintf(stderr, "Flushing block with %li bytes, meta_idx %li, closure offset %li\n", buf_offset, meta_idx, closure_offset);
+
+    /* else {
+        // We were in sparse mode, so all data cluster were closed
+    } */
+
+    // Push offset array size (unit = number of long = bytes_size / 8)
+    written = fwrite(&meta_idx, sizeof(size_t), 1, dfp);
+    if(written != 1) {
+        fprintf(stderr, "Write offsets size error\n");
+        return 1;
+    }
+
+    footerp->written += sizeof(size_t);
+    if(checksum)
+        check = sfs_hash64(&meta_idx, sizeof(size_t), check);
+
+    // Push offsets, packed as varints if the stream has compact boundaries
+    if(hdr->flags & SFS_FLAG_COMPACT_BOUNDARIES) {
+        packed = malloc(meta_idx * SFS_VARINT_MAX_BYTES);
+        if(packed == NULL) {
+            fprintf(stderr, "Unable to allocate memory for packed boundaries\n");
+            return 1;
+        }
+        packed_len = sfs_boundaries_encode(data_boundaries, meta_idx, hdr->granularity, packed);
+        if(fwrite(&packed_len, sizeof(size_t), 1, dfp) != 1 ||
+           fwrite(packed, 1, packed_len, dfp) != packed_len) {
+            fprintf(stderr, "Write meta error\n");
+            free(packed);
+            return 1;
+        }
+        footerp->written += sizeof(size_t) + packed_len;
+        if(checksum) {
+            check = sfs_hash64(&packed_len, sizeof(size_t), check);
+            check = sfs_hash64(packed, packed_len, check);
+        }
+        free(packed);
+    }
+    else {
+        written = fwrite((void *) data_boundaries, sizeof(size_t), meta_idx, dfp);
+        if(written != meta_idx) {
+            fprintf(stderr, "Write meta error\n");
+            return 1;
+        }
+        footerp->written += meta_idx * sizeof(size_t);
+        if(checksum)
+            check = sfs_hash64(data_boundaries, meta_idx * sizeof(size_t), check);
+    }
+
+    if((hdr->flags & SFS_FLAG_BOUNDARIES_FIRST) &&
+       flush_data(stored, stored_size, footerp, dfp, hdr, checksum ? &check : NULL, vmsplice) != 0)
+        return 1;
+
+    // Push the checksum of all the above, if the stream has one per block
+    if(checksum) {
+        written = fwrite(&check, sizeof(u_int64_t), 1, dfp);
+        if(written != 1) {
+            fprintf(stderr, "Write block checksum error\n");
+            return 1;
+        }
+        footerp->written += sizeof(u_int64_t);
+    }
+    return 0;
+}
+
+
+
+// Logical bytes restored by a block, the data range left open being closed by flush_block
+static size_t block_logical_len(const size_t *data_boundaries, size_t meta_idx, size_t closure_offset) {
+    size_t i, len = 0;
+
+    for(i=0; i<meta_idx; i++)
+        len += data_boundaries[i];
+    if(meta_idx % 2 != 0)
+        len += closure_offset;
+    return len;
+}
+
+
+// Number of blocks that can still be read before the keepalive forces a flush,
+// the last one included
+static size_t encoder_keepalive_budget(sfs_encoder_t *enc) {
+    if(enc->read_bytes_keepalive == 0)
+        return (size_t) -1;
+    if(enc->read_since_last_flush >= enc->read_bytes_keepalive)
+        return 1;
+    return (enc->read_bytes_keepalive - enc->read_since_last_flush + enc->granularity - 1) / enc->granularity;
+}
+
+
+// Write out a compressed block, in the order the blocks were queued
+static int encoder_write_slot(sfs_encoder_t *enc, sfs_codec_slot_t *slot) {
+    sfs_pending_block_t *p = &enc->pending[slot - enc->pool->slots];
+    u_int64_t start = sfs_stats_start(enc->stats);
+    int rc;
+
+    if(enc->indexed && sfs_index_add(&enc->index, enc->footer.written, p->logical_len) != 0)
+        return 1;
+    rc = flush_block(slot->raw, slot->raw_len, &enc->footer, enc->dfp, p->meta_idx, p->boundaries,
+                     p->closure_offset, enc->random_size, enc->random_buf,
+                     enc->typed != NULL ? p->typed : NULL, p->ntyped,
+                     slot->out_len > 0 ? slot->out : slot->raw,
+                     slot->out_len > 0 ? slot->out_len : slot->raw_len, &enc->hdr, &enc->random,
+                     enc->vmsplice);
+    sfs_stats_time(enc->stats, SFS_STAT_WRITE_NS, start);
+    enc->raw_bytes += slot->raw_len;
+    enc->stored_bytes += slot->out_len > 0 ? slot->out_len : slot->raw_len;
+    sfs_codec_pool_release(enc->pool);
+    return rc;
+}
+
+
+// Write out all the blocks still being compressed
+static int encoder_drain(sfs_encoder_t *enc) {
+    sfs_codec_slot_t *slot;
+
+    if(enc->pool == NULL)
+        return 0;
+    while((slot = sfs_codec_pool_retire(enc->pool)) != NULL) {
+        if(encoder_write_slot(enc, slot))
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Write the current atomic block out, or queue it to be compressed: the data and
+ * metadata are copied to a pool slot, the oldest blocks being written out first
+ * when all slots are busy
+ */
+static int encoder_emit(sfs_encoder_t *enc) {
+    sfs_codec_slot_t *slot;
+    sfs_pending_block_t *p;
+    size_t *boundaries;
+    u_int64_t start;
+    int rc;
+
+    sfs_stats_block(enc->stats, enc->buf_offset);
+    if(enc->pool == NULL) {
+        if(enc->indexed && sfs_index_add(&enc->index, enc->footer.written,
+                                         block_logical_len(enc->data_boundaries, enc->meta_idx,
+                                                           enc->relative_offset)) != 0)
+            return 1;
+        start = sfs_stats_start(enc->stats);
+        rc = flush_block(enc->buffer, enc->buf_offset, &enc->footer, enc->dfp, enc->meta_idx,
+                         enc->data_boundaries, enc->relative_offset, enc->random_size,
+                         enc->random_buf, enc->typed, enc->ntyped, NULL, 0, &enc->hdr,
+                         &enc->random, enc->vmsplice);
+        sfs_stats_time(enc->stats, SFS_STAT_WRITE_NS, start);
+        return rc;
+    }
+
+    while((slot = sfs_codec_pool_next(enc->pool)) == NULL) {
+        if(encoder_write_slot(enc, sfs_codec_pool_retire(enc->pool)))
+            return 1;
+    }
+    p = &enc->pending[slot - enc->pool->slots];
+
+    // One more slot for the closure done by flush_block
+    if(p->boundaries_cap < enc->meta_idx + 1) {
+        boundaries = realloc(p->boundaries, (enc->meta_idx + 1) * sizeof(size_t));
+        if(boundaries == NULL) {
+            fprintf(stderr, "Unable to allocate memory for pending block boundaries\n");
+            return 1;
+        }
+        p->boundaries = boundaries;
+        p->boundaries_cap = enc->meta_idx + 1;
+    }
+    memcpy(p->boundaries, enc->data_boundaries, enc->meta_idx * sizeof(size_t));
+    p->meta_idx = enc->meta_idx;
+    p->closure_offset = enc->relative_offset;
+    p->logical_len = block_logical_len(enc->data_boundaries, enc->meta_idx, enc->relative_offset);
+    if(enc->typed != NULL)
+        memcpy(p->typed, enc->typed, enc->ntyped * sizeof(sfs_typed_range_t));
+    p->ntyped = enc->ntyped;
+    memcpy(slot->raw, enc->buffer, enc->buf_offset);
+    slot->raw_len = enc->buf_offset;
+    sfs_codec_pool_submit(enc->pool);
+    return 0;
+}
+
+
+static int encoder_flush(sfs_encoder_t *enc) {
+    assert(enc->meta_idx % 2 == 1);
+
+    if(encoder_emit(enc))
+        return 1;
+
+    // Increment data cluster number for stats
+    enc->data_cluster_nb += (enc->meta_idx + 1) / 2;
+    enc->atomic_blocks++;
+
+    // Reset all counters, prepare for a new atomic block
+    enc->buf_offset = 0;
+    enc->read_since_last_flush = 0;
+    enc->meta_idx = 1;
+    enc->relative_offset = 0;
+    enc->ntyped = 0;
+    enc->typed_open = 0;
+    return 0;
+}
+
+
+// Close the current range with its length, one slot always being left for the closure
+// done by flush_block
+static int encoder_push_boundary(sfs_encoder_t *enc) {
+    if(enc->meta_idx >= enc->meta_max_idx-1) {
+
+        // This section should normally be dead code, if the first upper boundary computed above is correct
+        // we have reached the end (1 slot left for us) of the data_boundaries,
+        // we need to realloc some space
+        fprintf(stderr, "Data_boundaries memory needs extension. Etending by %li bytes\n", enc->extend_meta);
+        enc->meta_len += enc->extend_meta;
+        enc->meta_max_idx = enc->meta_len / sizeof(size_t);
+
+        enc->data_boundaries = realloc(enc->data_boundaries, enc->meta_len);
+        if(enc->data_boundaries == NULL) {
+            fprintf(stderr, "Unable to extend meta. Memory allocation error. Try decreasing atomic block size.\n");
+            return 1;
+        }
+        fprintf(stderr, "data_boundaries size is now %li bytes\n", enc->meta_len);
+    }
+    enc->data_boundaries[enc->meta_idx] = enc->relative_offset;
+    enc->relative_offset = 0;
+    enc->meta_idx++;
+    return 0;
+}
+
+
+// End the sparse range in progress, start a new data range
+static int encoder_start_data(sfs_encoder_t *enc) {
+    enc->sparse_on = 0;
+    enc->typed_open = 0;
+    return encoder_push_boundary(enc);
+}
+
+
+// End the data range in progress, start a new sparse range
+static int encoder_start_sparse(sfs_encoder_t *enc) {
+    enc->sparse_on = 1;
+    return encoder_push_boundary(enc);
+}
+
+
+/* Sparse ranges next to a typed one are separated from it by an empty data range.
+ * The atomic block is flushed there when its typed range table is full.
+ */
+static int encoder_end_typed(sfs_encoder_t *enc) {
+    if(encoder_start_data(enc))
+        return 1;
+    if(enc->ntyped == enc->typed_max)
+        return encoder_flush(enc);
+    return 0;
+}
+
+
+// Account for len bytes of zeros
+static int encoder_skip(sfs_encoder_t *enc, size_t len) {
+    if(enc->typed_open && encoder_end_typed(enc))
+        return 1;
+    if(!enc->sparse_on && encoder_start_sparse(enc))
+        return 1;
+    enc->relative_offset += len;
+    enc->read_since_last_flush += len;
+    enc->footer.read += len;
+    return 0;
+}
+
+
+/* Account for len bytes of a typed range: made of word repeated (SFS_RANGE_PATTERN),
+ * a copy of the granule at offset arg, whose hash is given (SFS_RANGE_COPY), or a
+ * granule unchanged since the base, whose hash is given (SFS_RANGE_BASE)
+ */
+static int encoder_skip_typed(sfs_encoder_t *enc, size_t len, size_t kind, size_t arg, u_int64_t hash) {
+    sfs_typed_range_t *last = enc->typed_open ? &enc->typed[enc->ntyped-1] : NULL;
+
+    if(last != NULL && last->kind == kind && kind == SFS_RANGE_PATTERN && last->arg == arg) {
+        // Same pattern, extended
+    }
+    else if(last != NULL && last->kind == kind && kind == SFS_RANGE_COPY &&
+            last->arg + enc->relative_offset == arg) {
+        // Copy of the granule right after the last copied one
+        last->check = sfs_hash_fold(last->check, hash);
+    }
+    else if(last != NULL && last->kind == kind && kind == SFS_RANGE_BASE) {
+        // Next granule unchanged too
+        last->check = sfs_hash_fold(last->check, hash);
+    }
+    else {
+        if(enc->sparse_on && encoder_end_typed(enc))
+            return 1;
+        if(encoder_start_sparse(enc))
+            return 1;
+        last = &enc->typed[enc->ntyped++];
+        last->slot = enc->meta_idx;
+        last->kind = kind;
+        last->arg = arg;
+        last->check = kind != SFS_RANGE_PATTERN ? sfs_hash_fold(0, hash) : 0;
+        enc->typed_open = 1;
+    }
+    enc->relative_offset += len;
+    enc->read_since_last_flush += len;
+    enc->footer.read += len;
+    return 0;
+}
+
+
+// Append len bytes of data to the atomic block, flushing it when it is full or
+// when the keepalive is reached
+static int encoder_copy(sfs_encoder_t *enc, const char *src, size_t len) {
+    if(enc->sparse_on) {
+        // Start a new data range
+        if(encoder_start_data(enc))
+            return 1;
+    }
+    // Nothing to move when no sparse range was met since the chunk was read in place.
+    // src is NULL for source holes skipped without being read
+    if(src == NULL)
+        memset(enc->buffer + enc->buf_offset, 0, len);
+    else if(src != enc->buffer + enc->buf_offset)
+        memmove(enc->buffer + enc->buf_offset, src, len);
+    enc->buf_offset += len;
+    enc->relative_offset += len;
+    enc->read_since_last_flush += len;
+    enc->footer.read += len;
+
+    if(enc->read_bytes_keepalive > 0 && enc->read_since_last_flush >= enc->read_bytes_keepalive) {
+        fprintf(stderr, "More than %li bytes read since last flush (%li bytes read). Forcing copy and flush (keepalive safety)\n",
+                enc->read_bytes_keepalive, enc->read_since_last_flush);
+        return encoder_flush(enc);
+    }
+    if(enc->buf_offset == enc->atomic_block_size || (enc->typed != NULL && enc->ntyped == enc->typed_max))
+        return encoder_flush(enc);
+    return 0;
+}
+
+
+static int encoder_feed_dense(sfs_encoder_t *enc, const char *src, size_t len) {
+    size_t chunk, budget;
+
+    while(len > 0) {
+        // Stop on the atomic block boundary or on the block triggering the keepalive
+        chunk = enc->atomic_block_size - enc->buf_offset;
+        if(chunk > len)
+            chunk = len;
+        budget = encoder_keepalive_budget(enc);
+        if(budget < chunk / enc->granularity)
+            chunk = budget * enc->granularity;
+        if(encoder_copy(enc, src, chunk))
+            return 1;
+        src += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+static int encoder_skip_gap(sfs_encoder_t *enc, size_t len, u_int64_t word) {
+    if(word == 0)
+        return encoder_skip(enc, len);
+    return encoder_skip_typed(enc, len, SFS_RANGE_PATTERN, word, 0);
+}
+
+
+/* Feed a sparse range of len bytes made of word repeated (zeros for word 0).
+ * src may be NULL if the zeros were not read
+ */
+static int encoder_feed_gap(sfs_encoder_t *enc, const char *src, size_t len, u_int64_t word) {
+    size_t budget;
+
+    while(len > 0) {
+        budget = encoder_keepalive_budget(enc);
+        if(budget > len / enc->granularity)
+            return encoder_skip_gap(enc, len, word);
+
+        // The keepalive is reached inside the sparse range: the block reaching it is
+        // copied to force a flush
+        if(budget > 1 && encoder_skip_gap(enc, (budget - 1) * enc->granularity, word))
+            return 1;
+        len -= budget * enc->granularity;
+        if(src != NULL)
+            src += (budget - 1) * enc->granularity;
+        if(encoder_copy(enc, src, enc->granularity))
+            return 1;
+        if(src != NULL)
+            src += enc->granularity;
+    }
+    return 0;
+}
+
+
+// Whether the granule at offset in the source is a copy of an earlier one, found in *ref
+static int encoder_dedup_lookup(sfs_encoder_t *enc, const char *granule, u_int64_t hash, size_t offset,
+                         size_t *ref) {
+    sfs_dedup_entry_t *e = &enc->dedup[hash & enc->dedup_mask];
+    ssize_t rb;
+
+    if(e->offset != DEDUP_EMPTY && e->hash == hash) {
+        // Fingerprints only tell granules apart: the earlier one is read back to be sure
+        rb = pread(enc->source_fd, enc->dedup_buf, enc->granularity, enc->source_offset + e->offset);
+        if(rb == (ssize_t) enc->granularity && memcmp(enc->dedup_buf, granule, enc->granularity) == 0) {
+            *ref = e->offset;
+            return 1;
+        }
+    }
+    // The most recent granule replaces the older one
+    e->hash = hash;
+    e->offset = offset;
+    return 0;
+}
+
+
+// Replace the granules already met by copies of the earlier ones, store the others
+static int encoder_feed_dedup(sfs_encoder_t *enc, const char *src, size_t len) {
+    size_t n, start = 0, ref;
+    u_int64_t hash;
+
+    for(n=0; n<len; n+=enc->granularity) {
+        hash = sfs_hash64(src + n, enc->granularity, 0);
+        // Granules before n are not fed yet
+        if(!encoder_dedup_lookup(enc, src + n, hash, enc->footer.read + n - start, &ref))
+            continue;
+        if(n > start && encoder_feed_dense(enc, src + start, n - start))
+            return 1;
+        start = n + enc->granularity;
+        // The granule reaching the keepalive is stored to force a flush
+        if(encoder_keepalive_budget(enc) > 1) {
+            if(encoder_skip_typed(enc, enc->granularity, SFS_RANGE_COPY, ref, hash))
+                return 1;
+            enc->dedup_bytes += enc->granularity;
+        }
+        else if(encoder_feed_dense(enc, src + n, enc->granularity)) {
+            return 1;
+        }
+    }
+    if(len > start)
+        return encoder_feed_dense(enc, src + start, len - start);
+    return 0;
+}
+
+
+// Store granules changed since the base, if any
+static int encoder_feed_changed(sfs_encoder_t *enc, const char *src, size_t len) {
+    if(enc->dedup != NULL)
+        return encoder_feed_dedup(enc, src, len);
+    return encoder_feed_dense(enc, src, len);
+}
+
+
+// Replace the granules unchanged since the base by base ranges, store the others
+static int encoder_feed_base(sfs_encoder_t *enc, const char *src, size_t len) {
+    size_t n, start = 0, g;
+    u_int64_t hash;
+
+    for(n=0; n<len; n+=enc->granularity) {
+        g = (src + n - enc->chunk) / enc->granularity;
+        hash = enc->hashes[g];
+        if(!sfs_sig_match(enc->base, enc->chunk_offset / enc->granularity + g, hash))
+            continue;
+        if(n > start && encoder_feed_changed(enc, src + start, n - start))
+            return 1;
+        start = n + enc->granularity;
+        // The granule reaching the keepalive is stored to force a flush
+        if(encoder_keepalive_budget(enc) > 1) {
+            if(encoder_skip_typed(enc, enc->granularity, SFS_RANGE_BASE, 0, hash))
+                return 1;
+            enc->base_bytes += enc->granularity;
+        }
+        else if(encoder_feed_changed(enc, src + n, enc->granularity)) {
+            return 1;
+        }
+    }
+    if(len > start)
+        return encoder_feed_changed(enc, src + start, len - start);
+    return 0;
+}
+
+
+static int encoder_feed_data(sfs_encoder_t *enc, const char *src, size_t len) {
+    if(enc->base != NULL)
+        return encoder_feed_base(enc, src, len);
+    return encoder_feed_changed(enc, src, len);
+}
+
+
+// Split a dense run into granules made of a repeated word, stripped as typed ranges, and data
+static int encoder_feed_patterns(sfs_encoder_t *enc, const char *src, size_t len) {
+    size_t n;
+    u_int64_t word, next;
+    int pattern;
+
+    while(len > 0) {
+        pattern = zs_is_pattern(src, enc->granularity, &word);
+        for(n=enc->granularity; n<len; n+=enc->granularity) {
+            if(zs_is_pattern(src + n, enc->granularity, &next) != pattern || (pattern && next != word))
+                break;
+        }
+        if(pattern ? encoder_feed_gap(enc, src, n, word) : encoder_feed_data(enc, src, n))
+            return 1;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Hash the granules of a chunk, zero runs being known to hash as a zero granule
+static int encoder_hash_chunk(sfs_encoder_t *enc, const char *chunk, size_t len, sfs_run_t *runs, size_t nruns) {
+    size_t i, n, g = 0;
+
+    enc->chunk = chunk;
+    enc->chunk_offset = enc->footer.read;
+    for(i=0; i<nruns; i++) {
+        for(n=0; n<runs[i].len; n+=enc->granularity, g++)
+            enc->hashes[g] = runs[i].zero ? enc->zero_hash : sfs_hash64(chunk + n, enc->granularity, 0);
+        chunk += runs[i].len;
+    }
+    // Last granule of the source, shorter than the others
+    if(g * enc->granularity < len) {
+        enc->hashes[g] = sfs_hash64(chunk, len - g * enc->granularity, 0);
+        g++;
+    }
+    if(enc->sig != NULL)
+        return sfs_sig_append(enc->sig, enc->hashes, g);
+    return 0;
+}
+
+
+// Feed a hole of the source, granule aligned and not read
+static int encoder_feed_hole(sfs_encoder_t *enc, size_t len) {
+    size_t n, count, i;
+
+    for(n=len/enc->granularity; enc->sig != NULL && n>0; n-=count) {
+        count = n < enc->hashes_max ? n : enc->hashes_max;
+        for(i=0; i<count; i++)
+            enc->hashes[i] = enc->zero_hash;
+        if(sfs_sig_append(enc->sig, enc->hashes, count))
+            return 1;
+    }
+    return encoder_feed_gap(enc, NULL, len, 0);
+}
+
+
+// Feed a chunk of len bytes, already split into runs, to the atomic block
+static int encoder_feed(sfs_encoder_t *enc, const char *chunk, size_t len, sfs_run_t *runs, size_t nruns) {
+    size_t i, full;
+    int rc = 0;
+
+    if(enc->hashes != NULL && encoder_hash_chunk(enc, chunk, len, runs, nruns))
+        return 1;
+    full = len / enc->granularity * enc->granularity;
+    for(i=0; i<nruns && rc == 0; i++) {
+        if(runs[i].zero)
+            rc = encoder_feed_gap(enc, chunk, runs[i].len, 0);
+        else if(enc->patterns)
+            rc = encoder_feed_patterns(enc, chunk, runs[i].len);
+        else
+            rc = encoder_feed_data(enc, chunk, runs[i].len);
+        chunk += runs[i].len;
+    }
+    if(rc != 0)
+        return rc;
+
+    if(full < len) {
+        fprintf(stderr, "Less than %li bytes read (%li bytes), unaligned so not skipping data\n",
+                enc->granularity, len - full);
+        if(encoder_copy(enc, chunk, len - full))
+            return 1;
+        // encoder_copy does not flush if the keepalive was not reached
+        if(enc->buf_offset > 0)
+            return encoder_flush(enc);
+    }
+    return 0;
+}
+
+
+// Data bytes are counted per block emitted, pending is the data of the block being built
+static void encoder_update_stats(sfs_encoder_t *enc, size_t pending) {
+    if(enc->stats == NULL)
+        return;
+    sfs_stats_set(enc->stats, SFS_STAT_READ, enc->footer.read);
+    sfs_stats_set(enc->stats, SFS_STAT_STRIPPED, enc->footer.read - pending -
+                  enc->stats->counters[SFS_STAT_BLOCK_DATA]);
+    sfs_stats_set(enc->stats, SFS_STAT_WRITTEN, enc->footer.written);
+}
+
+
+static void encoder_report_progress(sfs_encoder_t *enc) {
+    encoder_update_stats(enc, enc->buf_offset);
+    if(enc->footer.read / FIVE_GIB > enc->last_report) {
+        enc->last_report = enc->footer.read / FIVE_GIB;
+        enc->footer.ratio = ((double) enc->footer.written / (double) enc->footer.read);
+        fprintf(stderr, "Read %li, written %li, compression ratio %.5lf, data cluster number %li, atomic blocks %li\n",
+                enc->footer.read, enc->footer.written, enc->footer.ratio, enc->data_cluster_nb, enc->atomic_blocks);
+    }
+}
+
+
+// Ordered writer side of the multithreaded pipeline
+static int encoder_feed_slot(void *ctx, scanpipe_slot_t *slot) {
+    sfs_encoder_t *enc = (sfs_encoder_t *) ctx;
+    int rc;
+
+    if(slot->hole > 0)
+        rc = encoder_feed_hole(enc, slot->hole);
+    else
+        rc = encoder_feed(enc, slot->buf, slot->len, slot->runs, slot->nruns);
+    encoder_report_progress(enc);
+    return rc;
+}
+
+
+static void clean_dedup(sfs_encoder_t *enc) {
+    free_all_mem(2, (void *) enc->dedup, (void *) enc->dedup_buf);
+    enc->dedup = NULL;
+    enc->dedup_buf = NULL;
+}
+
+
+static void clean_signatures(sfs_encoder_t *enc) {
+    if(enc->sig != NULL)
+        sfs_sig_close(enc->sig);
+    if(enc->base != NULL)
+        sfs_sig_close(enc->base);
+    free_all_mem(1, (void *) enc->hashes);
+    enc->sig = NULL;
+    enc->base = NULL;
+    enc->hashes = NULL;
+}
+
+
+static void clean_codec(sfs_encoder_t *enc) {
+    size_t i;
+
+    if(enc->pool == NULL)
+        return;
+    if(enc->pending != NULL) {
+        for(i=0; i<enc->pool->nslots; i++)
+            free_all_mem(2, (void *) enc->pending[i].boundaries, (void *) enc->pending[i].typed);
+    }
+    sfs_codec_pool_stop(enc->pool);
+    free_all_mem(2, (void *) enc->pending, (void *) enc->pool);
+    enc->pending = NULL;
+    enc->pool = NULL;
+}
+
+
+// Scan a chunk for zero runs and feed it
+static int encoder_feed_chunk(sfs_encoder_t *enc, const char *chunk, size_t len) {
+    u_int64_t start;
+    size_t nruns;
+    int rc;
+
+    start = sfs_stats_start(enc->stats);
+    nruns = zs_scan(chunk, len / enc->granularity * enc->granularity, enc->granularity, enc->runs);
+    sfs_stats_time(enc->stats, SFS_STAT_SCAN_NS, start);
+    rc = encoder_feed(enc, chunk, len, enc->runs, nruns);
+    encoder_report_progress(enc);
+    return rc;
+}
+
+
+void sfs_encoder_opts_init(sfs_encoder_opts_t *opts) {
+    memset(opts, 0, sizeof(sfs_encoder_opts_t));
+    opts->atomic_block_size = DEFAULT_ATOMIC_BLOCK_SIZE;
+    opts->granularity = BLK_SIZE;
+    opts->chunk_size = DEFAULT_READ_CHUNK_SIZE;
+    opts->source_fd = -1;
+    opts->codec = SFS_CODEC_NONE;
+    opts->codec_threads = DEFAULT_CODEC_THREADS;
+    opts->shard_count = 1;
+}
+
+
+static int encoder_check_opts(const sfs_encoder_opts_t *opts) {
+    if(opts->granularity < MIN_GRANULARITY || opts->granularity > MAX_GRANULARITY ||
+       (opts->granularity & (opts->granularity - 1)) != 0) {
+        fprintf(stderr, "Granularity must be a power of 2 between 512 and 1048576 bytes\n");
+        return SFS_ERR_ARG;
+    }
+    if(opts->atomic_block_size == 0 || opts->atomic_block_size > MAX_ATOMIC_BLOCK_SIZE ||
+       opts->atomic_block_size % opts->granularity != 0) {
+        fprintf(stderr, "Atomic block size must be a multiple of the granularity\n");
+        return SFS_ERR_ARG;
+    }
+    if(opts->chunk_size == 0 || opts->chunk_size % opts->granularity != 0) {
+        fprintf(stderr, "Read chunk size must be a multiple of the granularity\n");
+        return SFS_ERR_ARG;
+    }
+    if(opts->random_size_bytes > MAX_RANDOM_BUFFER_SIZE) {
+        fprintf(stderr, "Random buffer size must be lower than %u bytes.\n", MAX_RANDOM_BUFFER_SIZE);
+        return SFS_ERR_ARG;
+    }
+    if(opts->boundaries_first && opts->codec != SFS_CODEC_NONE) {
+        fprintf(stderr, "Boundaries first streams cannot be compressed\n");
+        return SFS_ERR_ARG;
+    }
+    return SFS_OK;
+}
+
+
+// Allocate the deduplication table, if the source can be read back
+static int encoder_open_dedup(sfs_encoder_t *enc, const sfs_encoder_opts_t *opts) {
+    size_t i;
+
+    if(opts->source_fd < 0 || lseek(opts->source_fd, 0, SEEK_CUR) == -1) {
+        fprintf(stderr, "WARNING: the source is not seekable, deduplication disabled\n");
+        return SFS_OK;
+    }
+    // Power of 2 number of entries
+    for(enc->dedup_mask=1; enc->dedup_mask*2*sizeof(sfs_dedup_entry_t)<=opts->dedup_table_size;
+        enc->dedup_mask*=2);
+    enc->dedup = malloc(enc->dedup_mask * sizeof(sfs_dedup_entry_t));
+    if(enc->dedup == NULL || posix_memalign((void **) &enc->dedup_buf, DIRECT_IO_ALIGN, enc->granularity) != 0) {
+        enc->dedup_buf = NULL;
+        fprintf(stderr, "Unable to allocate the deduplication table. Try decreasing its size.\n");
+        return SFS_ERR_NOMEM;
+    }
+    for(i=0; i<enc->dedup_mask; i++)
+        enc->dedup[i].offset = DEDUP_EMPTY;
+    fprintf(stderr, "Deduplication activated, %li fingerprints\n", enc->dedup_mask);
+    enc->dedup_mask--;
+    enc->source_fd = opts->source_fd;
+    enc->source_offset = opts->shard_offset;
+    return SFS_OK;
+}
+
+
+static int encoder_open_signatures(sfs_encoder_t *enc) {
+    char *zeros;
+
+    // Hashes of a whole chunk, its last granule possibly shorter
+    enc->hashes_max = enc->chunk_size / enc->granularity + 1;
+    enc->hashes = malloc(enc->hashes_max * sizeof(u_int64_t));
+    // Every zero granule has the same hash
+    zeros = calloc(1, enc->granularity);
+    if(enc->hashes == NULL || zeros == NULL) {
+        free(zeros);
+        fprintf(stderr, "Unable to allocate memory for signatures. Try decreasing read chunk size.\n");
+        return SFS_ERR_NOMEM;
+    }
+    enc->zero_hash = sfs_hash64(zeros, enc->granularity, 0);
+    free(zeros);
+
+    if(enc->base != NULL) {
+        if(enc->base->hdr.granularity != enc->granularity) {
+            fprintf(stderr, "The base signatures were made with a %li bytes granularity\n",
+                    enc->base->hdr.granularity);
+            return SFS_ERR_ARG;
+        }
+        fprintf(stderr, "Incremental backup against a %li bytes base\n", enc->base->hdr.size);
+    }
+    return SFS_OK;
+}
+
+
+// Compression threads, and room for the metadata of the blocks they hold
+static int encoder_open_codec(sfs_encoder_t *enc, const sfs_encoder_opts_t *opts) {
+    size_t i;
+
+    enc->pool = calloc(1, sizeof(sfs_codec_pool_t));
+    if(enc->pool == NULL || sfs_codec_pool_start(enc->pool, opts->codec, opts->codec_level,
+                                                 opts->codec_threads, enc->atomic_block_size) != 0) {
+        free(enc->pool);
+        enc->pool = NULL;
+        fprintf(stderr, "Unable to start the compression threads. Try decreasing atomic block size.\n");
+        return SFS_ERR_NOMEM;
+    }
+    enc->pending = calloc(enc->pool->nslots, sizeof(sfs_pending_block_t));
+    for(i=0; enc->pending != NULL && i<enc->pool->nslots; i++) {
+        if(enc->typed == NULL)
+            continue;
+        enc->pending[i].typed = malloc(enc->typed_max * sizeof(sfs_typed_range_t));
+        if(enc->pending[i].typed == NULL)
+            break;
+    }
+    if(enc->pending == NULL || i < enc->pool->nslots) {
+        fprintf(stderr, "Unable to allocate memory for pending blocks. Try decreasing atomic block size.\n");
+        return SFS_ERR_NOMEM;
+    }
+    fprintf(stderr, "Compressing blocks with %s level %d, %d threads\n",
+            sfs_codec_name(opts->codec), opts->codec_level, opts->codec_threads);
+    return SFS_OK;
+}
+
+
+// Check that the output is a pipe, the data to be vmspliced into
+static int encoder_open_vmsplice(sfs_encoder_t *enc, FILE *dfp) {
+    struct stat st;
+
+    if(fileno(dfp) < 0 || fstat(fileno(dfp), &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        fprintf(stderr, "WARNING: the output is not a pipe, data copied to it\n");
+        return SFS_OK;
+    }
+    enc->vmsplice = 1;
+    fprintf(stderr, "Data handed to the output pipe with vmsplice\n");
+    return SFS_OK;
+}
+
+
+// Stream header, for sfsuz to know how to inflate the file later
+static void encoder_init_header(sfs_encoder_t *enc, const sfs_encoder_opts_t *opts) {
+    sfs_header_t *hdr = &enc->hdr;
+
+    // Streams with the default granularity and no typed ranges keep the version 2 header:
+    // the random_size_bytes value only
+    sfs_header_init(hdr);
+    hdr->random_size_bytes = enc->random_size * sizeof(int);
+    hdr->granularity = enc->granularity;
+    if(enc->patterns)
+        hdr->flags |= SFS_FLAG_TYPED_RANGES;
+    if(enc->dedup != NULL)
+        hdr->flags |= SFS_FLAG_TYPED_RANGES | SFS_FLAG_DEDUP;
+    if(enc->indexed)
+        hdr->flags |= SFS_FLAG_INDEX;
+    if(enc->base != NULL)
+        hdr->flags |= SFS_FLAG_TYPED_RANGES | SFS_FLAG_BASE;
+    if(opts->checksum)
+        hdr->flags |= SFS_FLAG_CHECKSUM;
+    if(opts->compact)
+        hdr->flags |= SFS_FLAG_COMPACT_BOUNDARIES;
+    if(opts->boundaries_first)
+        hdr->flags |= SFS_FLAG_BOUNDARIES_FIRST;
+    if(opts->codec != SFS_CODEC_NONE) {
+        hdr->flags |= SFS_FLAG_CODEC;
+        hdr->codec = opts->codec;
+    }
+    if(opts->shard_count > 1) {
+        hdr->flags |= SFS_FLAG_SHARD;
+        hdr->shard_offset = opts->shard_offset;
+        hdr->shard_index = opts->shard_index;
+        hdr->shard_count = opts->shard_count;
+    }
+    if(enc->granularity != BLK_SIZE || hdr->flags != 0) {
+        hdr->version = SFS_FORMAT_VERSION;
+        hdr->header_size = (hdr->flags & SFS_FLAG_SHARD) ? sizeof(sfs_header_t) : SFS_HEADER_NOSHARD_SIZE;
+    }
+}
+
+
+int sfs_encoder_open(sfs_encoder_t *enc, const sfs_encoder_opts_t *opts, FILE *dfp) {
+    size_t written;
+    int rc;
+
+    memset(enc, 0, sizeof(sfs_encoder_t));
+    enc->source_fd = -1;
+    enc->dfp = dfp;
+    enc->sig = opts->sig;
+    enc->base = opts->base;
+    rc = encoder_check_opts(opts);
+    if(rc != SFS_OK)
+        goto fail;
+    enc->atomic_block_size = opts->atomic_block_size;
+    enc->granularity = opts->granularity;
+    enc->chunk_size = opts->chunk_size;
+    enc->jobs = opts->jobs;
+    enc->read_bytes_keepalive = opts->read_bytes_keepalive;
+    enc->random_size = opts->random_size_bytes / sizeof(int);
+    enc->patterns = opts->patterns;
+    enc->indexed = opts->indexed;
+    enc->stats = opts->stats;
+
+    // We do not need a strong random generator, so we do not lose time initializing
+    // the random seed. Besides we want a repeatable process so the seed needs to stay
+    // the same: the sequence of rand() after srand(1), per encoder
+    initstate_r(1, enc->random_state, ENCODER_RANDOM_STATE_SIZE, &enc->random);
+    rc = SFS_ERR_NOMEM;
+    if(enc->random_size > 0) {
+        fprintf(stderr, "Random buffers activated!\n");
+        enc->random_buf = (int *) malloc(enc->random_size * sizeof(int));
+        if(enc->random_buf == NULL) {
+            fprintf(stderr, "Unable to allocate random buffer\n");
+            goto fail;
+        }
+    }
+
+    if(opts->dedup_table_size > 0 && (rc = encoder_open_dedup(enc, opts)) != SFS_OK)
+        goto fail;
+    if((enc->sig != NULL || enc->base != NULL) && (rc = encoder_open_signatures(enc)) != SFS_OK)
+        goto fail;
+
+    if(opts->vmsplice && (rc = encoder_open_vmsplice(enc, dfp)) != SFS_OK)
+        goto fail;
+
+    encoder_init_header(enc, opts);
+    written = sfs_header_write(dfp, &enc->hdr);
+    if(written == 0) {
+        fprintf(stderr, "Unable to write to destination\n");
+        rc = SFS_ERR_IO;
+        goto fail;
+    }
+    enc->footer.written += written;
+
+    // Room for a whole atomic block plus the chunk being read (and its alignment padding):
+    // a chunk is read right after the data already kept in the atomic block.
+    // The multithreaded pipeline reads in its own chunks instead
+    rc = SFS_ERR_NOMEM;
+    if(posix_memalign((void **) &enc->buffer, DIRECT_IO_ALIGN,
+                      enc->atomic_block_size + (enc->jobs > 0 ? 0 : enc->chunk_size + DIRECT_IO_ALIGN)) != 0) {
+        enc->buffer = NULL;
+        fprintf(stderr, "Unable to allocate buffer size correctly (%li required). "
+                "Decrease the block size.\n", enc->atomic_block_size + enc->chunk_size);
+        goto fail;
+    }
+
+    // The pipeline has its own runs array per slot
+    if(enc->jobs == 0) {
+        enc->runs = malloc(enc->chunk_size / enc->granularity * sizeof(sfs_run_t));
+        if(enc->runs == NULL) {
+            fprintf(stderr, "Unable to allocate memory for runs. Try decreasing read chunk size.\n");
+            goto fail;
+        }
+    }
+
+    zs_init();
+    fprintf(stderr, "Zero scan kernel: %s\n", zs_kernel_name());
+
+    // In the worst case scenario, there will be atomic_block_size/granularity + 2 boundaries,
+    // if data and sparse regions are all 1 block long. +2 is if we actually start with a sparse region
+    // The last bool is to make the max idx even, so that realloc activates correctly below if the
+    // max size computed here was anyhow wrong
+    enc->extend_meta = (enc->atomic_block_size / enc->granularity + 1) * 2;
+    enc->extend_meta *= sizeof(size_t);
+    fprintf(stderr, "Estimated boundary array max size in bytes: %li\n", enc->extend_meta);
+
+    enc->data_boundaries = malloc(enc->extend_meta);
+    if(enc->data_boundaries == NULL) {
+        fprintf(stderr, "Unable to allocate memory for data_boundaries. Try decreasing atomic block size.\n");
+        goto fail;
+    }
+    enc->meta_len += enc->extend_meta;
+
+    // Every typed range is at least one granule long
+    if(enc->hdr.flags & SFS_FLAG_TYPED_RANGES) {
+        enc->typed_max = enc->atomic_block_size / enc->granularity;
+        enc->typed = malloc(enc->typed_max * sizeof(sfs_typed_range_t));
+        if(enc->typed == NULL) {
+            fprintf(stderr, "Unable to allocate memory for typed ranges. Try decreasing atomic block size.\n");
+            goto fail;
+        }
+    }
+    if(enc->patterns)
+        fprintf(stderr, "Repeated patterns stripping activated!\n");
+
+    if(opts->codec != SFS_CODEC_NONE && (rc = encoder_open_codec(enc, opts)) != SFS_OK)
+        goto fail;
+    enc->meta_max_idx = enc->meta_len / sizeof(size_t);
+    assert( enc->meta_max_idx % 2 == 0);
+    // By convention, we start with sparse_mode off.
+    // For clarity, we explicitely set the first data_boundaries item to 0 as the first data offset
+    // (even if we could implictely skip it)
+    enc->data_boundaries[0] = 0;
+    enc->meta_idx++;
+    return SFS_OK;
+
+fail:
+    sfs_encoder_close(enc);
+    return rc;
+}
+
+
+int sfs_encoder_run(sfs_encoder_t *enc, sfs_reader_t *reader) {
+    size_t pos, hole;
+    ssize_t rb;
+
+    if(enc->finished || enc->pushed > 0)
+        return SFS_ERR_ARG;
+    if(enc->jobs > 0) {
+        fprintf(stderr, "Multithreaded pipeline with %d scan jobs\n", enc->jobs);
+        if(scanpipe_run(reader, enc->chunk_size, enc->granularity, enc->jobs, encoder_feed_slot, enc,
+                        enc->stats) != 0) {
+            fprintf(stderr, "Pipeline error\n");
+            return SFS_ERR_IO;
+        }
+        return SFS_OK;
+    }
+
+    do {
+        // Holes of the source are known to be zeros, no need to read them
+        hole = sfs_reader_skip_hole(reader);
+        if(hole == (size_t) -1) {
+            fprintf(stderr, "Unepxected error while reading from input\n");
+            return SFS_ERR_IO;
+        }
+        if(hole > 0) {
+            if(encoder_feed_hole(enc, hole)) {
+                fprintf(stderr, "Flush block error\n");
+                return SFS_ERR_IO;
+            }
+            encoder_report_progress(enc);
+        }
+        else {
+            pos = (enc->buf_offset + reader->align - 1) / reader->align * reader->align;
+            rb = sfs_reader_read(reader, enc->buffer + pos, enc->chunk_size);
+            if(rb < 0) {
+                fprintf(stderr, "Unepxected error while reading from input\n");
+                return SFS_ERR_IO;
+            }
+            if(encoder_feed_chunk(enc, enc->buffer + pos, rb)) {
+                fprintf(stderr, "Flush block error\n");
+                return SFS_ERR_IO;
+            }
+        }
+    } while(!reader->eof);
+    return SFS_OK;
+}
+
+
+int sfs_encoder_push(sfs_encoder_t *enc, const char *buf, size_t len) {
+    size_t n;
+
+    // Pushed chunks are scanned on the calling thread, right after the data kept
+    if(enc->finished || enc->jobs > 0)
+        return SFS_ERR_ARG;
+    while(len > 0) {
+        n = enc->chunk_size - enc->pushed;
+        if(n > len)
+            n = len;
+        memcpy(enc->buffer + enc->buf_offset + enc->pushed, buf, n);
+        enc->pushed += n;
+        buf += n;
+        len -= n;
+        if(enc->pushed < enc->chunk_size)
+            break;
+        enc->pushed = 0;
+        if(encoder_feed_chunk(enc, enc->buffer + enc->buf_offset, enc->chunk_size)) {
+            fprintf(stderr, "Flush block error\n");
+            return SFS_ERR_IO;
+        }
+    }
+    return SFS_OK;
+}
+
+
+int sfs_encoder_push_hole(sfs_encoder_t *enc, size_t len) {
+    size_t pushed = enc->pushed;
+
+    if(enc->finished || enc->jobs > 0 || pushed % enc->granularity != 0 || len % enc->granularity != 0)
+        return SFS_ERR_ARG;
+    enc->pushed = 0;
+    if((pushed > 0 && encoder_feed_chunk(enc, enc->buffer + enc->buf_offset, pushed)) ||
+       encoder_feed_hole(enc, len)) {
+        fprintf(stderr, "Flush block error\n");
+        return SFS_ERR_IO;
+    }
+    encoder_report_progress(enc);
+    return SFS_OK;
+}
+
+
+int sfs_encoder_finish(sfs_encoder_t *enc) {
+    size_t pos, written, pushed = enc->pushed;
+
+    if(enc->finished)
+        return SFS_ERR_ARG;
+    enc->finished = 1;
+
+    // Last pushed bytes, possibly not a whole granule
+    enc->pushed = 0;
+    if(pushed > 0 && encoder_feed_chunk(enc, enc->buffer + enc->buf_offset, pushed))
+        goto fail;
+
+    // Unlike trailing zeros, a trailing pattern must be restored: it is closed by an empty
+    // data range
+    if(enc->typed_open && encoder_start_data(enc))
+        goto fail;
+
+    // It may happen that the buffer is not empty. In such case we need to flush it
+    // one last time
+    if(enc->buf_offset > 0 || enc->ntyped > 0) {
+        fprintf(stderr, "Flushing last buffer to output\n");
+        /* If we were not in a copy case, relative_offset contains the number of zeros
+         * at the end of file. This number is redundant with the final footer read size.
+         * Thanks to the footer.read number we will know, when inflating, how many zeros
+         * we have to set in the end of file.
+         * It will just be discarded anyway because meta_idx % 2 == 0 (see flush block)
+         * So we may as well call flush block with relative offset-1
+         */
+        if(encoder_emit(enc))
+            goto fail;
+
+        enc->atomic_blocks++;
+        enc->data_cluster_nb += enc->meta_idx / 2 + (enc->meta_idx % 2 != 0);
+    }
+
+    if(encoder_drain(enc))
+        goto fail;
+    enc->footer.atomic_blocks = enc->atomic_blocks;
+
+    if(enc->dedup_bytes > 0)
+        fprintf(stderr, "%li bytes deduplicated\n", enc->dedup_bytes);
+    if(enc->base != NULL)
+        fprintf(stderr, "%li bytes unchanged since the base\n", enc->base_bytes);
+    if(enc->sig != NULL) {
+        if(sfs_sig_finish(enc->sig, enc->footer.read) != 0) {
+            fprintf(stderr, "Unable to write the signature file\n");
+            return SFS_ERR_IO;
+        }
+        fprintf(stderr, "%li granule signatures written\n", enc->sig->hdr.n);
+    }
+    if(enc->pool != NULL)
+        fprintf(stderr, "%li data bytes compressed to %li bytes\n", enc->raw_bytes, enc->stored_bytes);
+
+    if(enc->footer.read > 0) {
+        enc->footer.ratio = ((double) enc->footer.written/(double) enc->footer.read);
+    }
+
+    //Push next block: -1 marks the start of the final footer
+    pos = -1L;
+    written = fwrite(&pos, sizeof(size_t), 1, enc->dfp);
+    if(written != 1) {
+        fprintf(stderr, "Error declaring final footer\n");
+        return SFS_ERR_IO;
+    }
+    enc->footer.written += sizeof(size_t);
+
+    // The index is right before the footer, to be found from the end of the stream
+    if(enc->indexed) {
+        written = sfs_index_write(enc->dfp, &enc->index);
+        if(written == 0) {
+            fprintf(stderr, "Unable to write block index\n");
+            return SFS_ERR_IO;
+        }
+        enc->footer.written += written;
+        sfs_index_free(&enc->index);
+    }
+
+    enc->footer.written += sizeof(sfs_footer_t);
+    written = fwrite((void *) &enc->footer, sizeof(sfs_footer_t), 1, enc->dfp);
+    if(written != 1 || fflush(enc->dfp) != 0) {
+        fprintf(stderr, "Unable to write final footer correctly\n");
+        return SFS_ERR_IO;
+    }
+    encoder_update_stats(enc, 0);
+    return SFS_OK;
+
+fail:
+    fprintf(stderr, "Flush block error\n");
+    return SFS_ERR_IO;
+}
+
+
+void sfs_encoder_close(sfs_encoder_t *enc) {
+    clean_codec(enc);
+    clean_dedup(enc);
+    clean_signatures(enc);
+    sfs_index_free(&enc->index);
+    free_all_mem(5, (void *) enc->buffer, (void *) enc->data_boundaries, (void *) enc->random_buf,
+                 (void *) enc->typed, (void *) enc->runs);
+    enc->buffer = NULL;
+    enc->data_boundaries = NULL;
+    enc->random_buf = NULL;
+    enc->typed = NULL;
+    enc->runs = NULL;
+}
@@ -0,0 +1,293 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <block.h>
+#include <image.h>
+#include <index.h>
+#include <sfs.h>
+
+#define IMAGE_FREE_SLOT ((size_t) -1)
+
+
+int sfs_image_open(sfs_image_t *img, const char *path, size_t cache_blocks) {
+    size_t rb, i;
+
+    memset(img, 0, sizeof(sfs_image_t));
+    img->sfp = fopen(path, "rb");
+    if(img->sfp == NULL) {
+        fprintf(stderr, "Unable to open %s for reading\n", path);
+        return -1;
+    }
+    rb = sfs_header_read(img->sfp, &img->hdr);
+    if(rb == 0)
+        return -1;
+    // Unchanged ranges are only in the base image
+    if(img->hdr.flags & SFS_FLAG_BASE) {
+        fprintf(stderr, "Incremental images cannot be read on their own\n");
+        return -1;
+    }
+    if(sfs_index_open(img->sfp, &img->hdr, rb, &img->idx, &img->footer) != 0)
+        return -1;
+
+    if(img->hdr.random_size_bytes > 0) {
+        img->random_buf = malloc(img->hdr.random_size_bytes);
+        if(img->random_buf == NULL) {
+            fprintf(stderr, "Unable to allocate random buffer\n");
+            return -1;
+        }
+    }
+    img->cache = calloc(cache_blocks, sizeof(sfs_image_slot_t));
+    if(img->cache == NULL) {
+        fprintf(stderr, "Unable to allocate the block cache\n");
+        return -1;
+    }
+    img->ncache = cache_blocks;
+    for(i=0; i<img->ncache; i++)
+        img->cache[i].block = IMAGE_FREE_SLOT;
+    return 0;
+}
+
+
+size_t sfs_image_size(const sfs_image_t *img) {
+    return img->footer.read;
+}
+
+
+// Read and check a block, into the cache. Returns the cache slot, -1 on failure
+static ssize_t image_load(sfs_image_t *img, size_t b) {
+    const sfs_index_entry_t *e = &img->idx.entries[b];
+    sfs_image_slot_t *slot, *victim = NULL;
+    size_t i, len, data;
+    void *p;
+
+    for(i=0; i<img->ncache; i++) {
+        slot = &img->cache[i];
+        if(slot->block == b) {
+            slot->last_use = ++img->uses;
+            return i;
+        }
+        if(!slot->pinned && (victim == NULL || slot->last_use < victim->last_use))
+            victim = slot;
+    }
+
+    // All blocks in use by copies in progress
+    if(victim == NULL) {
+        p = realloc(img->cache, (img->ncache + 1) * sizeof(sfs_image_slot_t));
+        if(p == NULL) {
+            fprintf(stderr, "Unable to extend the block cache\n");
+            return -1;
+        }
+        img->cache = p;
+        victim = &img->cache[img->ncache++];
+        memset(victim, 0, sizeof(sfs_image_slot_t));
+    }
+
+    victim->block = IMAGE_FREE_SLOT;
+    if(fseeko(img->sfp, e->stream_offset, SEEK_SET) != 0 ||
+       sfs_block_read(img->sfp, &img->hdr, img->random_buf, &victim->blk) != BLOCK_OK ||
+       sfs_block_decode(&img->hdr, &victim->blk) != BLOCK_OK) {
+        fprintf(stderr, "Unable to read atomic block %li\n", b);
+        return -1;
+    }
+
+    for(i=0, len=0, data=0; i<victim->blk.meta_idx; i++) {
+        len += victim->blk.boundaries[i];
+        if(i % 2 != 0)
+            data += victim->blk.boundaries[i];
+    }
+    if(len != e->len || data != victim->blk.size) {
+        fprintf(stderr, "Unconsistent data: atomic block %li differs from the block map\n", b);
+        return -1;
+    }
+    victim->block = b;
+    victim->last_use = ++img->uses;
+    return victim - img->cache;
+}
+
+
+// Overlap of [pos, pos+len[ with [off, end[, 0 if none
+static size_t image_clip(size_t pos, size_t len, size_t off, size_t end, size_t *from) {
+    *from = pos > off ? pos : off;
+    if(pos + len < end)
+        end = pos + len;
+    return end > *from ? end - *from : 0;
+}
+
+
+// Fill len bytes with word repeated from pos on
+static void image_fill(char *buf, size_t len, u_int64_t word, size_t pos) {
+    char w[2 * sizeof(u_int64_t)];
+    size_t n;
+
+    memcpy(w, &word, sizeof(u_int64_t));
+    memcpy(w + sizeof(u_int64_t), &word, sizeof(u_int64_t));
+    for(; len > 0; buf += n, len -= n) {
+        n = len < sizeof(u_int64_t) ? len : sizeof(u_int64_t);
+        memcpy(buf, w + pos % sizeof(u_int64_t), n);
+    }
+}
+
+
+// Read [off, end[ out of block b, buf standing for off
+static int image_read_block(sfs_image_t *img, size_t b, char *buf, size_t off, size_t end) {
+    sfs_typed_range_t *typed;
+    sfs_block_t *blk;
+    ssize_t s;
+    size_t i, t = 0, pos, atomic_read = 0, from, n, seek, len;
+    int rc = 0;
+
+    s = image_load(img, b);
+    if(s < 0)
+        return -1;
+    img->cache[s].pinned++;
+
+    pos = img->idx.entries[b].offset;
+    for(i=0; i<img->cache[s].blk.meta_idx && pos < end && rc == 0; i+=2) {
+        // The cache may have been extended by a copy
+        blk = &img->cache[s].blk;
+        seek = blk->boundaries[i];
+        len = blk->boundaries[i+1];
+        typed = (t < blk->ntyped && blk->typed[t].slot == i) ? &blk->typed[t++] : NULL;
+
+        n = image_clip(pos, seek, off, end, &from);
+        if(n == 0) {
+            // Out of the range
+        }
+        else if(typed == NULL) {
+            memset(buf + from - off, 0, n);
+        }
+        else if(typed->kind == SFS_RANGE_PATTERN) {
+            image_fill(buf + from - off, n, (u_int64_t) typed->arg, from - pos);
+        }
+        else if(typed->arg + seek > pos) {
+            fprintf(stderr, "Unconsistent data: copy of [%li, %li[ at offset %li\n",
+                    typed->arg, typed->arg + seek, pos);
+            rc = -1;
+        }
+        else {
+            rc = sfs_image_pread(img, buf + from - off, n, typed->arg + from - pos);
+        }
+        pos += seek;
+
+        n = image_clip(pos, len, off, end, &from);
+        if(n > 0)
+            memcpy(buf + from - off, img->cache[s].blk.data + atomic_read + from - pos, n);
+        pos += len;
+        atomic_read += len;
+    }
+    img->cache[s].pinned--;
+    return rc;
+}
+
+
+int sfs_image_pread(sfs_image_t *img, char *buf, size_t len, size_t off) {
+    const sfs_index_entry_t *e;
+    size_t b, n;
+
+    while(len > 0) {
+        b = sfs_index_find(&img->idx, off);
+        // Trailing zeros
+        if(b == img->idx.n) {
+            memset(buf, 0, len);
+            return 0;
+        }
+        e = &img->idx.entries[b];
+        n = e->offset + e->len - off;
+        if(n > len)
+            n = len;
+        if(image_read_block(img, b, buf, off, off + n) != 0)
+            return -1;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Report the pending extent once a range of the other kind is met
+static int image_extent(size_t *ext_off, size_t *ext_len, int *ext_zero, size_t off, size_t len, int zero,
+                        sfs_extent_cb cb, void *ctx) {
+    if(len == 0)
+        return 0;
+    if(*ext_len > 0 && *ext_zero == zero) {
+        *ext_len += len;
+        return 0;
+    }
+    if(*ext_len > 0 && cb(ctx, *ext_off, *ext_len, *ext_zero) != 0)
+        return -1;
+    *ext_off = off;
+    *ext_len = len;
+    *ext_zero = zero;
+    return 0;
+}
+
+
+int sfs_image_extents(sfs_image_t *img, size_t off, size_t len, sfs_extent_cb cb, void *ctx) {
+    size_t end = off + len, b, i, t, pos, from, n, ext_off = 0, ext_len = 0;
+    int ext_zero = 0, typed;
+    sfs_block_t *blk = &img->meta;
+
+    for(b = sfs_index_find(&img->idx, off); b < img->idx.n && img->idx.entries[b].offset < end; b++) {
+        if(fseeko(img->sfp, img->idx.entries[b].stream_offset, SEEK_SET) != 0 ||
+           sfs_block_read_meta(img->sfp, &img->hdr, blk) != BLOCK_OK) {
+            fprintf(stderr, "Unable to read atomic block %li metadata\n", b);
+            return -1;
+        }
+        pos = img->idx.entries[b].offset;
+        for(i=0, t=0; i<blk->meta_idx && pos < end; i+=2) {
+            typed = t < blk->ntyped && blk->typed[t].slot == i;
+            t += typed;
+            n = image_clip(pos, blk->boundaries[i], off, end, &from);
+            if(image_extent(&ext_off, &ext_len, &ext_zero, from, n, !typed, cb, ctx) != 0)
+                return -1;
+            pos += blk->boundaries[i];
+            n = image_clip(pos, blk->boundaries[i+1], off, end, &from);
+            if(image_extent(&ext_off, &ext_len, &ext_zero, from, n, 0, cb, ctx) != 0)
+                return -1;
+            pos += blk->boundaries[i+1];
+        }
+    }
+
+    // Trailing zeros
+    pos = img->idx.n > 0 ? img->idx.entries[img->idx.n-1].offset + img->idx.entries[img->idx.n-1].len : 0;
+    n = image_clip(pos, img->footer.read - pos, off, end, &from);
+    if(image_extent(&ext_off, &ext_len, &ext_zero, from, n, 1, cb, ctx) != 0)
+        return -1;
+    if(ext_len > 0)
+        return cb(ctx, ext_off, ext_len, ext_zero);
+    return 0;
+}
+
+
+void sfs_image_close(sfs_image_t *img) {
+    size_t i;
+
+    for(i=0; i<img->ncache; i++)
+        sfs_block_free(&img->cache[i].blk);
+    sfs_block_free(&img->meta);
+    sfs_index_free(&img->idx);
+    free_all_mem(2, (void *) img->cache, img->random_buf);
+    img->cache = NULL;
+    img->random_buf = NULL;
+    img->ncache = 0;
+    close_all_files(1, img->sfp);
+    img->sfp = NULL;
+}
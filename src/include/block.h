@@ -0,0 +1,149 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_BLOCK_H
+#define SFS_BLOCK_H
+
+#include <stdio.h>
+
+#include <sfs.h>
+
+#define MAX_ATOMIC_BLOCK_SIZE 4294967296
+
+#define BLOCK_OK     0
+#define BLOCK_END    1  // The footer marker was read instead of a block
+#define BLOCK_ERROR -1
+
+/* Typed ranges. With SFS_FLAG_TYPED_RANGES, every block carries, between its data and
+ * its boundaries, a table of ntyped entries {slot, kind, arg, check}: the sparse range
+ * at boundaries index slot is not made of zeros but of what kind says. Slots are even,
+ * at least 2 and increasing. A data range between two sparse ranges may then be 0
+ * bytes long if any of them is typed, pattern ranges are a multiple of 8 bytes long.
+ */
+#define SFS_RANGE_PATTERN   1   // arg is an 8-byte word repeated over the whole range
+/* Copy of the range restored at offset arg (SFS_FLAG_DEDUP streams only). The range is
+ * made of whole granules and check is sfs_hash_fold() of their sfs_hash64(), in order
+ */
+#define SFS_RANGE_COPY      2
+/* Range left as is on the destination, expected to hold the base image the stream was
+ * made against (SFS_FLAG_BASE streams only). Made of whole granules, check as for copies
+ */
+#define SFS_RANGE_BASE      3
+
+/* Block checksum. With SFS_FLAG_CHECKSUM, every block ends, after its boundaries, with
+ * a 64 bits checksum of everything else it is made of, as stored in the stream: each
+ * part (size word, random buffer, compressed size word and data, typed range number and
+ * table, boundary number, packed size and boundaries) is hashed in turn with sfs_hash64(),
+ * seeded with the hash of the parts before it, starting from 0.
+ */
+
+/* Compact boundaries. With SFS_FLAG_COMPACT_BOUNDARIES, the boundary number is followed
+ * by the size in bytes of the packed boundaries, then by the boundaries as unsigned LEB128
+ * varints: the length in granules shifted left by one, or, for the lengths that are not a
+ * multiple of the granularity (the last data range of a stream), the length in bytes
+ * shifted left by one with the low bit set. Lengths are already deltas of the restored
+ * offsets, so most of them fit in one or two bytes.
+ */
+/* Boundaries first. With SFS_FLAG_BOUNDARIES_FIRST, the typed ranges and the boundaries
+ * of every block come right after its random buffer, and its data after them: a reader
+ * then knows where each data byte goes before reading it, and can write it out as it
+ * comes. Such streams are not compressed by sfsz. The checksum still ends the block,
+ * covering the same parts in their stream order, but the data is hashed in pieces of
+ * SFS_DATA_PIECE_SIZE bytes (the last one possibly shorter), for a reader to verify it
+ * without holding it whole.
+ */
+#define SFS_DATA_PIECE_SIZE 1048576
+
+// Checksum of the data of a block, chained to check as described above
+u_int64_t sfs_block_sum_data(const sfs_header_t *hdr, const void *buf, size_t len, u_int64_t check);
+
+#define SFS_VARINT_MAX_BYTES 10 // Longest packed boundary
+
+// Pack n boundaries into out (n * SFS_VARINT_MAX_BYTES long). Returns the packed size
+size_t sfs_boundaries_encode(const size_t *boundaries, size_t n, size_t granularity, unsigned char *out);
+
+/* Unpack exactly n boundaries from the len bytes of in, with bound checks.
+ * Returns 0 on success, -1 on truncated, overlong or trailing data
+ */
+int sfs_boundaries_decode(const unsigned char *in, size_t len, size_t granularity, size_t *boundaries,
+                          size_t n);
+
+typedef struct sfs_typed_range {
+    size_t slot;
+    size_t kind;
+    size_t arg;
+    size_t check;           // Verification of the restored range, 0 if the kind has none
+} sfs_typed_range_t;
+
+/* One atomic block, as read from a sfs stream. Buffers are reused (and only grown)
+ * from one block to the next.
+ */
+typedef struct sfs_block {
+    size_t size;            // Dense data bytes
+    char *data;
+    size_t data_cap;
+    size_t *boundaries;     // Alternating sparse and data range lengths, see doc
+    size_t meta_idx;        // Number of boundaries
+    size_t meta_cap;
+    sfs_typed_range_t *typed;
+    size_t ntyped;
+    size_t typed_cap;
+    char *stored;           // Compressed data, with SFS_FLAG_CODEC
+    size_t stored_len;
+    size_t stored_cap;
+    int encoded;            // The data is still in stored, see sfs_block_decode()
+    size_t stream_bytes;    // Bytes this block takes in the stream
+    u_int64_t checksum;     // Checksum of the parts read so far, with SFS_FLAG_CHECKSUM
+    unsigned char *packed;  // Packed boundaries, with SFS_FLAG_COMPACT_BOUNDARIES
+    size_t packed_cap;
+} sfs_block_t;
+
+/* Read and sanity check the next atomic block from sfp, as described by the stream
+ * header, and verify its checksum if it has one. random_buf is used to discard the
+ * random buffer of every block if any.
+ * With SFS_FLAG_CODEC, the data is stored as {stored_len, stored bytes}, stored as is
+ * when stored_len is the data size: otherwise the block is left encoded, to be
+ * decoded (possibly by another thread) by sfs_block_decode().
+ * Returns BLOCK_OK, BLOCK_END or BLOCK_ERROR.
+ */
+int sfs_block_read(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk);
+
+/* Same as sfs_block_read() without the data, seeked past on a seekable stream:
+ * only the size, the typed ranges and the boundaries are read, the checksum
+ * being skipped unverified.
+ * Returns BLOCK_OK, BLOCK_END or BLOCK_ERROR.
+ */
+int sfs_block_read_meta(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk);
+
+/* Read the next atomic block of a SFS_FLAG_BOUNDARIES_FIRST stream up to its data: its
+ * size, typed ranges and boundaries are sanity checked, sfp being left at the first data
+ * byte. The caller then reads the size bytes of data, passing each piece of them in order
+ * to sfs_block_sum(), and ends the block with sfs_block_read_tail().
+ * Returns BLOCK_OK, BLOCK_END or BLOCK_ERROR.
+ */
+int sfs_block_read_head(FILE *sfp, const sfs_header_t *hdr, void *random_buf, sfs_block_t *blk);
+
+// Account for a piece of data read after sfs_block_read_head(), in the stream bytes and checksum
+void sfs_block_sum(const sfs_header_t *hdr, sfs_block_t *blk, const void *buf, size_t len);
+
+// Read the end of a block after its data, verifying its checksum. Returns BLOCK_OK or BLOCK_ERROR
+int sfs_block_read_tail(FILE *sfp, const sfs_header_t *hdr, sfs_block_t *blk);
+
+// Decompress the data of an encoded block. Returns BLOCK_OK or BLOCK_ERROR
+int sfs_block_decode(const sfs_header_t *hdr, sfs_block_t *blk);
+
+void sfs_block_free(sfs_block_t *blk);
+
+#endif
@@ -0,0 +1,110 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_CODEC_H
+#define SFS_CODEC_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Per atomic block compression codecs. Every block's data is compressed on its
+ * own, so that blocks are compressed and decompressed independently, on as many
+ * threads as needed. Codecs are optional at build time (make ZSTD=1 LZ4=1): a
+ * stream can only be restored by a sfsuz built with the codec it uses.
+ */
+#define SFS_CODEC_NONE      0
+#define SFS_CODEC_ZSTD      1
+#define SFS_CODEC_LZ4       2
+
+#define DEFAULT_CODEC_THREADS   2
+#define MAX_CODEC_THREADS       256
+#define LZ4_HC_MIN_LEVEL        3 // lz4 levels from which LZ4HC is used, whatever the library version
+
+// Codec id by name ("zstd", "lz4"), -1 if unknown or not built in
+int sfs_codec_by_name(const char *name);
+
+const char *sfs_codec_name(int codec);
+
+// Whether the codec is built in
+int sfs_codec_available(int codec);
+
+// Default compression level of the codec
+int sfs_codec_default_level(int codec);
+
+// Size of the buffer needed to compress len bytes
+size_t sfs_codec_bound(int codec, size_t len);
+
+/* Compress len bytes of src into dst (cap bytes). Returns the compressed size, or 0
+ * when compression failed or did not spare anything: the data is then stored as is
+ */
+size_t sfs_codec_compress(int codec, int level, const void *src, size_t len, void *dst, size_t cap);
+
+// Decompress exactly raw_len bytes into dst. Returns 0 on success, -1 on failure
+int sfs_codec_decompress(int codec, const void *src, size_t len, void *dst, size_t raw_len);
+
+/* Ordered compression pool. The caller fills the slots in order, worker threads
+ * compress them concurrently and the caller gets them back in the same order to
+ * write them out. Memory is bounded by the number of slots.
+ */
+#define CODEC_SLOT_FREE         0
+#define CODEC_SLOT_QUEUED       1
+#define CODEC_SLOT_COMPRESSING  2
+#define CODEC_SLOT_DONE         3
+
+typedef struct sfs_codec_slot {
+    char *raw;
+    size_t raw_len;
+    char *out;
+    size_t out_len;     // Compressed size, 0 if the data is to be stored as is
+    int state;
+} sfs_codec_slot_t;
+
+typedef struct sfs_codec_pool {
+    int codec;
+    int level;
+    sfs_codec_slot_t *slots;
+    size_t nslots;
+    size_t next_fill;   // Slot numbers, growing forever: slot index is number % nslots
+    size_t next_job;
+    size_t next_done;
+    pthread_t *threads;
+    int nthreads;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sfs_codec_pool_t;
+
+/* Start nthreads workers over nthreads + 1 slots, each able to hold raw_size bytes.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_codec_pool_start(sfs_codec_pool_t *pool, int codec, int level, int nthreads, size_t raw_size);
+
+// Next slot to fill, NULL if all of them are in use: the oldest one must be retired first
+sfs_codec_slot_t *sfs_codec_pool_next(sfs_codec_pool_t *pool);
+
+// Queue the slot returned by the last sfs_codec_pool_next()
+void sfs_codec_pool_submit(sfs_codec_pool_t *pool);
+
+// Wait for the oldest queued slot to be compressed and return it, NULL if none is queued
+sfs_codec_slot_t *sfs_codec_pool_retire(sfs_codec_pool_t *pool);
+
+// Free the slot returned by the last sfs_codec_pool_retire(), once written out
+void sfs_codec_pool_release(sfs_codec_pool_t *pool);
+
+// Stop the workers and release all slots. Safe to call on a failed start
+void sfs_codec_pool_stop(sfs_codec_pool_t *pool);
+
+#endif
@@ -0,0 +1,82 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_DECODER_H
+#define SFS_DECODER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <dst.h>
+#include <prefetch.h>
+#include <restore.h>
+#include <sfs.h>
+#include <stats.h>
+
+// Decoder options, see sfsuz for what they do
+typedef struct sfs_decoder_opts {
+    size_t inflight;
+    unsigned uring_depth;
+    size_t merge_size;
+    int jobs;
+    sfs_window_t win;
+    int ranged;                 // win was given, only a range is restored
+    int onto_base;
+    int diff;                   // Only write what differs from the destination
+    const char *src_path;       // Reopened by the parallel restore, NULL if the stream is not a file
+    sfs_stats_t *stats;
+} sfs_decoder_opts_t;
+
+typedef struct sfs_decoder {
+    sfs_decoder_opts_t opts;
+    FILE *sfp;
+    const char *dst_path;
+    sfs_dst_t dst;
+    sfs_header_t hdr;
+    sfs_prefetch_t pf;
+    sfs_index_t idx;            // Loaded for parallel and indexed ranged restores only
+    sfs_footer_t *footp;        // Known from the index, or read at the end of the stream
+    int seekable;
+    int piped;                  // sfp is an unbuffered pipe, data can be spliced from it
+    int streamed;               // Boundaries first stream, restored as it is read
+    size_t total_read;
+    size_t inflated;
+    size_t atomic_blocks;
+} sfs_decoder_t;
+
+/* Decoder of a sparse stream read from sfp (see sfs_fopen_callbacks() to read it from
+ * anywhere else), restored to the file or block device at dst_path: restores need
+ * positional writes and hole punching, so the destination is not a stream.
+ * Functions return SFS_OK or a negative SFS_ERR_* code, details being logged on stderr.
+ */
+
+// Fill opts with the default values, sfsuz ones
+void sfs_decoder_opts_init(sfs_decoder_opts_t *opts);
+
+// Open the destination (without truncating it), read the stream header and check the options
+int sfs_decoder_open(sfs_decoder_t *dec, const sfs_decoder_opts_t *opts, FILE *sfp, const char *dst_path);
+
+// Restore the stream, checking it against its footer. sfp is not closed
+int sfs_decoder_run(sfs_decoder_t *dec);
+
+void sfs_decoder_close(sfs_decoder_t *dec);
+
+/* Read the whole stream from its start as sfsuz does, block checksums and compressed
+ * data included, without writing anything, and check it against footerp
+ */
+int sfs_decoder_verify(FILE *sfp, const sfs_footer_t *footerp);
+
+#endif
@@ -0,0 +1,182 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_DST_H
+#define SFS_DST_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <sfs.h>
+#include <stats.h>
+#include <uring.h>
+
+#define DEFAULT_URING_DEPTH 32
+#define DST_ZERO_BUF_SIZE   8388608  // Zeros written at once when no faster zeroing works
+#define DST_FILL_BUF_SIZE   1048576  // Pattern bytes written at once
+#define DST_FILL_WORD_SIZE  8        // Patterns are repeated 64 bits words
+#define DST_COPY_BUF_SIZE   1048576  // Bytes copied at once from an earlier range
+#define DST_MAX_IOV         64       // Ranges gathered in a single write
+#define DST_MAX_ZERO_ALIGN  1048576  // Coarser discard granularities are left to the kernel
+#define DST_DIFF_BUF_SIZE   1048576  // Destination bytes read at once to be compared, with diff
+#define DST_DIFF_BLOCK_SIZE 4096     // Unit compared, written or zeroed only if it differs
+
+/* Zeroing methods, from the fastest to the slowest. Every destination starts
+ * with the first one applying to it and moves down the list whenever the
+ * current one fails, the range being zeroed again with the next one.
+ */
+#define DST_ZERO_PUNCH      0 // fallocate(FALLOC_FL_PUNCH_HOLE)
+#define DST_ZERO_RANGE      1 // fallocate(FALLOC_FL_ZERO_RANGE)
+#define DST_ZERO_BLKZEROOUT 2 // Block devices only
+#define DST_ZERO_WRITE      3 // Writes from a preallocated zero buffer
+
+#define DST_OP_WRITE        0
+#define DST_OP_FILL         1 // Write from a zero or pattern buffer, repeated until len is written
+#define DST_OP_FALLOCATE    2
+
+/* Ranges are only punched or zeroed from and to aligned offsets: multiples
+ * of zero_align (the discard granularity or logical sector size of a block device, the
+ * block size of the filesystem of a file) minus zero_shift. Their unaligned edges are
+ * written. The SFS_DISCARD environment variable, set to granularity:alignment, forces
+ * them for any destination (mostly useful for testing).
+ */
+typedef struct dst_info_t {
+    u_int8_t zero_method;       // Current DST_ZERO_* method, cached for the whole restore
+    u_int8_t block_device;
+    u_int32_t zero_align;
+    u_int32_t zero_shift;       // Aligned offsets are at discard_alignment modulo zero_align
+} dst_info_t;
+
+typedef struct dst_op {
+    off_t off;
+    const char *buf;
+    size_t len;         // Bytes still to write (or to zero)
+    size_t submitted;   // Bytes asked to the kernel by the last submission
+    int kind;           // DST_OP_*
+    int method;         // DST_ZERO_* method of a DST_OP_FALLOCATE
+    size_t fill_size;   // Bytes of buf written at once by a DST_OP_FILL
+    size_t phase;       // Position in the pattern word of a DST_OP_FILL
+    struct iovec iov[DST_MAX_IOV]; // Ranges of a DST_OP_WRITE, from iov_idx on
+    int iov_idx;
+    int niov;
+    u_int64_t issued;   // Submission time of a DST_OP_FALLOCATE, with stats
+} dst_op_t;
+
+/* Restore destination. All writes and zeroings are positional, so the
+ * destination never has to be seeked around.
+ *
+ * With io_uring, writes and zeroings are only queued: up to uring_depth of them
+ * are in flight at once (all the ranges of an atomic block, typically), and
+ * sfs_dst_drain() must be called before the buffers they point to are reused.
+ * Without io_uring, every operation completes before returning.
+ *
+ * Contiguous operations are coalesced before being issued: successive zero
+ * ranges, even across atomic blocks, are zeroed at once when some data is
+ * written after them (or at the end), and holes up to merge_size bytes
+ * between two data ranges are written as zeros, along with the data, by a
+ * single vectored write.
+ *
+ * With diff, the destination is read before being written: only the
+ * DST_DIFF_BLOCK_SIZE blocks that differ are written, and only the ones not
+ * reading back as zeros already are zeroed (holes of a file are not even read).
+ * Holes are then never merged with the data around them.
+ */
+typedef struct sfs_dst {
+    int fd;
+    dst_info_t info;
+    int uring;
+    unsigned uring_depth;
+    sfs_uring_t ring;
+    dst_op_t *ops;
+    unsigned *free_ops;
+    unsigned nfree;
+    char *zeros;
+    char *fill;                 // Pattern buffer, lazily allocated
+    char *copy;                 // Copy buffer, lazily allocated
+    u_int64_t fill_word;
+    int error;
+    size_t merge_size;
+    off_t zero_off;             // Pending zero range
+    size_t zero_len;
+    off_t write_off;            // Pending write
+    size_t write_len;
+    struct iovec write_iov[DST_MAX_IOV];
+    int write_niov;
+    sfs_stats_t *stats;         // Wait times and zeroing calls, NULL without stats
+    off_t base;                 // Added to every offset given, the offset of the shard restored
+    int diff;                   // Leave what the destination already holds as it is, see above
+    char *diff_buf;             // Destination bytes compared, lazily allocated
+} sfs_dst_t;
+
+/* Open (without truncating it) or create the destination, for reading too so that
+ * restored ranges can be copied. Offsets are counted from base, 0 once opened.
+ * With uring_depth > 0, io_uring is used if available, otherwise we fall back on
+ * plain syscalls.
+ * merge_size (at most DST_ZERO_BUF_SIZE) is the size up to which holes between
+ * data are written rather than zeroed, 0 to always zero them.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_dst_open(sfs_dst_t *dst, const char *path, unsigned uring_depth, size_t merge_size);
+
+/* Write len bytes at off. buf must stay untouched until the next sfs_dst_drain().
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_dst_write(sfs_dst_t *dst, off_t off, const char *buf, size_t len);
+
+/* Make [off, off+len[ read back as zeros, with the fastest method supported by
+ * the destination. Returns 0 on success, -1 on failure
+ */
+int sfs_dst_zero(sfs_dst_t *dst, off_t off, size_t len);
+
+/* Make [off, off+len[ read back as word repeated from off on, in the host byte
+ * order. A zero word is zeroed as sfs_dst_zero() does.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_dst_fill(sfs_dst_t *dst, off_t off, size_t len, u_int64_t word);
+
+/* Copy len bytes restored at src to off. The source range must be before off and
+ * len a multiple of granularity: *check is set to sfs_hash_fold() of the
+ * sfs_hash64() of the copied granules, for the caller to verify the copy.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_dst_copy(sfs_dst_t *dst, off_t off, off_t src, size_t len, size_t granularity,
+                 u_int64_t *check);
+
+/* Move len bytes from the pipe fd straight to off, with splice(2), once everything queued
+ * before is done. *spliced is set to the bytes moved. Returns 0 on success, 1 if the
+ * destination does not support splicing (the rest being left in the pipe), -1 on failure
+ */
+int sfs_dst_splice(sfs_dst_t *dst, int fd, off_t off, size_t len, size_t *spliced);
+
+/* Issue the pending write and wait for all queued operations. The pending zero
+ * range is kept, to be extended by the next zero ranges.
+ * Returns 0 on success, -1 if any failed
+ */
+int sfs_dst_drain(sfs_dst_t *dst);
+
+/* Issue everything still pending and wait for it. The destination is written
+ * up to end: if it ends with a zero range, its last bytes are written rather
+ * than zeroed so that a regular file is extended to its full size.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_dst_finish(sfs_dst_t *dst, off_t end);
+
+// Current destination size, base included, -1 on failure. Queued operations must be drained first
+off_t sfs_dst_size(sfs_dst_t *dst);
+
+void sfs_dst_close(sfs_dst_t *dst);
+
+#endif
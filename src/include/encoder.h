@@ -0,0 +1,184 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_ENCODER_H
+#define SFS_ENCODER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <codec.h>
+#include <index.h>
+#include <reader.h>
+#include <sfs.h>
+#include <signature.h>
+#include <stats.h>
+#include <zeroscan.h>
+
+#define DEFAULT_ATOMIC_BLOCK_SIZE   268435456
+#define ENCODER_RANDOM_STATE_SIZE   128 // Same generator as rand(), per encoder
+#define DEDUP_EMPTY ((size_t) -1)
+
+// Last granule met with a given fingerprint
+typedef struct sfs_dedup_entry {
+    u_int64_t hash;
+    size_t offset;          // Source offset, DEDUP_EMPTY for free entries
+} sfs_dedup_entry_t;
+
+
+// Block metadata waiting, along with the block data in a codec slot, to be written out
+typedef struct sfs_pending_block {
+    size_t *boundaries;
+    size_t boundaries_cap;
+    size_t meta_idx;
+    size_t closure_offset;
+    sfs_typed_range_t *typed;
+    size_t ntyped;
+    size_t logical_len;
+} sfs_pending_block_t;
+
+
+/* Encoder options, see sfsz for what they do. sig and base are opened by the caller,
+ * then owned by the encoder: sig is finished and both are closed by it
+ */
+typedef struct sfs_encoder_opts {
+    size_t atomic_block_size;
+    size_t granularity;
+    size_t chunk_size;          // Bytes scanned at once, a multiple of the granularity
+    size_t random_size_bytes;
+    size_t read_bytes_keepalive;
+    int patterns;
+    size_t dedup_table_size;    // 0 without deduplication
+    int source_fd;              // Read back by the deduplication, which is disabled if not seekable
+    int codec;
+    int codec_level;
+    int codec_threads;
+    int indexed;
+    int checksum;
+    int compact;
+    int boundaries_first;
+    int jobs;                   // Scan threads of sfs_encoder_run(), 0 to scan on the calling thread
+    int vmsplice;               // Hand the data to the output pipe by reference, see sfsz --vmsplice
+    size_t shard_offset;        // With shard_count > 1, the stream is the shard of the source starting there
+    size_t shard_index;
+    size_t shard_count;
+    sfs_sig_t *sig;
+    sfs_sig_t *base;
+    sfs_stats_t *stats;
+} sfs_encoder_opts_t;
+
+
+/* Atomic block builder state.
+ * Source data is read in big chunks straight into the atomic block buffer, at the
+ * current buf_offset, then scanned in place: dense runs are compacted down to buf_offset
+ * and zero runs only move the boundaries. As the compacted data never grows faster
+ * than what was read, the destination never overlaps the data still to be processed.
+ */
+typedef struct sfs_encoder {
+    char *buffer;
+    size_t atomic_block_size;
+    size_t granularity;     // Sparse detection granularity
+    size_t buf_offset;
+    size_t *data_boundaries;
+    size_t meta_idx;
+    size_t meta_len;
+    size_t meta_max_idx;
+    size_t extend_meta;
+    // Storing relative offsets instead of the absolute ones will probably be more perf
+    // when calling fseek from seek_cur
+    size_t relative_offset;
+    unsigned int sparse_on;
+    size_t read_bytes_keepalive;
+    size_t read_since_last_flush;
+    size_t random_size;
+    int *random_buf;
+    struct random_data random;
+    char random_state[ENCODER_RANDOM_STATE_SIZE];
+    size_t atomic_blocks;
+    size_t data_cluster_nb;
+    size_t last_report;
+    sfs_footer_t footer;
+    FILE *dfp;
+    int patterns;               // Repeated word granules are stripped as typed ranges
+    sfs_typed_range_t *typed;   // Typed ranges of the current atomic block, NULL without patterns
+    size_t ntyped;
+    size_t typed_max;           // Table size, the atomic block is flushed when it is full
+    int typed_open;             // The current sparse range is the last typed one
+    sfs_dedup_entry_t *dedup;   // Direct mapped fingerprint table, NULL without deduplication
+    size_t dedup_mask;
+    int source_fd;              // Granules with the same fingerprint are read back to compare them
+    size_t source_offset;       // Source offset of the stream start, the shard offset
+    char *dedup_buf;
+    size_t dedup_bytes;
+    sfs_codec_pool_t *pool;     // Blocks are compressed before being written, NULL without codec
+    sfs_pending_block_t *pending; // Metadata of the blocks in the pool, per slot
+    size_t stored_bytes;        // Data bytes written once compressed
+    size_t raw_bytes;
+    int indexed;                // Blocks are recorded in index, written before the footer
+    sfs_header_t hdr;           // Stream header, telling how blocks are laid out
+    sfs_index_t index;
+    sfs_sig_t *sig;             // Signature file written along, NULL if not asked for
+    sfs_sig_t *base;            // Granules with the same signature are not stored, NULL without base
+    u_int64_t *hashes;          // Hashes of the granules of the chunk being fed, with sig or base
+    size_t hashes_max;
+    const char *chunk;          // Chunk being fed, read from chunk_offset in the source
+    size_t chunk_offset;
+    u_int64_t zero_hash;
+    size_t base_bytes;
+    sfs_stats_t *stats;         // Hot path metrics, NULL if not asked for
+    size_t chunk_size;
+    int jobs;
+    sfs_run_t *runs;            // Runs of the chunk being scanned, NULL with jobs
+    size_t pushed;              // Bytes pushed since the last chunk was fed
+    int finished;
+    int vmsplice;               // dfp is a pipe, block data is vmspliced into it
+} sfs_encoder_t;
+
+/* Encoder of a sparse stream, fed either with the chunks of a source read by
+ * sfs_encoder_run() or with buffers pushed by the caller, and writing the stream
+ * to dfp (see sfs_fopen_callbacks() to write it anywhere else).
+ * An encoder is only used by one thread at a time, several encoders can run at once.
+ * Functions return SFS_OK or a negative SFS_ERR_* code, details being logged on stderr.
+ */
+
+// Fill opts with the default values, sfsz ones
+void sfs_encoder_opts_init(sfs_encoder_opts_t *opts);
+
+// Check the options, allocate the encoder buffers and write the stream header
+int sfs_encoder_open(sfs_encoder_t *enc, const sfs_encoder_opts_t *opts, FILE *dfp);
+
+/* Encode the whole source: chunks are read straight into the atomic block buffer,
+ * or through the scan pipeline with jobs
+ */
+int sfs_encoder_run(sfs_encoder_t *enc, sfs_reader_t *reader);
+
+/* Encode len bytes following the ones already pushed. Data is copied into the atomic
+ * block buffer and scanned by chunk_size chunks
+ */
+int sfs_encoder_push(sfs_encoder_t *enc, const char *buf, size_t len);
+
+/* Encode len zeros following the bytes already pushed, without reading them (a hole of
+ * the source). The bytes pushed so far and len must be multiples of the granularity
+ */
+int sfs_encoder_push_hole(sfs_encoder_t *enc, size_t len);
+
+// Write the last atomic block, the block index and the footer. dfp is not closed
+int sfs_encoder_finish(sfs_encoder_t *enc);
+
+void sfs_encoder_close(sfs_encoder_t *enc);
+
+#endif
@@ -0,0 +1,33 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_HASH_H
+#define SFS_HASH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* 64 bits non cryptographic hash (XXH64 algorithm), used to fingerprint granules.
+ * It only has to tell different granules apart, not to resist crafted collisions:
+ * deduplicated granules are compared byte for byte before being referenced.
+ */
+u_int64_t sfs_hash64(const void *buf, size_t len, u_int64_t seed);
+
+/* Check value of a range made of several granules: the hashes of its granules,
+ * folded in order, starting from 0
+ */
+u_int64_t sfs_hash_fold(u_int64_t check, u_int64_t hash);
+
+#endif
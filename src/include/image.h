@@ -0,0 +1,74 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_IMAGE_H
+#define SFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <block.h>
+#include <index.h>
+#include <sfs.h>
+
+#define DEFAULT_IMAGE_CACHE_BLOCKS 4
+
+typedef struct sfs_image_slot {
+    sfs_block_t blk;
+    size_t block;           // Index entry of the block held, (size_t) -1 if free
+    size_t last_use;
+    int pinned;             // Being read from, not to be evicted
+} sfs_image_slot_t;
+
+/* Random read access to a seekable sfs stream, as if it was the file it restores.
+ * The block map is built at open time (from the index if the stream has one).
+ * Sparse and pattern ranges are answered from memory, data ranges from the last
+ * cache_blocks blocks read, decompressed. Copies of earlier ranges are read from
+ * their source range. Not thread safe.
+ */
+typedef struct sfs_image {
+    FILE *sfp;
+    sfs_header_t hdr;
+    sfs_footer_t footer;
+    sfs_index_t idx;
+    void *random_buf;
+    sfs_image_slot_t *cache;
+    size_t ncache;
+    size_t uses;
+    sfs_block_t meta;       // Metadata of the block last described by sfs_image_extents()
+} sfs_image_t;
+
+// Called for every range described by sfs_image_extents(), zero telling whether it reads as zeros
+typedef int (*sfs_extent_cb)(void *ctx, size_t off, size_t len, int zero);
+
+// Returns 0 on success, -1 on failure
+int sfs_image_open(sfs_image_t *img, const char *path, size_t cache_blocks);
+
+// Size of the restored file
+size_t sfs_image_size(const sfs_image_t *img);
+
+// Read len bytes at off, zeros past the end. Returns 0 on success, -1 on failure
+int sfs_image_pread(sfs_image_t *img, char *buf, size_t len, size_t off);
+
+/* Describe [off, off+len[ as ranges reading as zeros or not, in order, successive
+ * ranges of the same kind being merged. Only block metadata is read.
+ * Returns 0 on success, -1 on failure (or if cb failed)
+ */
+int sfs_image_extents(sfs_image_t *img, size_t off, size_t len, sfs_extent_cb cb, void *ctx);
+
+void sfs_image_close(sfs_image_t *img);
+
+#endif
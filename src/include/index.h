@@ -0,0 +1,75 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_INDEX_H
+#define SFS_INDEX_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <block.h>
+#include <sfs.h>
+
+/* Seekable block index (SFS_FLAG_INDEX). It is written between the end of
+ * blocks marker and the final footer: the number of entries (always the
+ * footer atomic_blocks), then one entry per atomic block, in stream order.
+ * Being right before the footer, it is found from the end of a seekable
+ * stream without reading the blocks.
+ */
+typedef struct sfs_index_entry {
+    size_t stream_offset;   // Offset of the block size word, from the start of the stream
+    size_t offset;          // Logical offset the block is restored at
+    size_t len;             // Logical bytes restored by the block, trailing zeros excluded
+} sfs_index_entry_t;
+
+typedef struct sfs_index {
+    sfs_index_entry_t *entries;
+    size_t n;
+    size_t cap;
+    size_t blocks_end;      // Stream offset of the end of blocks marker, once loaded
+} sfs_index_t;
+
+// Append the entry of the next block, starting where the previous one ended. Returns 0 or -1
+int sfs_index_add(sfs_index_t *idx, size_t stream_offset, size_t len);
+
+// Returns the number of bytes written, 0 on failure
+size_t sfs_index_write(FILE *dfp, const sfs_index_t *idx);
+
+/* Read past the index of a stream being read sequentially, right after the end of
+ * blocks marker. Returns the number of bytes read, 0 on failure
+ */
+size_t sfs_index_skip(FILE *sfp, size_t atomic_blocks);
+
+/* Load the index and the footer of a seekable stream from its end, and sanity
+ * check them. The stream position is left undefined.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_index_load(FILE *sfp, sfs_index_t *idx, sfs_footer_t *footer);
+
+/* Map the blocks of a seekable stream whose header (header_size bytes) was just read,
+ * with its index if it has one, otherwise by walking the block metadata and seeking
+ * past the data. The footer is read along. The stream position is left undefined.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_index_open(FILE *sfp, const sfs_header_t *hdr, size_t header_size, sfs_index_t *idx,
+                   sfs_footer_t *footer);
+
+// First entry ending after offset, idx->n if none does
+size_t sfs_index_find(const sfs_index_t *idx, size_t offset);
+
+void sfs_index_free(sfs_index_t *idx);
+
+#endif
@@ -0,0 +1,71 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_PREFETCH_H
+#define SFS_PREFETCH_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <block.h>
+
+#define DEFAULT_INFLIGHT_BLOCKS 2
+#define MAX_INFLIGHT_BLOCKS     64
+
+/* Atomic block prefetcher.
+ *
+ * A reader thread reads the next atomic blocks from the stream (data and
+ * boundaries) while the current one is being restored, so that downloading and
+ * writing overlap. At most inflight blocks are held in memory at once, the one
+ * being restored included: memory usage is bounded by inflight times the
+ * atomic block size. With inflight == 1, blocks are read synchronously, without
+ * any thread.
+ *
+ * Compressed blocks (SFS_FLAG_CODEC) are decompressed by inflight - 1 decoder
+ * threads, so that all the blocks read ahead can be decompressed concurrently.
+ */
+typedef struct sfs_prefetch {
+    FILE *sfp;
+    sfs_header_t hdr;
+    void *random_buf;
+    size_t inflight;
+    sfs_block_t *blocks;
+    int *states;            // Result of sfs_block_read for every slot, or PREFETCH_* if not ready
+    size_t next_read;
+    size_t next_decode;
+    size_t next_consume;
+    size_t total_read;      // Stream bytes read by the reader
+    int threaded;
+    int abort;
+    int reader_done;
+    pthread_t thread;
+    pthread_t *decoders;
+    size_t ndecoders;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sfs_prefetch_t;
+
+// Returns 0 on success, -1 on failure
+int sfs_prefetch_start(sfs_prefetch_t *pf, FILE *sfp, const sfs_header_t *hdr, size_t inflight);
+
+/* Get the next atomic block. The previous one returned is released and must not
+ * be used anymore. Returns NULL at the end of blocks (then *end is set) or on error.
+ */
+sfs_block_t *sfs_prefetch_next(sfs_prefetch_t *pf, int *end);
+
+// Stop the reader and release all blocks. Safe to call on a failed start
+void sfs_prefetch_stop(sfs_prefetch_t *pf);
+
+#endif
@@ -0,0 +1,103 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_READER_H
+#define SFS_READER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <stats.h>
+#include <uring.h>
+
+#define DIRECT_IO_ALIGN         4096 // Buffer, offset and length alignment used for O_DIRECT reads
+#define DEFAULT_READ_CHUNK_SIZE 4194304
+#define URING_MIN_READ_SIZE     65536 // Chunks are not split in smaller reads than this
+
+/* Source reader: reads the source in large chunks, straight into the caller's
+ * buffer. When direct I/O is requested, the source is opened with O_DIRECT
+ * (the caller is then responsible for providing DIRECT_IO_ALIGN aligned
+ * buffers and lengths). If O_DIRECT is not supported by the source, we fall
+ * back on buffered reads and drop the pages from the page cache once read,
+ * so that big backups do not evict the working set of the host anyway.
+ *
+ * For regular files, the reader also asks the filesystem for the extent map
+ * (FIEMAP, or SEEK_DATA/SEEK_HOLE when not available), so that holes and
+ * unwritten extents can be skipped without being read: they are known to read
+ * back as zeros. Only the part of the holes aligned on the skip alignment is
+ * skipped, the edges are read as usual.
+ *
+ * On seekable sources, reads can also go through io_uring: every chunk is then
+ * split into up to uring_depth positional reads, all in flight at once, which
+ * keeps deep device queues (NVMe, network block devices) busy.
+ */
+#define EXTENT_MAP_NONE     0
+#define EXTENT_MAP_FIEMAP   1
+#define EXTENT_MAP_SEEK     2
+
+typedef struct sfs_reader {
+    int fd;
+    int direct;         // O_DIRECT is active
+    int drop_cache;     // POSIX_FADV_DONTNEED consumed ranges
+    int eof;
+    size_t align;       // Required buffer alignment (1 if none)
+    off_t pos;          // Bytes consumed so far (read or skipped)
+    int extent_map;     // One of EXTENT_MAP_*
+    size_t skip_align;  // Skipped holes start and end on multiples of this
+    off_t size;         // Source size, only known for regular files
+    off_t end;          // Range end, -1 to read up to the end of the source
+    off_t skip_start;   // Next hole that can be skipped, -1 if none is known after pos
+    off_t skip_end;
+    size_t skipped;     // Total number of bytes skipped
+    int uring;          // Reads go through the ring
+    unsigned uring_depth;
+    sfs_uring_t ring;
+    ssize_t *uring_res; // Result of every read of the current chunk
+    sfs_stats_t *stats; // Time blocked on reads, NULL if not measured
+} sfs_reader_t;
+
+/* path "-" means stdin. Skipped holes will be aligned on skip_align bytes
+ * (the sparse detection block size). Returns 0 on success, -1 on failure
+ */
+int sfs_reader_open(sfs_reader_t *reader, const char *path, int direct, size_t skip_align);
+
+// Size of a regular file or block device source, -1 if not known
+off_t sfs_reader_source_size(sfs_reader_t *reader);
+
+/* Only read len bytes from start on, a seekable source being read by several readers
+ * at once. start, and the range end unless it is the end of the source, must be aligned
+ * as reads are. Returns 0 on success, -1 on failure
+ */
+int sfs_reader_set_range(sfs_reader_t *reader, off_t start, off_t len);
+
+/* Read through io_uring with up to depth reads in flight. Returns 0 on success,
+ * -1 if io_uring is not available or the source is not seekable: the reader
+ * then keeps on using plain reads.
+ */
+int sfs_reader_use_uring(sfs_reader_t *reader, unsigned depth);
+
+/* If a hole starts at the current position, move past it and return its length.
+ * Returns 0 otherwise, or (size_t) -1 on error.
+ */
+size_t sfs_reader_skip_hole(sfs_reader_t *reader);
+
+/* Read up to len bytes. Less is returned at end of file (eof is then set), or
+ * when stopping at the start of the next hole to skip. Returns -1 on error
+ */
+ssize_t sfs_reader_read(sfs_reader_t *reader, char *buf, size_t len);
+
+void sfs_reader_close(sfs_reader_t *reader);
+
+#endif
@@ -0,0 +1,75 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_RESTORE_H
+#define SFS_RESTORE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <block.h>
+#include <dst.h>
+#include <index.h>
+#include <sfs.h>
+
+#define MAX_RESTORE_JOBS 256
+
+/* Restored window: [start, end[ of the logical offsets, written from the start of
+ * the destination on. The whole stream is restored as is with {0, (size_t) -1}.
+ */
+typedef struct sfs_window {
+    size_t start;
+    size_t end;
+} sfs_window_t;
+
+/* Clip the range of len bytes at *off to the window, *off becoming the destination
+ * offset. Returns the number of bytes clipped at the start, *len being 0 if nothing is left
+ */
+size_t sfs_window_clip(const sfs_window_t *win, size_t *off, size_t *len);
+
+/* Restore a block starting at the logical offset *cursor, moved past it, and wait for
+ * its writes: the block can be reused right after.
+ * Returns 0 on success, -1 on failure (inconsistent block or destination error)
+ */
+int sfs_restore_block(sfs_dst_t *dst, const sfs_header_t *hdr, const sfs_block_t *blk, size_t *cursor,
+                      const sfs_window_t *win);
+
+/* Restore the blocks of a SFS_FLAG_BOUNDARIES_FIRST stream from sfp, in order, the data
+ * being read and written one SFS_DATA_PIECE_SIZE piece at a time as it comes: memory usage
+ * does not depend on the atomic block size. With splice, sfp being an unbuffered pipe, the
+ * data of streams without checksums is spliced straight to the destination instead.
+ * Stops at the end marker, or once *cursor reached the window end. *blocks and *total_read
+ * are increased by the blocks and stream bytes read.
+ * Returns BLOCK_END, BLOCK_OK when stopped at the window end, or BLOCK_ERROR
+ */
+int sfs_restore_stream(FILE *sfp, sfs_dst_t *dst, const sfs_header_t *hdr, size_t *cursor,
+                       const sfs_window_t *win, int splice, size_t *blocks, size_t *total_read);
+
+/* Restore the blocks of a seekable stream overlapping the window, mapped by idx, on
+ * jobs threads. Every thread reads its blocks through its own stream and writes them
+ * through its own destination, at the offsets known from the index. The trailing
+ * zeros (after the last block) are left to the caller. With diff, destinations only get
+ * what they do not hold yet, see sfs_dst_t. Deduplicated streams cannot be
+ * restored this way, copies needing the blocks before them. stats, if not NULL, is
+ * shared by all the threads.
+ * Returns 0 on success, -1 on failure
+ */
+int sfs_restore_parallel(const char *src_path, const char *dst_path, const sfs_header_t *hdr,
+                         const sfs_index_t *idx, const sfs_window_t *win, int jobs,
+                         unsigned uring_depth, size_t merge_size, int diff, sfs_stats_t *stats);
+
+#endif
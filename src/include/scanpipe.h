@@ -0,0 +1,60 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_SCANPIPE_H
+#define SFS_SCANPIPE_H
+
+#include <stddef.h>
+
+#include <reader.h>
+#include <stats.h>
+#include <zeroscan.h>
+
+/* Multithreaded read/scan pipeline.
+ *
+ * A reader thread fills a bounded ring of chunk slots from the source, N scanner
+ * threads split every chunk into zero/non-zero runs concurrently, and the calling
+ * thread gets the scanned chunks back in source order, through a callback. The
+ * ring size bounds the memory used: (2 * N + 2) chunks.
+ */
+
+#define SLOT_FREE     0
+#define SLOT_READ     1
+#define SLOT_SCANNING 2
+#define SLOT_SCANNED  3
+
+typedef struct scanpipe_slot {
+    char *buf;
+    size_t len;         // Bytes of data read in buf
+    size_t hole;        // Or length of a source hole skipped without reading
+    sfs_run_t *runs;    // Runs found in the len / blk_size first blocks of buf
+    size_t nruns;
+    int state;
+    int last;           // End of source reached with this slot
+    int error;          // Reading the source failed
+} scanpipe_slot_t;
+
+// Must return 0 on success, anything else aborts the pipeline
+typedef int (*scanpipe_cb_t)(void *ctx, scanpipe_slot_t *slot);
+
+/* Read the whole source through the pipeline, calling cb on every chunk in order.
+ * The scan time is added to stats, if not NULL.
+ * Returns 0 on success, -1 if the source could not be read, the pipeline could not
+ * be setup or if the callback failed.
+ */
+int scanpipe_run(sfs_reader_t *reader, size_t chunk_size, size_t blk_size, int nworkers,
+                 scanpipe_cb_t cb, void *ctx, sfs_stats_t *stats);
+
+#endif
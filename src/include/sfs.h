@@ -13,12 +13,64 @@
  * limitations under the License.
  */
 
+#ifndef SFS_H
+#define SFS_H
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #define BLK_SIZE    4096 // Minimum number of contiguous zeros to switch on sparse mode
 #define DIE(msg)    { fprintf(stderr, msg); exit(EXIT_FAILURE); }
 
+#define MAX_RANDOM_BUFFER_SIZE  (unsigned int) 10485760
+#define MAX_ATOMIC_BLOCK_SIZE   4294967296
+#define MIN_GRANULARITY         512
+#define MAX_GRANULARITY         1048576
+
+/* Stream header. Version 2 streams (sfs 2.0) only start with the random buffer
+ * size, which cannot be mistaken for the magic number. Version 3 streams start
+ * with the header below, only written when the stream needs it (granularity
+ * other than BLK_SIZE, or any flag), so that default streams stay readable by
+ * older sfsuz. header_size covers the whole header: fields are only appended,
+ * the ones missing from a stream keep their default value and the ones unknown
+ * to a reader are skipped. Flags are features the reader must support.
+ */
+#define SFS_MAGIC           0x3352444853465353 // "SSFSHDR3"
+#define SFS_FORMAT_LEGACY   2
+#define SFS_FORMAT_VERSION  3
+#define SFS_HEADER_MIN_SIZE (5 * sizeof(size_t))
+
+#define SFS_FLAG_TYPED_RANGES   0x1 // Blocks carry a typed range table, see block.h
+#define SFS_FLAG_DEDUP          0x2 // Typed ranges may copy earlier ranges, requires typed ranges
+#define SFS_FLAG_CODEC          0x4 // Block data is compressed with the codec of the header
+#define SFS_FLAG_INDEX          0x8 // A block index precedes the footer, see index.h
+#define SFS_FLAG_BASE           0x10 // Typed ranges may be left as in a base image, requires typed ranges
+#define SFS_FLAG_CHECKSUM       0x20 // Every block ends with its checksum, see block.h
+#define SFS_FLAG_COMPACT_BOUNDARIES 0x40 // Boundaries are packed as varints, see block.h
+#define SFS_FLAG_BOUNDARIES_FIRST 0x80 // Block data comes after the boundaries, see block.h
+#define SFS_FLAG_SHARD          0x100 // The stream is one shard of the source, restored at shard_offset
+#define SFS_FLAGS_KNOWN         (SFS_FLAG_TYPED_RANGES | SFS_FLAG_DEDUP | SFS_FLAG_CODEC | SFS_FLAG_INDEX | \
+                                 SFS_FLAG_BASE | SFS_FLAG_CHECKSUM | SFS_FLAG_COMPACT_BOUNDARIES | \
+                                 SFS_FLAG_BOUNDARIES_FIRST | SFS_FLAG_SHARD)
+
+typedef struct sfs_header {
+    size_t magic;
+    size_t version;
+    size_t header_size;
+    size_t granularity;         // Sparse detection granularity, in bytes
+    size_t random_size_bytes;
+    size_t flags;               // SFS_FLAG_*
+    size_t codec;               // SFS_CODEC_*, see codec.h
+    size_t shard_offset;        // Source offset of the first byte of a SFS_FLAG_SHARD stream
+    size_t shard_index;         // From 0 to shard_count - 1
+    size_t shard_count;
+} sfs_header_t;
+
+// The shard fields are only written by the streams having them
+#define SFS_HEADER_NOSHARD_SIZE offsetof(sfs_header_t, shard_offset)
+
 typedef struct sfs_footer {
     size_t read;
     size_t written;
@@ -26,13 +78,40 @@ typedef struct sfs_footer {
     size_t atomic_blocks;
 } sfs_footer_t; // The 24 last bytes of the file will contain this struct.
 
+sfs_footer_t *extract_footer(FILE* sfp, int skip_repositionning);
+
+// Initialize a header with the default values
+void sfs_header_init(sfs_header_t *hdr);
 
-typedef struct dst_info_t {
-    u_int8_t punch_support;
-} dst_info_t;
+// Write the first header_size bytes of the header. Returns the number of bytes written, 0 on failure
+size_t sfs_header_write(FILE *dfp, const sfs_header_t *hdr);
 
-sfs_footer_t *extract_footer(FILE* sfp, int skip_repositionning);
+// Returns the number of bytes read from the stream, 0 on failure or on an invalid header
+size_t sfs_header_read(FILE *sfp, sfs_header_t *hdr);
+
+/* libsfs return codes: the encoder and decoder (encoder.h, decoder.h) return SFS_OK or
+ * one of the negative codes below, the details being logged on stderr
+ */
+#define SFS_OK          0
+#define SFS_ERR_IO      -1 // Reading the source or writing the destination failed
+#define SFS_ERR_NOMEM   -2
+#define SFS_ERR_FORMAT  -3 // Invalid, corrupted or unsupported stream
+#define SFS_ERR_ARG     -4 // Invalid options, or call out of order
+
+// Description of an SFS_* return code
+const char *sfs_strerror(int rc);
+
+/* Wrap callbacks into a stream, for the encoder to write anywhere or the decoder to read
+ * from anywhere. read and write follow the read(2) and write(2) conventions, either may
+ * be NULL. The stream is buffered like any other, close with fclose().
+ * Returns NULL on failure
+ */
+typedef ssize_t (*sfs_read_cb_t)(void *ctx, char *buf, size_t len);
+typedef ssize_t (*sfs_write_cb_t)(void *ctx, const char *buf, size_t len);
+FILE *sfs_fopen_callbacks(void *ctx, sfs_read_cb_t read, sfs_write_cb_t write);
 
 void close_all_files(int fp_number, ...);
 
 void free_all_mem(int voidp_number, ...);
+
+#endif
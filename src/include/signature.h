@@ -0,0 +1,66 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_SIGNATURE_H
+#define SFS_SIGNATURE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Signature file (sfsz --signatures): the sfs_hash64() of every granule of the
+ * source, in order, for a later backup of the same source to only store the
+ * granules that changed since (sfsz --base). It starts with the header below,
+ * the source size and the number of hashes being set once the source is read.
+ * Holes and zero granules get the hash of a zero granule, the last granule
+ * the hash of its bytes only when the source size is not a multiple of the
+ * granularity.
+ */
+#define SFS_SIG_MAGIC   0x3147495353465353 // "SSFSSIG1"
+
+typedef struct sfs_sig_header {
+    size_t magic;
+    size_t granularity;
+    size_t size;            // Source size
+    size_t n;               // Number of hashes
+} sfs_sig_header_t;
+
+typedef struct sfs_sig {
+    sfs_sig_header_t hdr;
+    FILE *fp;               // Signature file being written
+    const u_int64_t *hashes; // Mapped hashes of a base signature file
+    size_t map_len;
+    void *map;
+} sfs_sig_t;
+
+// Create the signature file at path. Returns 0 on success, -1 on failure
+int sfs_sig_create(sfs_sig_t *sig, const char *path, size_t granularity);
+
+// Append the hashes of the next count granules. Returns 0 on success, -1 on failure
+int sfs_sig_append(sfs_sig_t *sig, const u_int64_t *hashes, size_t count);
+
+// Write the header of the whole source, size bytes long, and close. Returns 0 or -1
+int sfs_sig_finish(sfs_sig_t *sig, size_t size);
+
+// Map the base signature file at path. Returns 0 on success, -1 on failure
+int sfs_sig_open(sfs_sig_t *sig, const char *path);
+
+// Whether granule number g of the base had this hash
+int sfs_sig_match(const sfs_sig_t *sig, size_t g, u_int64_t hash);
+
+void sfs_sig_close(sfs_sig_t *sig);
+
+#endif
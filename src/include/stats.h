@@ -0,0 +1,101 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SFS_STATS_H
+#define SFS_STATS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define STATS_INTERVAL_NS   1000000000ULL // Between two periodic lines
+#define STATS_LINE_SIZE     4096
+
+// Counters
+#define SFS_STAT_READ           0 // Source bytes (sfsz) or stream bytes (sfsuz) read
+#define SFS_STAT_STRIPPED       1 // Bytes stored (sfsz) or restored (sfsuz) without their data
+#define SFS_STAT_WRITTEN        2 // Stream bytes (sfsz) or data bytes (sfsuz) written
+#define SFS_STAT_READ_NS        3 // Time blocked on reads
+#define SFS_STAT_WRITE_NS       4 // Time blocked on writes, zeroings and destination comparisons included
+#define SFS_STAT_SCAN_NS        5 // Time spent looking for zeros
+#define SFS_STAT_ZERO_FALLBACKS 6 // Zeroing methods given up on the destination
+#define SFS_STAT_ZERO_WRITTEN   7 // Bytes zeroed by writing zeros, the slowest method
+#define SFS_STAT_BLOCKS         8 // Atomic blocks written or restored
+#define SFS_STAT_BLOCK_DATA     9 // Data bytes of these blocks
+#define SFS_STAT_UNCHANGED      10 // Bytes left as they are on the destination, already holding them
+#define SFS_STAT_COUNTERS       11
+
+/* Latencies of the zeroing calls (fallocate or block device ioctls) are counted per
+ * method in buckets: bucket 0 for calls under 1 us, then bucket i for [2^(i-1), 2^i[ us,
+ * the last one gathering all the slower calls
+ */
+#define STATS_ZERO_METHODS      3 // DST_ZERO_* methods that are not plain writes
+#define STATS_LATENCY_BUCKETS   24
+#define STATS_FILL_BUCKETS      10 // Atomic block fill, by tenths of the atomic block size
+
+/* Hot path metrics, emitted as JSON lines on fd by a timer thread every STATS_INTERVAL_NS,
+ * stalls included, and once more at the end. Counters are updated by any thread with
+ * relaxed atomics, so that keeping them costs a clock read per chunk or per I/O. All the
+ * functions do nothing when passed a NULL sfs_stats_t, tools pass one only when asked to.
+ */
+typedef struct sfs_stats {
+    int fd;
+    const char *tool;
+    u_int64_t start;
+    u_int64_t next;             // Time of the next periodic line
+    u_int64_t last;             // Time of the last line
+    u_int64_t last_read;        // Counters at the last line, for the rates
+    u_int64_t last_written;
+    size_t block_capacity;      // Atomic block size, 0 if unknown (fill buckets are then empty)
+    u_int64_t counters[SFS_STAT_COUNTERS];
+    u_int64_t zero_latency[STATS_ZERO_METHODS][STATS_LATENCY_BUCKETS];
+    u_int64_t block_fill[STATS_FILL_BUCKETS];
+    pthread_mutex_t lock;       // Held by the thread emitting a line
+    pthread_cond_t wake;        // Signaled to stop the timer
+    pthread_t timer;
+    int stop;
+} sfs_stats_t;
+
+// Monotonic time in ns
+u_int64_t sfs_stats_clock(void);
+
+void sfs_stats_add(sfs_stats_t *st, int counter, u_int64_t v);
+
+void sfs_stats_set(sfs_stats_t *st, int counter, u_int64_t v);
+
+// Start of a timed section, 0 without stats
+u_int64_t sfs_stats_start(sfs_stats_t *st);
+
+// Add the time elapsed since start to a *_NS counter
+void sfs_stats_time(sfs_stats_t *st, int counter, u_int64_t start);
+
+/* Emit to fd (not closed) for tool, starting the timer thread. block_capacity is the
+ * atomic block size if known. Returns 0 on success, -1 on failure
+ */
+int sfs_stats_init(sfs_stats_t *st, const char *tool, int fd, size_t block_capacity);
+
+// Count a zeroing call of the given DST_ZERO_* method, started at start
+void sfs_stats_zero(sfs_stats_t *st, int method, u_int64_t start);
+
+// Count an atomic block of size data bytes
+void sfs_stats_block(sfs_stats_t *st, size_t size);
+
+// Stop the timer thread and emit the final line
+void sfs_stats_finish(sfs_stats_t *st);
+
+void sfs_stats_destroy(sfs_stats_t *st);
+
+#endif
@@ -0,0 +1,66 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_URING_H
+#define SFS_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#define MAX_URING_DEPTH 4096
+
+/* Minimal io_uring wrapper, on top of the raw syscalls so that no liburing
+ * is required to build. A ring is meant to be used by a single thread.
+ */
+typedef struct sfs_uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail;     // Next submission slot, published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned pending;           // Prepared, not submitted yet
+    unsigned inflight;          // Submitted, not completed yet
+} sfs_uring_t;
+
+// Returns 0 on success, -1 if io_uring is not available (old kernel, seccomp...)
+int sfs_uring_init(sfs_uring_t *ring, unsigned entries);
+
+// Get a zeroed submission entry, NULL if the submission queue is full
+struct io_uring_sqe *sfs_uring_get_sqe(sfs_uring_t *ring);
+
+// Submit the prepared entries and wait for at least wait_nr completions. Returns 0 or -1
+int sfs_uring_submit(sfs_uring_t *ring, unsigned wait_nr);
+
+// Pop a completion if any is available. Returns 1 if cqe was filled, 0 otherwise
+int sfs_uring_peek(sfs_uring_t *ring, struct io_uring_cqe *cqe);
+
+// Pop a completion, waiting for one if needed. Returns 0 or -1
+int sfs_uring_wait(sfs_uring_t *ring, struct io_uring_cqe *cqe);
+
+void sfs_uring_exit(sfs_uring_t *ring);
+
+#endif
@@ -0,0 +1,69 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFS_ZEROSCAN_H
+#define SFS_ZEROSCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A run is a maximal sequence of contiguous blocks sharing the same nature
+ * (all zeros or not). Runs are produced in buffer order and their lengths
+ * are expressed in bytes, so that summing them gives back the scanned length.
+ */
+typedef struct sfs_run {
+    size_t len;
+    u_int8_t zero;
+} sfs_run_t;
+
+typedef struct zs_kernel {
+    const char *name;
+    int (*supported)(void);
+    // Scan nblk blocks of blk_size bytes, fill runs (at most nblk entries)
+    // and return the number of runs
+    size_t (*scan)(const unsigned char *buf, size_t nblk, size_t blk_size, sfs_run_t *runs);
+} zs_kernel_t;
+
+/* Select the fastest kernel supported by the running CPU. The SFS_ZEROSCAN
+ * environment variable can be set to a kernel name to force a given one
+ * (mostly useful for testing and benchmarking).
+ * Calling it is optional: the first scan initializes the dispatch anyway.
+ */
+void zs_init(void);
+
+// Name of the kernel currently in use
+const char *zs_kernel_name(void);
+
+// NULL terminated list of all the kernels compiled in, supported or not
+const zs_kernel_t * const *zs_kernels(void);
+
+// Force a kernel by name. Returns 0 on success, -1 if unknown or unsupported
+int zs_select(const char *name);
+
+/* Split buf into runs of zero / non-zero blocks of blk_size bytes.
+ * len must be a multiple of blk_size and runs must be able to hold
+ * len / blk_size entries. Returns the number of runs filled.
+ */
+size_t zs_scan(const void *buf, size_t len, size_t blk_size, sfs_run_t *runs);
+
+// Whether the len bytes of buf are all zeros (any length accepted)
+int zs_is_zero(const void *buf, size_t len);
+
+/* Whether buf is a single 64 bits word repeated over len bytes (a multiple of 8,
+ * at least 16). If so, the word is stored in *word
+ */
+int zs_is_pattern(const void *buf, size_t len, u_int64_t *word);
+
+#endif
@@ -0,0 +1,197 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <index.h>
+#include <sfs.h>
+
+
+int sfs_index_add(sfs_index_t *idx, size_t stream_offset, size_t len) {
+    sfs_index_entry_t *p, *e;
+
+    if(idx->n == idx->cap) {
+        p = realloc(idx->entries, (idx->cap > 0 ? idx->cap * 2 : 1024) * sizeof(sfs_index_entry_t));
+        if(p == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the block index\n");
+            return -1;
+        }
+        idx->entries = p;
+        idx->cap = idx->cap > 0 ? idx->cap * 2 : 1024;
+    }
+    e = &idx->entries[idx->n];
+    e->stream_offset = stream_offset;
+    e->offset = idx->n > 0 ? e[-1].offset + e[-1].len : 0;
+    e->len = len;
+    idx->n++;
+    return 0;
+}
+
+
+size_t sfs_index_write(FILE *dfp, const sfs_index_t *idx) {
+    if(fwrite(&idx->n, sizeof(size_t), 1, dfp) != 1)
+        return 0;
+    if(fwrite(idx->entries, sizeof(sfs_index_entry_t), idx->n, dfp) != idx->n)
+        return 0;
+    return sizeof(size_t) + idx->n * sizeof(sfs_index_entry_t);
+}
+
+
+size_t sfs_index_skip(FILE *sfp, size_t atomic_blocks) {
+    sfs_index_entry_t e;
+    size_t n, i;
+
+    if(fread(&n, sizeof(size_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read block index size\n");
+        return 0;
+    }
+    if(n != atomic_blocks) {
+        fprintf(stderr, "Unconsistent data: %li index entries for %li atomic blocks\n", n, atomic_blocks);
+        return 0;
+    }
+    // The stream may be a pipe
+    for(i=0; i<n; i++) {
+        if(fread(&e, sizeof(sfs_index_entry_t), 1, sfp) != 1) {
+            fprintf(stderr, "Unable to read block index\n");
+            return 0;
+        }
+    }
+    return sizeof(size_t) + n * sizeof(sfs_index_entry_t);
+}
+
+
+int sfs_index_load(FILE *sfp, sfs_index_t *idx, sfs_footer_t *footer) {
+    off_t end, pos;
+    size_t n, i;
+    sfs_index_entry_t *e;
+
+    if(fseeko(sfp, 0, SEEK_END) != 0 || (end = ftello(sfp)) < 0) {
+        fprintf(stderr, "The stream is not seekable, its block index cannot be used\n");
+        return -1;
+    }
+    if(end < (off_t) (sizeof(sfs_footer_t) + sizeof(size_t)) ||
+       fseeko(sfp, end - sizeof(sfs_footer_t), SEEK_SET) != 0 ||
+       fread(footer, sizeof(sfs_footer_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read the stream footer\n");
+        return -1;
+    }
+    // Every entry stands for at least a block size word
+    if(footer->atomic_blocks > (size_t) end / sizeof(sfs_index_entry_t)) {
+        fprintf(stderr, "Unconsistent data: %li atomic blocks\n", footer->atomic_blocks);
+        return -1;
+    }
+    pos = end - sizeof(sfs_footer_t) - footer->atomic_blocks * sizeof(sfs_index_entry_t) - sizeof(size_t);
+    if(pos < (off_t) sizeof(size_t) || fseeko(sfp, pos, SEEK_SET) != 0 || fread(&n, sizeof(size_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read the block index\n");
+        return -1;
+    }
+    if(n != footer->atomic_blocks) {
+        fprintf(stderr, "Unconsistent data: %li index entries for %li atomic blocks\n",
+                n, footer->atomic_blocks);
+        return -1;
+    }
+
+    idx->entries = malloc((n > 0 ? n : 1) * sizeof(sfs_index_entry_t));
+    if(idx->entries == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the block index\n");
+        return -1;
+    }
+    idx->n = idx->cap = n;
+    idx->blocks_end = pos - sizeof(size_t);
+    if(fread(idx->entries, sizeof(sfs_index_entry_t), n, sfp) != n) {
+        fprintf(stderr, "Unable to read the block index\n");
+        return -1;
+    }
+
+    // Blocks follow each other, in the stream as in the restored file
+    for(i=0; i<n; i++) {
+        e = &idx->entries[i];
+        if(e->stream_offset >= idx->blocks_end ||
+           (i > 0 && (e->stream_offset <= e[-1].stream_offset || e->offset != e[-1].offset + e[-1].len)) ||
+           (i == 0 && e->offset != 0) || e->offset + e->len > footer->read || e->offset + e->len < e->offset) {
+            fprintf(stderr, "Unconsistent data: invalid block index entry %li\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Map the blocks from their metadata, the stream being right after its header
+static int index_build(FILE *sfp, const sfs_header_t *hdr, size_t header_size, sfs_index_t *idx,
+                       sfs_footer_t *footer) {
+    sfs_block_t blk;
+    size_t pos = header_size, len, i;
+    int rc;
+
+    memset(&blk, 0, sizeof(sfs_block_t));
+    while((rc = sfs_block_read_meta(sfp, hdr, &blk)) == BLOCK_OK) {
+        for(i=0, len=0; i<blk.meta_idx; i++)
+            len += blk.boundaries[i];
+        if(sfs_index_add(idx, pos, len) != 0)
+            break;
+        pos += blk.stream_bytes;
+    }
+    sfs_block_free(&blk);
+    if(rc != BLOCK_END)
+        return -1;
+
+    if(fread(footer, sizeof(sfs_footer_t), 1, sfp) != 1) {
+        fprintf(stderr, "Unable to read the stream footer\n");
+        return -1;
+    }
+    if(footer->atomic_blocks != idx->n ||
+       (idx->n > 0 && idx->entries[idx->n-1].offset + idx->entries[idx->n-1].len > footer->read)) {
+        fprintf(stderr, "Unconsistent data: footer differs from the blocks\n");
+        return -1;
+    }
+    idx->blocks_end = pos;
+    return 0;
+}
+
+
+int sfs_index_open(FILE *sfp, const sfs_header_t *hdr, size_t header_size, sfs_index_t *idx,
+                   sfs_footer_t *footer) {
+    memset(idx, 0, sizeof(sfs_index_t));
+    if(hdr->flags & SFS_FLAG_INDEX)
+        return sfs_index_load(sfp, idx, footer);
+    return index_build(sfp, hdr, header_size, idx, footer);
+}
+
+
+size_t sfs_index_find(const sfs_index_t *idx, size_t offset) {
+    size_t lo = 0, hi = idx->n, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(idx->entries[mid].offset + idx->entries[mid].len > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+
+void sfs_index_free(sfs_index_t *idx) {
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->n = 0;
+    idx->cap = 0;
+}
@@ -0,0 +1,211 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <prefetch.h>
+#include <sfs.h>
+
+#define PREFETCH_FREE     -2
+#define PREFETCH_ENCODED  -3 // Read, waiting for a decoder
+#define PREFETCH_DECODING -4
+
+
+static void *prefetch_reader(void *arg) {
+    sfs_prefetch_t *pf = (sfs_prefetch_t *) arg;
+    size_t i;
+    int rc = BLOCK_OK;
+
+    while(rc == BLOCK_OK) {
+        i = pf->next_read % pf->inflight;
+
+        pthread_mutex_lock(&pf->lock);
+        while(pf->states[i] != PREFETCH_FREE && !pf->abort)
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        if(pf->abort) {
+            pthread_mutex_unlock(&pf->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pf->lock);
+
+        rc = sfs_block_read(pf->sfp, &pf->hdr, pf->random_buf, &pf->blocks[i]);
+
+        pthread_mutex_lock(&pf->lock);
+        if(rc != BLOCK_ERROR)
+            pf->total_read += pf->blocks[i].stream_bytes;
+        pf->states[i] = (rc == BLOCK_OK && pf->blocks[i].encoded) ? PREFETCH_ENCODED : rc;
+        pf->next_read++;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    pf->reader_done = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+
+// Decompress the blocks read, in any order: every decoder takes the next encoded one
+static void *prefetch_decoder(void *arg) {
+    sfs_prefetch_t *pf = (sfs_prefetch_t *) arg;
+    size_t i;
+    int rc;
+
+    pthread_mutex_lock(&pf->lock);
+    while(!pf->abort) {
+        if(pf->next_decode == pf->next_read) {
+            if(pf->reader_done)
+                break;
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        i = pf->next_decode % pf->inflight;
+        pf->next_decode++;
+        if(pf->states[i] != PREFETCH_ENCODED)
+            continue;
+        pf->states[i] = PREFETCH_DECODING;
+        pthread_mutex_unlock(&pf->lock);
+
+        rc = sfs_block_decode(&pf->hdr, &pf->blocks[i]);
+
+        pthread_mutex_lock(&pf->lock);
+        pf->states[i] = rc;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+
+int sfs_prefetch_start(sfs_prefetch_t *pf, FILE *sfp, const sfs_header_t *hdr, size_t inflight) {
+    size_t i;
+
+    memset(pf, 0, sizeof(sfs_prefetch_t));
+    pf->sfp = sfp;
+    pf->hdr = *hdr;
+    pf->inflight = inflight;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+
+    if(hdr->random_size_bytes > 0) {
+        fprintf(
+            stderr,
+            "Random bufferes activated. Allocating garbage buffer with %li bytes\n",
+            hdr->random_size_bytes
+        );
+        pf->random_buf = malloc(hdr->random_size_bytes);
+        if(pf->random_buf == NULL) {
+            fprintf(stderr, "Unable to allocate random buffer\n");
+            return -1;
+        }
+    }
+
+    pf->blocks = calloc(inflight, sizeof(sfs_block_t));
+    pf->states = malloc(inflight * sizeof(int));
+    if(pf->blocks == NULL || pf->states == NULL) {
+        fprintf(stderr, "Unable to allocate prefetch slots\n");
+        return -1;
+    }
+    for(i=0; i<inflight; i++)
+        pf->states[i] = PREFETCH_FREE;
+
+    if(inflight > 1) {
+        if(pthread_create(&pf->thread, NULL, prefetch_reader, pf) != 0) {
+            fprintf(stderr, "Unable to start prefetch thread\n");
+            return -1;
+        }
+        pf->threaded = 1;
+    }
+
+    if(inflight > 1 && (hdr->flags & SFS_FLAG_CODEC)) {
+        pf->decoders = calloc(inflight - 1, sizeof(pthread_t));
+        if(pf->decoders == NULL) {
+            fprintf(stderr, "Unable to allocate decoder threads\n");
+            return -1;
+        }
+        for(; pf->ndecoders<inflight-1; pf->ndecoders++) {
+            if(pthread_create(&pf->decoders[pf->ndecoders], NULL, prefetch_decoder, pf) != 0) {
+                fprintf(stderr, "Unable to start decoder thread\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+sfs_block_t *sfs_prefetch_next(sfs_prefetch_t *pf, int *end) {
+    size_t i = pf->next_consume % pf->inflight;
+    int rc;
+
+    *end = 0;
+    if(!pf->threaded) {
+        rc = sfs_block_read(pf->sfp, &pf->hdr, pf->random_buf, &pf->blocks[0]);
+        if(rc != BLOCK_ERROR)
+            pf->total_read += pf->blocks[0].stream_bytes;
+        if(rc == BLOCK_OK)
+            rc = sfs_block_decode(&pf->hdr, &pf->blocks[0]);
+    }
+    else {
+        pthread_mutex_lock(&pf->lock);
+        // Release the block handed over last time
+        if(pf->next_consume > 0) {
+            pf->states[(pf->next_consume - 1) % pf->inflight] = PREFETCH_FREE;
+            pthread_cond_broadcast(&pf->cond);
+        }
+        while(pf->states[i] == PREFETCH_FREE || pf->states[i] == PREFETCH_ENCODED ||
+              pf->states[i] == PREFETCH_DECODING)
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        rc = pf->states[i];
+        pthread_mutex_unlock(&pf->lock);
+    }
+    pf->next_consume++;
+
+    if(rc == BLOCK_END)
+        *end = 1;
+    return (rc == BLOCK_OK) ? &pf->blocks[i] : NULL;
+}
+
+
+void sfs_prefetch_stop(sfs_prefetch_t *pf) {
+    size_t i;
+
+    if(pf->threaded) {
+        pthread_mutex_lock(&pf->lock);
+        pf->abort = 1;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        for(i=0; i<pf->ndecoders; i++)
+            pthread_join(pf->decoders[i], NULL);
+        pf->ndecoders = 0;
+        pf->threaded = 0;
+    }
+
+    if(pf->blocks != NULL) {
+        for(i=0; i<pf->inflight; i++)
+            sfs_block_free(&pf->blocks[i]);
+    }
+    free_all_mem(4, (void *) pf->blocks, (void *) pf->states, pf->random_buf, (void *) pf->decoders);
+    pf->blocks = NULL;
+    pf->decoders = NULL;
+    pf->states = NULL;
+    pf->random_buf = NULL;
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+}
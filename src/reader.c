@@ -0,0 +1,438 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <reader.h>
+
+#define FIEMAP_BATCH 128 // Extents fetched per FIEMAP call
+
+
+/* Find the first hole starting at or after from, using FIEMAP.
+ * Gaps between extents and unwritten extents (preallocated, reading back as zeros)
+ * are both considered holes. *hole_start is set to -1 if there is none.
+ */
+static int fiemap_next_hole(sfs_reader_t *reader, off_t from, off_t *hole_start, off_t *hole_end) {
+    char buf[sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent)];
+    struct fiemap *fm = (struct fiemap *) buf;
+    struct fiemap_extent *ext;
+    off_t cur = from, ext_start, ext_end;
+    unsigned int i;
+
+    *hole_start = -1;
+    while(cur < reader->size) {
+        memset(fm, 0, sizeof(struct fiemap));
+        fm->fm_start = cur;
+        fm->fm_length = reader->size - cur;
+        // Flush dirty pages first, otherwise delayed allocations and unwritten
+        // extents holding data only in the page cache would be reported wrongly
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_BATCH;
+        if(ioctl(reader->fd, FS_IOC_FIEMAP, fm) < 0)
+            return -1;
+
+        if(fm->fm_mapped_extents == 0)
+            break;
+
+        for(i=0; i<fm->fm_mapped_extents; i++) {
+            ext = &fm->fm_extents[i];
+            ext_start = ext->fe_logical;
+            ext_end = ext->fe_logical + ext->fe_length;
+            if(ext_end <= cur)
+                continue;
+
+            if(ext->fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+                if(*hole_start == -1)
+                    *hole_start = cur;
+                cur = ext_end;
+            }
+            else if(ext_start > cur) {
+                if(*hole_start == -1)
+                    *hole_start = cur;
+                *hole_end = ext_start;
+                return 0;
+            }
+            else if(*hole_start != -1) {
+                *hole_end = cur;
+                return 0;
+            }
+            else {
+                cur = ext_end;
+            }
+
+            if(ext->fe_flags & FIEMAP_EXTENT_LAST)
+                break;
+        }
+
+        if(i < fm->fm_mapped_extents || fm->fm_mapped_extents < FIEMAP_BATCH)
+            break;
+    }
+
+    // Nothing allocated from cur to the end of file
+    if(cur < reader->size && *hole_start == -1)
+        *hole_start = cur;
+    if(*hole_start != -1)
+        *hole_end = reader->size;
+    return 0;
+}
+
+
+// Same as above, relying on SEEK_DATA and SEEK_HOLE
+static int seek_next_hole(sfs_reader_t *reader, off_t from, off_t *hole_start, off_t *hole_end) {
+    off_t data;
+    int rc = 0;
+
+    *hole_start = -1;
+    data = lseek(reader->fd, from, SEEK_DATA);
+    if(data == -1 && errno != ENXIO) {
+        rc = -1;
+    }
+    else if(data == -1 || data > from) {
+        // ENXIO: no data from here to the end of file
+        *hole_start = from;
+        *hole_end = (data == -1) ? reader->size : data;
+    }
+    else {
+        *hole_start = lseek(reader->fd, from, SEEK_HOLE);
+        if(*hole_start == -1) {
+            rc = -1;
+        }
+        else if(*hole_start >= reader->size) {
+            *hole_start = -1;
+        }
+        else {
+            data = lseek(reader->fd, *hole_start, SEEK_DATA);
+            if(data == -1 && errno != ENXIO)
+                rc = -1;
+            *hole_end = (data == -1) ? reader->size : data;
+        }
+    }
+
+    // lseek moved the file offset, put it back where the next read is expected
+    if(lseek(reader->fd, reader->pos, SEEK_SET) == -1)
+        rc = -1;
+    return rc;
+}
+
+
+// Locate the next skippable hole after the current position
+static void reader_map_next_hole(sfs_reader_t *reader) {
+    off_t from = reader->pos, hole_start, hole_end;
+    int rc;
+
+    reader->skip_start = -1;
+    while(reader->extent_map != EXTENT_MAP_NONE && from < reader->size) {
+        if(reader->extent_map == EXTENT_MAP_FIEMAP) {
+            rc = fiemap_next_hole(reader, from, &hole_start, &hole_end);
+            if(rc != 0) {
+                // Not supported by every filesystem (tmpfs, nfs...)
+                reader->extent_map = EXTENT_MAP_SEEK;
+                continue;
+            }
+        }
+        else {
+            rc = seek_next_hole(reader, from, &hole_start, &hole_end);
+            if(rc != 0) {
+                fprintf(stderr, "WARNING: unable to get the source extent map (%s), reading it "
+                        "entirely\n", strerror(errno));
+                reader->extent_map = EXTENT_MAP_NONE;
+                return;
+            }
+        }
+
+        if(hole_start == -1)
+            return;
+
+        if(hole_end > reader->size)
+            hole_end = reader->size;
+        hole_start = (hole_start + reader->skip_align - 1) / reader->skip_align * reader->skip_align;
+        hole_end = hole_end / reader->skip_align * reader->skip_align;
+        if(hole_end > hole_start) {
+            reader->skip_start = hole_start;
+            reader->skip_end = hole_end;
+            return;
+        }
+        // Too small once aligned, it will just be read
+        from = hole_end > from ? hole_end : from + reader->skip_align;
+    }
+}
+
+
+int sfs_reader_open(sfs_reader_t *reader, const char *path, int direct, size_t skip_align) {
+    struct stat st;
+
+    reader->fd = -1;
+    reader->direct = 0;
+    reader->drop_cache = 0;
+    reader->eof = 0;
+    reader->align = 1;
+    reader->pos = 0;
+    reader->extent_map = EXTENT_MAP_NONE;
+    reader->skip_align = skip_align;
+    reader->size = -1;
+    reader->end = -1;
+    reader->skip_start = -1;
+    reader->skip_end = -1;
+    reader->skipped = 0;
+    reader->uring = 0;
+    reader->uring_depth = 0;
+    reader->stats = NULL;
+    reader->uring_res = NULL;
+
+    if(strcmp(path, "-") == 0) {
+        if(direct)
+            fprintf(stderr, "WARNING: direct I/O is not available on stdin. Ignoring\n");
+        reader->fd = STDIN_FILENO;
+        return 0;
+    }
+
+    if(direct) {
+        reader->fd = open(path, O_RDONLY | O_DIRECT);
+        if(reader->fd != -1) {
+            reader->direct = 1;
+            reader->align = DIRECT_IO_ALIGN;
+        }
+        else if(errno == EINVAL) {
+            fprintf(stderr, "WARNING: O_DIRECT not supported by source, falling back on "
+                    "buffered reads without caching\n");
+            reader->drop_cache = 1;
+        }
+        else {
+            fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if(reader->fd == -1) {
+        reader->fd = open(path, O_RDONLY);
+        if(reader->fd == -1) {
+            fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Hints only: failures (pipes, character devices...) do not matter
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if(fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        reader->size = st.st_size;
+        if(reader->skip_align < reader->align)
+            reader->skip_align = reader->align;
+        reader->extent_map = EXTENT_MAP_FIEMAP;
+        reader_map_next_hole(reader);
+    }
+    return 0;
+}
+
+
+off_t sfs_reader_source_size(sfs_reader_t *reader) {
+    struct stat st;
+    u_int64_t size;
+
+    if(fstat(reader->fd, &st) != 0)
+        return -1;
+    if(S_ISREG(st.st_mode))
+        return st.st_size;
+    if(S_ISBLK(st.st_mode) && ioctl(reader->fd, BLKGETSIZE64, &size) == 0)
+        return (off_t) size;
+    return -1;
+}
+
+
+int sfs_reader_set_range(sfs_reader_t *reader, off_t start, off_t len) {
+    if(lseek(reader->fd, start, SEEK_SET) == -1) {
+        fprintf(stderr, "Unable to seek to offset %li on source: %s\n", start, strerror(errno));
+        return -1;
+    }
+    reader->pos = start;
+    reader->end = start + len;
+    // Holes are only mapped up to the range end
+    if(reader->size > reader->end)
+        reader->size = reader->end;
+    if(reader->pos >= reader->end)
+        reader->eof = 1;
+    else
+        reader_map_next_hole(reader);
+    return 0;
+}
+
+
+size_t sfs_reader_skip_hole(sfs_reader_t *reader) {
+    size_t len;
+
+    if(reader->skip_start == -1 || reader->pos != reader->skip_start)
+        return 0;
+
+    if(lseek(reader->fd, reader->skip_end, SEEK_SET) == -1) {
+        fprintf(stderr, "Unable to skip source hole: %s\n", strerror(errno));
+        return (size_t) -1;
+    }
+    len = reader->skip_end - reader->skip_start;
+    reader->pos = reader->skip_end;
+    reader->skipped += len;
+    if(reader->pos >= reader->size || reader->pos == reader->end)
+        reader->eof = 1;
+    else
+        reader_map_next_hole(reader);
+    return len;
+}
+
+
+int sfs_reader_use_uring(sfs_reader_t *reader, unsigned depth) {
+    if(lseek(reader->fd, 0, SEEK_CUR) == -1)
+        return -1;
+
+    reader->uring_res = malloc(depth * sizeof(ssize_t));
+    if(reader->uring_res == NULL)
+        return -1;
+    if(sfs_uring_init(&reader->ring, depth) != 0) {
+        free(reader->uring_res);
+        reader->uring_res = NULL;
+        return -1;
+    }
+    reader->uring = 1;
+    reader->uring_depth = depth;
+    return 0;
+}
+
+
+/* Read a chunk as up to uring_depth positional reads submitted at once.
+ * Returns the length of the part read without any gap, the caller goes on
+ * from there if some read came back short.
+ */
+static ssize_t reader_uring_read(sfs_reader_t *reader, char *buf, size_t len) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    size_t piece, off, total;
+    unsigned i, n;
+
+    piece = (len + reader->uring_depth - 1) / reader->uring_depth;
+    if(piece < URING_MIN_READ_SIZE)
+        piece = URING_MIN_READ_SIZE;
+    piece = (piece + reader->align - 1) / reader->align * reader->align;
+
+    for(n=0, off=0; off < len; n++, off += piece) {
+        sqe = sfs_uring_get_sqe(&reader->ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = reader->fd;
+        sqe->addr = (unsigned long) (buf + off);
+        sqe->len = (len - off < piece) ? len - off : piece;
+        sqe->off = reader->pos + off;
+        sqe->user_data = n;
+    }
+    if(sfs_uring_submit(&reader->ring, n) != 0)
+        return -1;
+    for(i=0; i<n; i++) {
+        if(sfs_uring_wait(&reader->ring, &cqe) != 0)
+            return -1;
+        reader->uring_res[cqe.user_data] = cqe.res;
+    }
+
+    for(i=0, total=0; i<n; i++) {
+        if(reader->uring_res[i] < 0) {
+            fprintf(stderr, "Error while reading from source: %s\n",
+                    strerror(-reader->uring_res[i]));
+            return -1;
+        }
+        total += reader->uring_res[i];
+        if((size_t) reader->uring_res[i] < piece)
+            break;
+    }
+    return (ssize_t) (total < len ? total : len);
+}
+
+
+ssize_t sfs_reader_read(sfs_reader_t *reader, char *buf, size_t len) {
+    size_t total = 0;
+    ssize_t rb;
+    u_int64_t start = sfs_stats_start(reader->stats);
+
+    // Never read over the next hole, it is skipped instead, nor over the range end
+    if(reader->skip_start != -1 && reader->skip_start - reader->pos < len)
+        len = reader->skip_start - reader->pos;
+    if(reader->end != -1 && reader->end - reader->pos < len) {
+        len = reader->end - reader->pos;
+        // Direct reads keep an aligned length: only the end of the source may be unaligned
+        if(reader->direct)
+            len = (len + reader->align - 1) / reader->align * reader->align;
+    }
+
+    if(reader->uring && len > 0) {
+        rb = reader_uring_read(reader, buf, len);
+        if(rb < 0)
+            return -1;
+        total = rb;
+        // Direct reads are only short at the end of the source
+        if(reader->direct && (total % reader->align != 0)) {
+            reader->eof = 1;
+            len = total;
+        }
+    }
+
+    while(total < len) {
+        if(reader->uring)
+            rb = pread(reader->fd, buf + total, len - total, reader->pos + total);
+        else
+            rb = read(reader->fd, buf + total, len - total);
+        if(rb < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "Error while reading from source: %s\n", strerror(errno));
+            return -1;
+        }
+        if(rb == 0)
+            break;
+        total += rb;
+        // Direct reads are only short at the end of the source, and a next read
+        // from an unaligned position would fail with EINVAL
+        if(reader->direct && (rb % reader->align != 0))
+            break;
+    }
+    if(total < len)
+        reader->eof = 1;
+
+    if(reader->drop_cache && total > 0)
+        posix_fadvise(reader->fd, reader->pos, total, POSIX_FADV_DONTNEED);
+    reader->pos += total;
+    if(reader->pos == reader->end)
+        reader->eof = 1;
+    sfs_stats_time(reader->stats, SFS_STAT_READ_NS, start);
+
+    return (ssize_t) total;
+}
+
+
+void sfs_reader_close(sfs_reader_t *reader) {
+    if(reader->uring) {
+        sfs_uring_exit(&reader->ring);
+        free(reader->uring_res);
+        reader->uring_res = NULL;
+        reader->uring = 0;
+    }
+    if(reader->fd > STDIN_FILENO)
+        close(reader->fd);
+    reader->fd = -1;
+}
@@ -0,0 +1,485 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <block.h>
+#include <dst.h>
+#include <index.h>
+#include <restore.h>
+#include <sfs.h>
+#include <zeroscan.h>
+
+
+size_t sfs_window_clip(const sfs_window_t *win, size_t *off, size_t *len) {
+    size_t skip = 0, end = *off + *len;
+
+    if(end > win->end)
+        end = win->end;
+    if(*off < win->start)
+        skip = win->start - *off;
+    if(*off + skip >= end) {
+        *len = 0;
+        return 0;
+    }
+    *len = end - *off - skip;
+    *off += skip - win->start;
+    return skip;
+}
+
+
+// Pattern word as repeated from skip bytes further
+static u_int64_t pattern_shift(u_int64_t word, size_t skip) {
+    char b[2 * sizeof(u_int64_t)];
+
+    memcpy(b, &word, sizeof(u_int64_t));
+    memcpy(b + sizeof(u_int64_t), &word, sizeof(u_int64_t));
+    memcpy(&word, b + skip % sizeof(u_int64_t), sizeof(u_int64_t));
+    return word;
+}
+
+
+// Data of a boundaries first block, read from the stream as it is restored
+typedef struct restore_stream {
+    FILE *sfp;
+    sfs_block_t *blk;       // Block being read, for its stream bytes and checksum
+    char *buf;              // One piece of data
+    size_t start;           // Block data offset of the buffered bytes
+    size_t len;
+    int splice;             // sfp is an unbuffered pipe the data can be spliced from
+} restore_stream_t;
+
+
+// Write len bytes at off, zeroing them instead if they are whole zero granules
+static int restore_data(sfs_dst_t *dst, const sfs_header_t *hdr, size_t off, const char *buf, size_t len) {
+    u_int64_t start;
+    int zero = 0;
+
+    if(off % hdr->granularity == 0 && len % hdr->granularity == 0) {
+        start = sfs_stats_start(dst->stats);
+        zero = zs_is_zero(buf, len);
+        sfs_stats_time(dst->stats, SFS_STAT_SCAN_NS, start);
+    }
+    if(zero) {
+        sfs_stats_add(dst->stats, SFS_STAT_STRIPPED, len);
+        return sfs_dst_zero(dst, off, len);
+    }
+    sfs_stats_add(dst->stats, SFS_STAT_WRITTEN, len);
+    return sfs_dst_write(dst, off, buf, len);
+}
+
+
+// Read the next piece of data of the block, once the writes from the previous one are done
+static int restore_stream_fill(sfs_dst_t *dst, const sfs_header_t *hdr, restore_stream_t *st) {
+    u_int64_t start;
+    size_t n;
+
+    if(sfs_dst_drain(dst) != 0)
+        return -1;
+    st->start += st->len;
+    n = st->blk->size - st->start;
+    if(n > SFS_DATA_PIECE_SIZE)
+        n = SFS_DATA_PIECE_SIZE;
+    start = sfs_stats_start(dst->stats);
+    if(fread(st->buf, 1, n, st->sfp) != n) {
+        fprintf(stderr, "Unable to read %li bytes of atomic block data\n", n);
+        return -1;
+    }
+    sfs_stats_time(dst->stats, SFS_STAT_READ_NS, start);
+    st->len = n;
+    sfs_block_sum(hdr, st->blk, st->buf, n);
+    return 0;
+}
+
+
+/* Read the data range of data_length bytes at pos in the block data, restoring the len
+ * bytes from skip on at off. Ranges are read piece by piece, or spliced from the pipe
+ */
+static int restore_stream_data(sfs_dst_t *dst, const sfs_header_t *hdr, restore_stream_t *st, size_t pos,
+                               size_t off, size_t skip, size_t len, size_t data_length) {
+    size_t end = pos + data_length, lo = pos + skip, hi = pos + skip + len, a, b, spliced;
+    int rc;
+
+    while(pos < end) {
+        if(pos == st->start + st->len) {
+            if(st->splice && pos >= lo && pos < hi) {
+                rc = sfs_dst_splice(dst, fileno(st->sfp), off + (pos - lo), hi - pos, &spliced);
+                st->blk->stream_bytes += spliced;
+                sfs_stats_add(dst->stats, SFS_STAT_WRITTEN, spliced);
+                pos += spliced;
+                st->start = pos;
+                st->len = 0;
+                if(rc < 0)
+                    return -1;
+                // Not supported by the destination: read and write the rest
+                if(rc > 0) {
+                    fprintf(stderr, "WARNING: unable to splice data to destination, falling back on writes\n");
+                    st->splice = 0;
+                }
+                continue;
+            }
+            if(restore_stream_fill(dst, hdr, st) != 0)
+                return -1;
+        }
+
+        // Part of the buffered piece in the window
+        b = st->start + st->len < end ? st->start + st->len : end;
+        a = pos > lo ? pos : lo;
+        if(b > hi)
+            b = hi;
+        if(a < b && restore_data(dst, hdr, off + (a - lo), st->buf + (a - st->start), b - a) != 0)
+            return -1;
+        pos = st->start + st->len < end ? st->start + st->len : end;
+    }
+    return 0;
+}
+
+
+// With st, the block data is read from the stream instead of blk->data
+static int restore_block(sfs_dst_t *dst, const sfs_header_t *hdr, const sfs_block_t *blk, size_t *cursor,
+                         const sfs_window_t *win, restore_stream_t *st) {
+    size_t i, t = 0, data_seek, data_length, atomic_read = 0, off, len, skip;
+    const sfs_typed_range_t *typed;
+    int next_typed, rc;
+    u_int64_t check;
+
+    //By convention we start by assuming sparse mode is off
+    for(i=0; i<blk->meta_idx; i+=2) {
+        //Data offsets in bytes
+        data_seek = blk->boundaries[i];
+        data_length = blk->boundaries[i+1];
+
+        if(atomic_read + data_length > blk->size) {
+            fprintf(stderr, "Unconsistent data: %li > %li\n", atomic_read + data_length, blk->size);
+            fprintf(stderr, "Unconsistent data: offset array item falls out of bounds\n");
+            return -1;
+        }
+
+        // Typed sparse range at this index, and whether the next one is typed
+        typed = (t < blk->ntyped && blk->typed[t].slot == i) ? &blk->typed[t++] : NULL;
+        next_typed = t < blk->ntyped && blk->typed[t].slot == i + 2;
+
+        if(data_length == 0 || data_seek == 0) {
+            // This can only happen at the start of the file, or for data between
+            // typed ranges
+            if(i > 0 && (data_seek == 0 || (typed == NULL && !next_typed))) {
+                fprintf(stderr, "A zero length sparse or data region should not be possible "
+                                "apart at the file beginning. Index %li, sparse len %li, "
+                                "data len %li.\n",
+                        i, data_seek, data_length);
+                fprintf(stderr, "Unconsistent data: invalid metadata\n");
+                return -1;
+            }
+            if(data_length == 0 && data_seek == 0)
+                continue;
+        }
+
+        // Zero ranges are coalesced by the destination until some data is written after them
+        off = *cursor;
+        len = data_seek;
+        skip = sfs_window_clip(win, &off, &len);
+        if(len == 0)
+            rc = 0;
+        else if(typed == NULL)
+            rc = sfs_dst_zero(dst, off, len);
+        else if(typed->kind == SFS_RANGE_PATTERN)
+            rc = sfs_dst_fill(dst, off, len, pattern_shift((u_int64_t) typed->arg, skip));
+        else if(typed->kind == SFS_RANGE_BASE)
+            rc = 0; // Already on the destination
+        else if(typed->arg + data_seek > *cursor) {
+            fprintf(stderr, "Unconsistent data: copy of [%li, %li[ at offset %li, not restored yet\n",
+                    typed->arg, typed->arg + data_seek, *cursor);
+            fprintf(stderr, "Unconsistent data: invalid back-reference\n");
+            return -1;
+        }
+        else {
+            rc = sfs_dst_copy(dst, *cursor, typed->arg, data_seek, hdr->granularity, &check);
+            if(rc == 0 && check != typed->check) {
+                fprintf(stderr, "Copy of [%li, %li[ at offset %li does not match what was backed up\n",
+                        typed->arg, typed->arg + data_seek, *cursor);
+                fprintf(stderr, "Unconsistent data: back-reference verification failed\n");
+                return -1;
+            }
+        }
+        if(rc != 0) {
+            fprintf(stderr, "Unable to zero range on destination!\n");
+            return -1;
+        }
+        sfs_stats_add(dst->stats, SFS_STAT_STRIPPED, len);
+        *cursor += data_seek;
+        if(data_length == 0)
+            continue;
+
+        // Zeros stored as data (granules forced by the keepalive) extend the zero range instead
+        off = *cursor;
+        len = data_length;
+        skip = sfs_window_clip(win, &off, &len);
+        if(st != NULL)
+            rc = restore_stream_data(dst, hdr, st, atomic_read, off, skip, len, data_length);
+        else if(len == 0)
+            rc = 0;
+        else
+            rc = restore_data(dst, hdr, off, blk->data+atomic_read+skip, len);
+        if(rc != 0) {
+            fprintf(stderr, "Unable to write data correctly on destination!\n");
+            return -1;
+        }
+        *cursor += data_length;
+        atomic_read += data_length;
+    } // Block data read
+
+    // Queued writes point into the block, which is handed back to the prefetcher next
+    if(sfs_dst_drain(dst) != 0) {
+        fprintf(stderr, "Unable to write data correctly on destination!\n");
+        return -1;
+    }
+
+    if(atomic_read != blk->size) {
+        fprintf(stderr,
+                "Unconsistent data: atomic read (%li) differs from expected (%li)\n",
+                atomic_read, blk->size);
+        return -1;
+    }
+    return 0;
+}
+
+
+int sfs_restore_block(sfs_dst_t *dst, const sfs_header_t *hdr, const sfs_block_t *blk, size_t *cursor,
+                      const sfs_window_t *win) {
+    return restore_block(dst, hdr, blk, cursor, win, NULL);
+}
+
+
+int sfs_restore_stream(FILE *sfp, sfs_dst_t *dst, const sfs_header_t *hdr, size_t *cursor,
+                       const sfs_window_t *win, int splice, size_t *blocks, size_t *total_read) {
+    restore_stream_t st;
+    sfs_block_t blk;
+    void *random_buf = NULL;
+    u_int64_t start;
+    int rc;
+
+    memset(&blk, 0, sizeof(sfs_block_t));
+    memset(&st, 0, sizeof(restore_stream_t));
+    st.sfp = sfp;
+    st.blk = &blk;
+    // Spliced data would not be added to the checksum
+    st.splice = splice && !(hdr->flags & SFS_FLAG_CHECKSUM);
+    st.buf = malloc(SFS_DATA_PIECE_SIZE);
+    if(hdr->random_size_bytes > 0)
+        random_buf = malloc(hdr->random_size_bytes);
+    if(st.buf == NULL || (hdr->random_size_bytes > 0 && random_buf == NULL)) {
+        fprintf(stderr, "Unable to allocate memory for the restore buffers\n");
+        free_all_mem(2, (void *) st.buf, random_buf);
+        return BLOCK_ERROR;
+    }
+
+    for(;;) {
+        start = sfs_stats_start(dst->stats);
+        rc = sfs_block_read_head(sfp, hdr, random_buf, &blk);
+        sfs_stats_time(dst->stats, SFS_STAT_READ_NS, start);
+        if(rc != BLOCK_OK)
+            break;
+        (*blocks)++;
+        st.start = 0;
+        st.len = 0;
+        // The checksum is only known once the data is restored: a corrupted block is
+        // reported, but its data may already be on the destination
+        if(restore_block(dst, hdr, &blk, cursor, win, &st) != 0) {
+            rc = BLOCK_ERROR;
+            break;
+        }
+        start = sfs_stats_start(dst->stats);
+        rc = sfs_block_read_tail(sfp, hdr, &blk);
+        sfs_stats_time(dst->stats, SFS_STAT_READ_NS, start);
+        if(rc != BLOCK_OK) {
+            rc = BLOCK_ERROR;
+            break;
+        }
+        *total_read += blk.stream_bytes;
+        sfs_stats_add(dst->stats, SFS_STAT_READ, blk.stream_bytes);
+        sfs_stats_block(dst->stats, blk.size);
+
+        // The rest of the stream is out of the window
+        if(*cursor >= win->end)
+            break;
+    }
+    if(rc == BLOCK_END)
+        *total_read += blk.stream_bytes;
+
+    sfs_block_free(&blk);
+    free_all_mem(2, (void *) st.buf, random_buf);
+    return rc;
+}
+
+
+typedef struct restore_job {
+    const char *src_path;
+    const char *dst_path;
+    const sfs_header_t *hdr;
+    const sfs_index_t *idx;
+    const sfs_window_t *win;
+    unsigned uring_depth;
+    size_t merge_size;
+    int diff;
+    sfs_stats_t *stats;
+    size_t next;            // Next block to restore
+    size_t last;            // Blocks are restored up to this one, excluded
+    off_t end;              // Destination end of the last block
+    int error;
+    pthread_mutex_t lock;
+} restore_job_t;
+
+
+// Restore the next block not taken by another worker, until there is none left
+static void *restore_worker(void *arg) {
+    restore_job_t *job = (restore_job_t *) arg;
+    const sfs_index_entry_t *e;
+    FILE *sfp;
+    sfs_dst_t dst;
+    sfs_block_t blk;
+    void *random_buf = NULL;
+    size_t b, cursor;
+    u_int64_t start;
+    int rc = -1;
+
+    memset(&dst, 0, sizeof(sfs_dst_t));
+    dst.fd = -1;
+    memset(&blk, 0, sizeof(sfs_block_t));
+
+    sfp = fopen(job->src_path, "rb");
+    if(sfp == NULL) {
+        fprintf(stderr, "Unable to open source file for reading\n");
+        goto end;
+    }
+    if(sfs_dst_open(&dst, job->dst_path, job->uring_depth, job->merge_size) != 0) {
+        fprintf(stderr, "Unable to open destination file for writing\n");
+        goto end;
+    }
+    dst.stats = job->stats;
+    dst.base = job->hdr->shard_offset;
+    dst.diff = job->diff;
+    if(job->hdr->random_size_bytes > 0) {
+        random_buf = malloc(job->hdr->random_size_bytes);
+        if(random_buf == NULL) {
+            fprintf(stderr, "Unable to allocate random buffer\n");
+            goto end;
+        }
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        b = job->error ? job->last : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if(b >= job->last)
+            break;
+
+        e = &job->idx->entries[b];
+        start = sfs_stats_start(job->stats);
+        if(fseeko(sfp, e->stream_offset, SEEK_SET) != 0 ||
+           sfs_block_read(sfp, job->hdr, random_buf, &blk) != BLOCK_OK) {
+            fprintf(stderr, "Unable to read atomic block %li\n", b);
+            goto end;
+        }
+        sfs_stats_time(job->stats, SFS_STAT_READ_NS, start);
+        if(sfs_block_decode(job->hdr, &blk) != BLOCK_OK) {
+            fprintf(stderr, "Unable to read atomic block %li\n", b);
+            goto end;
+        }
+        sfs_stats_add(job->stats, SFS_STAT_READ, blk.stream_bytes);
+        sfs_stats_block(job->stats, blk.size);
+        cursor = e->offset;
+        if(sfs_restore_block(&dst, job->hdr, &blk, &cursor, job->win) != 0)
+            goto end;
+        if(cursor != e->offset + e->len) {
+            fprintf(stderr, "Unconsistent data: atomic block %li differs from the block index\n", b);
+            goto end;
+        }
+    }
+
+    // Zero ranges still pending. The one ending the last block extends the destination
+    if(sfs_dst_finish(&dst, job->end) != 0)
+        goto end;
+    rc = 0;
+
+end:
+    if(rc != 0) {
+        pthread_mutex_lock(&job->lock);
+        job->error = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    sfs_dst_close(&dst);
+    sfs_block_free(&blk);
+    close_all_files(1, sfp);
+    free(random_buf);
+    return NULL;
+}
+
+
+int sfs_restore_parallel(const char *src_path, const char *dst_path, const sfs_header_t *hdr,
+                         const sfs_index_t *idx, const sfs_window_t *win, int jobs,
+                         unsigned uring_depth, size_t merge_size, int diff, sfs_stats_t *stats) {
+    restore_job_t job;
+    pthread_t *threads;
+    size_t end;
+    int i, started;
+
+    memset(&job, 0, sizeof(restore_job_t));
+    job.src_path = src_path;
+    job.dst_path = dst_path;
+    job.hdr = hdr;
+    job.idx = idx;
+    job.win = win;
+    job.uring_depth = uring_depth;
+    job.merge_size = merge_size;
+    job.diff = diff;
+    job.stats = stats;
+    job.next = sfs_index_find(idx, win->start);
+    for(job.last=job.next; job.last<idx->n && idx->entries[job.last].offset < win->end; job.last++);
+    if((size_t) jobs > job.last - job.next)
+        jobs = job.last - job.next;
+    if(jobs == 0)
+        return 0;
+    end = idx->entries[job.last-1].offset + idx->entries[job.last-1].len;
+    if(end > win->end)
+        end = win->end;
+    job.end = end - win->start;
+
+    threads = malloc(jobs * sizeof(pthread_t));
+    if(threads == NULL) {
+        fprintf(stderr, "Unable to allocate restore threads\n");
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    for(started=0; started<jobs; started++) {
+        if(pthread_create(&threads[started], NULL, restore_worker, &job) != 0) {
+            fprintf(stderr, "Unable to start restore thread\n");
+            pthread_mutex_lock(&job.lock);
+            job.error = 1;
+            pthread_mutex_unlock(&job.lock);
+            break;
+        }
+    }
+    for(i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    return job.error ? -1 : 0;
+}
@@ -0,0 +1,239 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <scanpipe.h>
+#include <sfs.h>
+
+
+typedef struct scanpipe {
+    sfs_reader_t *reader;
+    size_t chunk_size;
+    size_t blk_size;
+    size_t nslots;
+    scanpipe_slot_t *slots;
+    // Sequence numbers of the next chunk to read, scan and hand over
+    size_t next_read;
+    size_t next_scan;
+    size_t next_write;
+    int reader_done;
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sfs_stats_t *stats;
+} scanpipe_t;
+
+
+static void *scanpipe_reader(void *arg) {
+    scanpipe_t *sp = (scanpipe_t *) arg;
+    scanpipe_slot_t *slot;
+    ssize_t rb;
+    size_t hole;
+    int stop = 0;
+
+    while(!stop) {
+        slot = &sp->slots[sp->next_read % sp->nslots];
+
+        pthread_mutex_lock(&sp->lock);
+        while(slot->state != SLOT_FREE && !sp->abort)
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        stop = sp->abort;
+        pthread_mutex_unlock(&sp->lock);
+        if(stop)
+            break;
+
+        slot->len = 0;
+        slot->hole = 0;
+        slot->nruns = 0;
+        slot->error = 0;
+        hole = sfs_reader_skip_hole(sp->reader);
+        if(hole == (size_t) -1) {
+            slot->error = 1;
+        }
+        else if(hole > 0) {
+            slot->hole = hole;
+        }
+        else {
+            rb = sfs_reader_read(sp->reader, slot->buf, sp->chunk_size);
+            if(rb < 0)
+                slot->error = 1;
+            else
+                slot->len = rb;
+        }
+        slot->last = sp->reader->eof || slot->error;
+        stop = slot->last;
+
+        pthread_mutex_lock(&sp->lock);
+        // Holes and errors do not need any scan
+        slot->state = (slot->len > 0) ? SLOT_READ : SLOT_SCANNED;
+        sp->next_read++;
+        sp->reader_done = stop;
+        pthread_cond_broadcast(&sp->cond);
+        pthread_mutex_unlock(&sp->lock);
+    }
+
+    return NULL;
+}
+
+
+static void *scanpipe_worker(void *arg) {
+    scanpipe_t *sp = (scanpipe_t *) arg;
+    scanpipe_slot_t *slot;
+    u_int64_t start;
+
+    pthread_mutex_lock(&sp->lock);
+    while(1) {
+        // Skip the slots that need no scan
+        while(sp->next_scan < sp->next_read &&
+              sp->slots[sp->next_scan % sp->nslots].state != SLOT_READ)
+            sp->next_scan++;
+
+        if(sp->abort || (sp->reader_done && sp->next_scan == sp->next_read))
+            break;
+
+        if(sp->next_scan == sp->next_read) {
+            pthread_cond_wait(&sp->cond, &sp->lock);
+            continue;
+        }
+
+        slot = &sp->slots[sp->next_scan % sp->nslots];
+        slot->state = SLOT_SCANNING;
+        sp->next_scan++;
+        pthread_mutex_unlock(&sp->lock);
+
+        start = sfs_stats_start(sp->stats);
+        slot->nruns = zs_scan(slot->buf, slot->len / sp->blk_size * sp->blk_size,
+                              sp->blk_size, slot->runs);
+        sfs_stats_time(sp->stats, SFS_STAT_SCAN_NS, start);
+
+        pthread_mutex_lock(&sp->lock);
+        slot->state = SLOT_SCANNED;
+        pthread_cond_broadcast(&sp->cond);
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return NULL;
+}
+
+
+int scanpipe_run(sfs_reader_t *reader, size_t chunk_size, size_t blk_size, int nworkers,
+                 scanpipe_cb_t cb, void *ctx, sfs_stats_t *stats) {
+    scanpipe_t sp;
+    scanpipe_slot_t *slot;
+    pthread_t reader_thread;
+    pthread_t *workers = NULL;
+    int started = 0, reader_started = 0, last = 0;
+    int rc = 0;
+    size_t i;
+
+    memset(&sp, 0, sizeof(scanpipe_t));
+    sp.reader = reader;
+    sp.chunk_size = chunk_size;
+    sp.blk_size = blk_size;
+    sp.stats = stats;
+    sp.nslots = 2 * nworkers + 2;
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.cond, NULL);
+
+    sp.slots = calloc(sp.nslots, sizeof(scanpipe_slot_t));
+    workers = calloc(nworkers, sizeof(pthread_t));
+    if(sp.slots == NULL || workers == NULL) {
+        fprintf(stderr, "Unable to allocate pipeline slots\n");
+        rc = -1;
+        goto out;
+    }
+    for(i=0; i<sp.nslots; i++) {
+        slot = &sp.slots[i];
+        // Aligned for direct I/O
+        if(posix_memalign((void **) &slot->buf, DIRECT_IO_ALIGN, chunk_size) != 0) {
+            slot->buf = NULL;
+            fprintf(stderr, "Unable to allocate %li bytes for pipeline slot. "
+                    "Try decreasing read chunk size or jobs number.\n", chunk_size);
+            rc = -1;
+            goto out;
+        }
+        slot->runs = malloc(chunk_size / blk_size * sizeof(sfs_run_t));
+        if(slot->runs == NULL) {
+            fprintf(stderr, "Unable to allocate memory for runs\n");
+            rc = -1;
+            goto out;
+        }
+    }
+
+    if(pthread_create(&reader_thread, NULL, scanpipe_reader, &sp) != 0) {
+        fprintf(stderr, "Unable to start reader thread\n");
+        rc = -1;
+        goto out;
+    }
+    reader_started = 1;
+    for(started=0; started<nworkers; started++) {
+        if(pthread_create(&workers[started], NULL, scanpipe_worker, &sp) != 0) {
+            fprintf(stderr, "Unable to start scanner thread\n");
+            rc = -1;
+            goto out;
+        }
+    }
+
+    // Hand the scanned chunks over in order
+    while(!last) {
+        slot = &sp.slots[sp.next_write % sp.nslots];
+
+        pthread_mutex_lock(&sp.lock);
+        while(slot->state != SLOT_SCANNED)
+            pthread_cond_wait(&sp.cond, &sp.lock);
+        pthread_mutex_unlock(&sp.lock);
+
+        if(slot->error) {
+            rc = -1;
+            break;
+        }
+        if(cb(ctx, slot) != 0) {
+            rc = -1;
+            break;
+        }
+        last = slot->last;
+
+        pthread_mutex_lock(&sp.lock);
+        slot->state = SLOT_FREE;
+        sp.next_write++;
+        pthread_cond_broadcast(&sp.cond);
+        pthread_mutex_unlock(&sp.lock);
+    }
+
+out:
+    pthread_mutex_lock(&sp.lock);
+    sp.abort = 1;
+    pthread_cond_broadcast(&sp.cond);
+    pthread_mutex_unlock(&sp.lock);
+
+    for(i=0; i<started; i++)
+        pthread_join(workers[i], NULL);
+    if(reader_started)
+        pthread_join(reader_thread, NULL);
+
+    if(sp.slots != NULL) {
+        for(i=0; i<sp.nslots; i++)
+            free_all_mem(2, (void *) sp.slots[i].buf, (void *) sp.slots[i].runs);
+    }
+    free_all_mem(2, (void *) sp.slots, (void *) workers);
+    pthread_mutex_destroy(&sp.lock);
+    pthread_cond_destroy(&sp.cond);
+
+    return rc;
+}
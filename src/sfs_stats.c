@@ -13,24 +13,40 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 
-#include <sfs.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <decoder.h>
+#include <sfs.h>
+
 
 int main(int argc, char *argv[])
 {
     char *sfilename;
     FILE *sfp;
     sfs_footer_t *footerp;
+    int c, verify = 0;
+    static struct option long_options[] = {
+        {"verify", no_argument, NULL, 'V'},
+        {NULL, 0, NULL, 0}
+    };
 
-    if(argc != 2)
-        DIE("Missing argument, usage: sfs_stats filename\n");
+    // --verify reads the whole image, checking every block, without restoring anything
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if(c == 'V')
+            verify = 1;
+        else
+            DIE("Usage: sfs_stats [--verify] filename\n");
+    }
+    if(argc - optind != 1)
+        DIE("Missing argument, usage: sfs_stats [--verify] filename\n");
 
-    sfilename = argv[1];
+    sfilename = argv[optind];
 
     sfp = fopen(sfilename, "rb");
     if(sfp == NULL)
@@ -40,6 +56,15 @@ int main(int argc, char *argv[])
     if(footerp == NULL)
         DIE("Unable to extract footer from source\n");
 
+    if(verify) {
+        if(fseeko(sfp, 0, SEEK_SET) != 0 || sfs_decoder_verify(sfp, footerp) != SFS_OK) {
+            free(footerp);
+            fclose(sfp);
+            DIE("Verification failed\n");
+        }
+        fprintf(stderr, "Image verified\n");
+    }
+
     fprintf(stdout, "Sparse file stripper stats: read=%li, written=%li, "
             "ratio=%.5lf, atomic_blocks=%li\n", footerp->read, footerp->written,
             footerp->ratio, footerp->atomic_blocks);
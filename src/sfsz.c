@@ -13,17 +13,25 @@
  * limitations under the License.
  */
 
-#include <assert.h>
-#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <codec.h>
+#include <encoder.h>
+#include <reader.h>
 #include <sfs.h>
+#include <signature.h>
+#include <stats.h>
 
-#define FIVE_GIB  (long) (5 * pow(2, 30))
-#define MAX_RANDOM_BUFFER_SIZE (unsigned int) 10485760
+#define MAX_READ_CHUNK_SIZE 1073741824
+#define MAX_JOBS 256
+#define MAX_SHARDS 256
+#define SHARD_ALIGN MAX_GRANULARITY // Shards start on a multiple of any granularity and direct I/O alignment
 
 void print_usage() {
     // The atomic_block_size_bytes can be adapted, depending on the target available memory.
@@ -35,158 +43,360 @@ void print_usage() {
     // The random size is expected to be provided in bytes. It will be divided by sizeof(int) and floored.
     // We do not need a strong and secure random generator for this. The purpose is to prevent any compression tool further in the workflow from
     // cancelling the -k effect (due to empty atomic blocks pattern being caught)
-    fprintf(stderr, "sfsz [-b atomic_block_size_bytes] [-k read_bytes_keepalive] [-r random_size_bytes] src_path dst_path\n");
+    // -c is the size of the chunks read from the source at once, -d reads the source with O_DIRECT
+    // so that big backups do not churn the page cache of the host
+    // -j runs the reading, the zero scan (on the given number of threads) and the writing concurrently.
+    // The output is exactly the same as with the default single threaded mode
+    // -u reads the source through io_uring, every chunk being split in up to queue_depth reads
+    // -g is the sparse detection granularity (power of 2, 512 to 1048576, 4096 by default): smaller
+    // strips more zeros, bigger means less boundaries in the stream and less holes to punch at restore
+    // -f also strips the granules made of a single repeated 64 bits word (0xFF erased flash, fill
+    // patterns...), restored by filling them. Such streams can only be read by sfsuz 3.0 and later
+    // -D deduplicates granules: the ones already met earlier in the source (as long as they are
+    // still in the dedup_table_bytes fingerprint table) are restored by copying the earlier ones.
+    // The source must be seekable
+    // -z compresses the data of every atomic block with the given codec (zstd or lz4, if built in)
+    // and optional level, on -t codec_threads threads. Higher levels compress better for both
+    // codecs (lz4: 3 to 12 use LZ4HC, negative levels are faster). Blocks are compressed independently,
+    // so that sfsuz decompresses them in parallel too
+    // -i appends a block index before the footer, for sfsuz --range to seek straight to the blocks
+    // of a range of a seekable image
+    // -C ends every atomic block with a checksum of the whole block, verified by sfsuz before the
+    // block is written and by sfs_stats --verify
+    // -e packs the boundaries of every block as varints, in granules: much smaller metadata for
+    // fragmented sources. Such streams can only be read by sfsuz 3.0 and later
+    // -H writes the boundaries of every block before its data, for sfsuz to restore the data as it
+    // comes with a few MiB of memory whatever the atomic block size. Cannot be combined with -z
+    // --signatures writes the hash of every granule of the source to the given file. A later backup
+    // of the same source given it as --base only stores the granules that changed since: the stream
+    // is then restored with sfsuz --onto-base, on a destination holding the base image
+    // --stats-fd writes JSON lines of throughput, wait and scan times and block fill to the given
+    // file descriptor every second and at the end, --stats-json appends them to the given file
+    // --vmsplice hands the data of the blocks to the output pipe by reference instead of copying it,
+    // the pages given away being replaced by fresh ones
+    // --shards splits the source (a regular file or a block device) in shards contiguous ranges, backed
+    // up at once as independent streams: %d in dst_path is replaced by the shard number, from 0 on.
+    // --shard-fds writes the streams to the given comma separated file descriptors instead, dst_path
+    // being -. Every shard is restored on its own by sfsuz, where it starts
+    fprintf(stderr, "sfsz [-b atomic_block_size_bytes] [-k read_bytes_keepalive] [-r random_size_bytes] "
+            "[-c read_chunk_bytes] [-d] [-j scan_jobs] [-u queue_depth] [-g granularity_bytes] [-f] "
+            "[-D dedup_table_bytes] [-z codec[:level]] [-t codec_threads] [-i] [-C] [-e] [-H] [--signatures path] "
+            "[--base signatures_path] [--stats-fd fd] [--stats-json path] [--vmsplice] [--shards shards] [--shard-fds fd,fd...] "
+            "src_path dst_path\n");
 }
 
 
-int flush_block(void* buffer, size_t buf_offset, sfs_footer_t* footerp,
-                 FILE *dfp, size_t meta_idx, size_t* data_boundaries,
-                 size_t closure_offset, size_t random_size, int* random_buf) {
-    size_t written;
-    int i;
+static void clean_all(sfs_reader_t *reader, FILE *dfp, sfs_sig_t *sig, sfs_sig_t *base) {
+    sfs_reader_close(reader);
+    if(dfp != NULL)
+        fclose(dfp);
+    if(sig != NULL)
+        sfs_sig_close(sig);
+    if(base != NULL)
+        sfs_sig_close(base);
+}
 
-    // Push next block size (not counting the additional random if any)
-    written = fwrite(&buf_offset, sizeof(size_t), 1, dfp);
-    if(written != 1) {
-        fprintf(stderr, "Write next block size error\n");
-        return 1;
-    }
-    footerp->written += sizeof(size_t);
 
-    // Push random
-    if(random_buf != NULL)
-    {
-        for(i=0; i<random_size; i++){
-            random_buf[i] = rand();
-        }
-        //fprintf(stderr, "Block random %d\n", random);
-        written = fwrite((void *) random_buf, sizeof(int), random_size, dfp);
-        if(written != random_size) {
-            fprintf(stderr, "Write random in next block error\n");
-            return 1;
-        }
-        footerp->written += sizeof(int) * random_size;
+// Shard of a sharded backup, backed up by its own thread
+typedef struct shard {
+    sfs_encoder_opts_t opts;
+    const char *src_path;
+    int direct_io;
+    unsigned uring_depth;
+    size_t len;
+    FILE *dfp;
+    sfs_reader_t reader;
+    sfs_encoder_t enc;
+    int rc;
+} shard_t;
+
+
+static void *backup_shard(void *arg) {
+    shard_t *shard = (shard_t *) arg;
+    sfs_reader_t *reader = &shard->reader;
+    sfs_encoder_t *enc = &shard->enc;
+
+    shard->rc = SFS_ERR_IO;
+    if(sfs_reader_open(reader, shard->src_path, shard->direct_io, shard->opts.granularity) != 0 ||
+       sfs_reader_set_range(reader, shard->opts.shard_offset, shard->len) != 0) {
+        fprintf(stderr, "Unable to open source file for reading\n");
+        return NULL;
     }
+    if(shard->uring_depth > 0 && sfs_reader_use_uring(reader, shard->uring_depth) != 0)
+        fprintf(stderr, "WARNING: io_uring is not available for this source, falling back on plain reads\n");
+
+    shard->opts.source_fd = reader->fd;
+    shard->rc = sfs_encoder_open(enc, &shard->opts, shard->dfp);
+    if(shard->rc != SFS_OK)
+        return NULL;
+    shard->rc = sfs_encoder_run(enc, reader);
+    if(shard->rc == SFS_OK)
+        shard->rc = sfs_encoder_finish(enc);
+    if(shard->rc == SFS_OK)
+        fprintf(stderr, "Shard %li: read %li from offset %li, written %li, compression ratio %.5lf, "
+                "number of atomic_blocks %li\n", shard->opts.shard_index, enc->footer.read,
+                shard->opts.shard_offset, enc->footer.written, enc->footer.ratio, enc->atomic_blocks);
+    sfs_encoder_close(enc);
+    return NULL;
+}
 
-    // Push block data
-    written = fwrite((void *) buffer, 1, buf_offset, dfp);
-    if(written != buf_offset) {
-        fprintf(stderr, "Unable to write buffer correctly\n");
-        return 1;
-    }
-    footerp->written += buf_offset;
 
-    // Close the data range if we were in copy mode, i.e if meta_idx % 2 != 0
-    if(meta_idx % 2 != 0) {
-        data_boundaries[meta_idx] = closure_offset;
-        meta_idx++;
+/* Back up the source as nshards contiguous shards at once, to dst_path with %d replaced
+ * by the shard number, or to fds if not NULL. Returns 0 on success, -1 on failure
+ */
+static int backup_shards(const char *src_path, const char *dst_path, const int *fds, size_t nshards,
+                         const sfs_encoder_opts_t *opts, int direct_io, unsigned uring_depth) {
+    sfs_reader_t reader;
+    shard_t *shards;
+    pthread_t *threads;
+    const char *pattern;
+    char *path;
+    off_t size;
+    size_t shard_size, i, started, read = 0, written = 0;
+    int rc = 0;
+
+    // The shards are cut from the source size
+    if(sfs_reader_open(&reader, src_path, 0, opts->granularity) != 0)
+        return -1;
+    size = sfs_reader_source_size(&reader);
+    sfs_reader_close(&reader);
+    if(size < 0) {
+        fprintf(stderr, "Sharded backups need a regular file or block device source\n");
+        return -1;
     }
-
-    //fprintf(stderr, "Flushing block with %li bytes, meta_idx %li, closure offset %li\n", buf_offset, meta_idx, closure_offset);
-
-    /* else {
-        // We were in sparse mode, so all data cluster were closed
-    } */
-
-    // Push offset array size (unit = number of long = bytes_size / 8)
-    written = fwrite(&meta_idx, sizeof(size_t), 1, dfp);
-    if(written != 1) {
-        fprintf(stderr, "Write offsets size error\n");
-        return 1;
+    shard_size = (size + nshards - 1) / nshards;
+    shard_size = (shard_size + SHARD_ALIGN - 1) / SHARD_ALIGN * SHARD_ALIGN;
+    pattern = fds == NULL ? strstr(dst_path, "%d") : NULL;
+    path = malloc(strlen(dst_path) + 24);
+    shards = calloc(nshards, sizeof(shard_t));
+    threads = calloc(nshards, sizeof(pthread_t));
+    if(path == NULL || shards == NULL || threads == NULL) {
+        free_all_mem(3, (void *) path, (void *) shards, (void *) threads);
+        fprintf(stderr, "Unable to allocate memory for shards\n");
+        return -1;
     }
-
-    footerp->written += sizeof(size_t);
-
-    // Push offsets
-    written = fwrite((void *) data_boundaries, sizeof(size_t), meta_idx, dfp);
-    if(written != meta_idx) {
-        fprintf(stderr, "Write meta error\n");
-        return 1;
+    fprintf(stderr, "Backing up %li bytes as %li shards of %li bytes\n", size, nshards, shard_size);
+
+    for(started=0; started<nshards; started++) {
+        shards[started].opts = *opts;
+        shards[started].opts.shard_index = started;
+        shards[started].opts.shard_count = nshards;
+        shards[started].opts.shard_offset = started * shard_size < (size_t) size ? started * shard_size : size;
+        shards[started].len = size - shards[started].opts.shard_offset;
+        if(shards[started].len > shard_size)
+            shards[started].len = shard_size;
+        shards[started].src_path = src_path;
+        shards[started].direct_io = direct_io;
+        shards[started].uring_depth = uring_depth;
+        if(fds != NULL) {
+            shards[started].dfp = fdopen(fds[started], "wb");
+        }
+        else {
+            sprintf(path, "%.*s%li%s", (int) (pattern - dst_path), dst_path, started, pattern + 2);
+            shards[started].dfp = fopen(path, "wb");
+        }
+        if(shards[started].dfp == NULL) {
+            fprintf(stderr, "Unable to open destination of shard %li for writing\n", started);
+            rc = -1;
+            break;
+        }
+        if(pthread_create(&threads[started], NULL, backup_shard, &shards[started]) != 0) {
+            fprintf(stderr, "Unable to start the thread of shard %li\n", started);
+            fclose(shards[started].dfp);
+            rc = -1;
+            break;
+        }
     }
 
-    footerp->written += meta_idx * sizeof(size_t);
-    return 0;
+    for(i=0; i<started; i++) {
+        pthread_join(threads[i], NULL);
+        if(fclose(shards[i].dfp) != 0 || shards[i].rc != SFS_OK) {
+            fprintf(stderr, "Shard %li failed: %s\n", i, sfs_strerror(shards[i].rc));
+            rc = -1;
+        }
+        sfs_reader_close(&shards[i].reader);
+        read += shards[i].enc.footer.read;
+        written += shards[i].enc.footer.written;
+    }
+    if(rc == 0)
+        fprintf(stderr, "Read: %li, written %li in %li shards\n", read, written, nshards);
+    free_all_mem(3, (void *) path, (void *) shards, (void *) threads);
+    return rc;
 }
 
 
-void clean_all(FILE *sfp, FILE *dfp, char *buffer, size_t *data_boundaries, int* random_buf) {
-    close_all_files(2, sfp, dfp);
-    free_all_mem(3, (void *) buffer, (void *) data_boundaries, (void *) random_buf);
+// Parse a comma separated list of file descriptors, returns their number or 0 if invalid
+static size_t parse_fds(const char *arg, int *fds, size_t max) {
+    char *end;
+    size_t n;
+
+    for(n=0; n<max; n++) {
+        fds[n] = (int) strtol(arg, &end, 10);
+        if(end == arg || fds[n] < 0)
+            return 0;
+        if(*end == '\0')
+            return n + 1;
+        if(*end != ',')
+            return 0;
+        arg = end + 1;
+    }
+    return 0;
 }
 
 
 int main(int argc, char *argv[])
 {
     int c;
-    // We start assuming the beginning of the file is not sparse
-    unsigned int sparse_on = 0;
-    unsigned int copy = 0;
-    unsigned int force_buffer_flush = 0;
-    size_t *data_boundaries = NULL;
-    // Storing relative offsets instead of the absolute ones will probably be more perf
-    // when calling fseek from seek_cur
-    size_t relative_offset = 0;
-    char zeros[BLK_SIZE];
-    char src[BLK_SIZE];
-    //Default stack size -> about 8MiB, our buffer won't fit in there.
-    char* buffer = NULL;
-    size_t meta_idx = 0, atomic_blocks = 0;
-    size_t rb, written;
-    size_t buf_offset = 0;
-    size_t data_cluster_nb = 0;
+    int direct_io = 0;
+    unsigned uring_depth = 0;
+    char *level;
+    char *sig_path = NULL, *base_path = NULL;
+    sfs_sig_t sig, base;
+    sfs_encoder_opts_t opts;
+    char *sfilename;
+    char *dfilename;
+    FILE *dfp = NULL;
+    sfs_reader_t reader;
+    sfs_encoder_t enc;
+    sfs_stats_t stats;
+    int stats_fd = -1;
+    size_t nshards = 1;
+    int shard_fds[MAX_SHARDS], *fds = NULL;
+    static struct option long_options[] = {
+        {"signatures", required_argument, NULL, 'S'},
+        {"base", required_argument, NULL, 'B'},
+        {"stats-fd", required_argument, NULL, 'F'},
+        {"stats-json", required_argument, NULL, 'J'},
+        {"vmsplice", no_argument, NULL, 'V'},
+        {"shards", required_argument, NULL, 'N'},
+        {"shard-fds", required_argument, NULL, 'O'},
+        {NULL, 0, NULL, 0}
+    };
+    memset(&reader, 0, sizeof(sfs_reader_t));
+    reader.fd = -1;
     /* Default structure block size: this gives
      * the size of blocks to be bufferized in memory and processed
      * as a whole when downloading. Do not choose it big if your target
      * has not much memory */
-    size_t atomic_block_size = 268435456;
-    size_t read_bytes_keepalive = 0;
-    size_t read_since_last_flush = 0;
-    size_t random_size = 0, random_size_bytes = 0;
-    int *random_buf = NULL;
-    char *sfilename;
-    char *dfilename;
-    FILE *sfp = NULL;
-    FILE *dfp = NULL;
-    sfs_footer_t footer;
-    footer.read = 0;
-    footer.written = 0;
-    footer.ratio = 0;
-    footer.atomic_blocks = 0;
-    size_t meta_len = 0, extend_meta = 0, meta_max_idx = 0;
-
-    // We do not need a strong random generator, so we do not
-    // lose time initializing the random seed. Besides we want
-    // a repeatable process so the seed needs to stay the same
-    srand(1);
-
-    while ((c = getopt(argc, argv, ":b:k:r:")) != -1) {
+    sfs_encoder_opts_init(&opts);
+
+    while ((c = getopt_long(argc, argv, ":b:c:defg:ij:k:r:t:u:z:CD:H", long_options, NULL)) != -1) {
         switch (c) {
-            case 'c':
-                random_size_bytes = (size_t) atol(optarg);
-                if(random_size_bytes < sizeof(int))
+            case 'S':
+                sig_path = optarg;
+                break;
+            case 'B':
+                base_path = optarg;
+                break;
+            case 'F':
+                stats_fd = atoi(optarg);
+                break;
+            case 'J':
+                stats_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                if(stats_fd < 0)
+                    DIE("Unable to open the stats file\n");
+                break;
+            case 'V':
+                opts.vmsplice = 1;
+                break;
+            case 'N':
+                nshards = (size_t) atol(optarg);
+                if(nshards < 2 || nshards > MAX_SHARDS)
+                    DIE("Shards number must be between 2 and 256\n");
+                break;
+            case 'O':
+                nshards = parse_fds(optarg, shard_fds, MAX_SHARDS);
+                if(nshards < 2)
+                    DIE("Shard file descriptors must be 2 to 256 comma separated numbers\n");
+                fds = shard_fds;
+                break;
+            case 'r':
+                opts.random_size_bytes = (size_t) atol(optarg);
+                if(opts.random_size_bytes < sizeof(int))
                     fprintf(
                         stderr,
                         "WARNING: random buffer size must be greater than %li to take effect. Ignoring\n",
                         sizeof(int)
                     );
-                if(random_size_bytes > MAX_RANDOM_BUFFER_SIZE) {
+                if(opts.random_size_bytes > MAX_RANDOM_BUFFER_SIZE) {
                     fprintf(stderr, "Random buffer size must be lower than %u bytes.\n", MAX_RANDOM_BUFFER_SIZE);
                     DIE("Bad random size\n");
                 }
-                random_size = random_size_bytes / sizeof(int);
-                random_size_bytes = random_size * sizeof(int);
-                fprintf(stderr, "Random buffer size (bytes): %li\n", random_size_bytes);
+                opts.random_size_bytes = opts.random_size_bytes / sizeof(int) * sizeof(int);
+                fprintf(stderr, "Random buffer size (bytes): %li\n", opts.random_size_bytes);
                 break;
             case 'k':
-                read_bytes_keepalive = (size_t) atol(optarg);
+                opts.read_bytes_keepalive = (size_t) atol(optarg);
                 break;
             case 'b':
-                atomic_block_size = (size_t) atol(optarg);
-                if(atomic_block_size % BLK_SIZE != 0)
-                    DIE("Atomic block size must be a multiple of 4096 bytes");
-                if(atomic_block_size > 4294967296 || atomic_block_size == 0)
+                opts.atomic_block_size = (size_t) atol(optarg);
+                if(opts.atomic_block_size % MIN_GRANULARITY != 0)
+                    DIE("Atomic block size must be a multiple of 512 bytes\n");
+                if(opts.atomic_block_size > MAX_ATOMIC_BLOCK_SIZE || opts.atomic_block_size == 0)
                     DIE("Atomic block size must be greater than 0 and lower than 4294967296 bytes (4 GiB)\n");
-                fprintf(stderr, "Custom atomic block size %li\n", atomic_block_size);
+                fprintf(stderr, "Custom atomic block size %li\n", opts.atomic_block_size);
+                break;
+            case 'c':
+                opts.chunk_size = (size_t) atol(optarg);
+                if(opts.chunk_size % DIRECT_IO_ALIGN != 0 || opts.chunk_size == 0)
+                    DIE("Read chunk size must be a positive multiple of 4096 bytes\n");
+                if(opts.chunk_size > MAX_READ_CHUNK_SIZE)
+                    DIE("Read chunk size must be lower than 1073741824 bytes (1 GiB)\n");
+                fprintf(stderr, "Custom read chunk size %li\n", opts.chunk_size);
+                break;
+            case 'd':
+                direct_io = 1;
+                break;
+            case 'f':
+                opts.patterns = 1;
+                break;
+            case 'i':
+                opts.indexed = 1;
+                break;
+            case 'C':
+                opts.checksum = 1;
+                break;
+            case 'e':
+                opts.compact = 1;
+                break;
+            case 'H':
+                opts.boundaries_first = 1;
+                break;
+            case 'D':
+                opts.dedup_table_size = (size_t) atol(optarg);
+                if(opts.dedup_table_size < 16 * sizeof(sfs_dedup_entry_t))
+                    DIE("Deduplication table size must be at least 256 bytes\n");
+                break;
+            case 'g':
+                opts.granularity = (size_t) atol(optarg);
+                if(opts.granularity < MIN_GRANULARITY || opts.granularity > MAX_GRANULARITY ||
+                   (opts.granularity & (opts.granularity - 1)) != 0)
+                    DIE("Granularity must be a power of 2 between 512 and 1048576 bytes\n");
+                fprintf(stderr, "Custom granularity %li\n", opts.granularity);
+                break;
+            case 'j':
+                opts.jobs = atoi(optarg);
+                if(opts.jobs < 1 || opts.jobs > MAX_JOBS)
+                    DIE("Jobs number must be between 1 and 256\n");
+                break;
+            case 'u':
+                uring_depth = (unsigned) atol(optarg);
+                if(uring_depth < 1 || uring_depth > MAX_URING_DEPTH)
+                    DIE("io_uring queue depth must be between 1 and 4096\n");
+                break;
+            case 'z':
+                level = strchr(optarg, ':');
+                if(level != NULL)
+                    *level++ = '\0';
+                opts.codec = sfs_codec_by_name(optarg);
+                if(opts.codec < 0)
+                    DIE("Unknown codec, or codec not built in (make ZSTD=1 LZ4=1)\n");
+                opts.codec_level = level != NULL ? atoi(level) : sfs_codec_default_level(opts.codec);
+                break;
+            case 't':
+                opts.codec_threads = atoi(optarg);
+                if(opts.codec_threads < 1 || opts.codec_threads > MAX_CODEC_THREADS)
+                    DIE("Codec threads number must be between 1 and 256\n");
                 break;
             case '?':
                 print_usage();
@@ -207,240 +417,105 @@ int main(int argc, char *argv[])
     sfilename = argv[optind];
     dfilename = argv[optind+1];
 
-    if(strcmp(sfilename, "-") == 0) {
-        sfp = freopen(NULL, "rb", stdin);
-        if(sfp == NULL) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-            DIE("Unable to reopen stdin in binary mode\n");
-        }
+    // Every shard has its own reader, encoder and output, on its own thread
+    if(nshards > 1) {
+        if(sig_path != NULL || base_path != NULL || stats_fd >= 0)
+            DIE("Signatures and stats are not available with shards\n");
+        if(fds != NULL ? strcmp(dfilename, "-") != 0 : strstr(dfilename, "%d") == NULL)
+            DIE("The destination of shards must contain %%d, or be - with --shard-fds\n");
+        if(backup_shards(sfilename, dfilename, fds, nshards, &opts, direct_io, uring_depth) != 0)
+            DIE("Sharded backup failed\n");
+        fprintf(stderr, "Sparse file stripper compression done!\n");
+        exit(EXIT_SUCCESS);
     }
-    else {
-        sfp = fopen(sfilename, "rb");
-        if(sfp == NULL) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-            DIE("Unable to open source file for reading\n");
+
+    if(sfs_reader_open(&reader, sfilename, direct_io, opts.granularity) != 0) {
+        clean_all(&reader, dfp, NULL, NULL);
+        DIE("Unable to open source file for reading\n");
+    }
+
+    if(stats_fd >= 0) {
+        if(sfs_stats_init(&stats, "sfsz", stats_fd, opts.atomic_block_size) != 0) {
+            clean_all(&reader, dfp, NULL, NULL);
+            DIE("Unable to set up the stats\n");
         }
+        opts.stats = &stats;
+        reader.stats = &stats;
+    }
+
+    if(uring_depth > 0) {
+        if(sfs_reader_use_uring(&reader, uring_depth) == 0)
+            fprintf(stderr, "Reading through io_uring, queue depth %u\n", uring_depth);
+        else
+            fprintf(stderr, "WARNING: io_uring is not available for this source, "
+                    "falling back on plain reads\n");
     }
 
     if(strcmp(dfilename, "-") == 0) {
         dfp = freopen(NULL, "wb", stdout);
         if(dfp == NULL) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
+            clean_all(&reader, dfp, NULL, NULL);
             DIE("Unable to reopen stdout in binary mode\n");
         }
     }
     else {
         dfp = fopen(dfilename, "wb");
         if(dfp == NULL) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
+            clean_all(&reader, dfp, NULL, NULL);
             DIE("Unable to open destination file for writing\n");
         }
     }
 
-    // Allocate random buffer if needed
-    if(random_size > 0){
-        fprintf(stderr, "Random buffers activated!\n");
-        random_buf = (int *) malloc(random_size_bytes);
-        if(random_buf == NULL) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-            DIE("Unable to allocate random buffer\n");
+    // The encoder owns the signature files from here
+    if(base_path != NULL) {
+        if(sfs_sig_open(&base, base_path) != 0) {
+            clean_all(&reader, dfp, NULL, NULL);
+            DIE("Unable to load the base signatures\n");
         }
+        opts.base = &base;
     }
-
-    // Prepend the random_size_bytes value in the output for the sfsuz to know how to inflate the file later
-    written = fwrite(&random_size_bytes, sizeof(size_t), 1, dfp);
-    if(written != 1) {
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        DIE("Unable to write to destination\n");
-    }
-    footer.written += sizeof(size_t);
-
-    buffer = malloc(atomic_block_size);
-    if(buffer == NULL) {
-        fprintf(stderr, "Unable to allocate buffer size correctly (%li required). "
-                "Decrease the block size.\n", atomic_block_size);
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        exit(1);
-    }
-
-    memset(zeros, 0, BLK_SIZE);
-
-    // In the worst case scenario, there will be atomic_block_size/BLK_SIZE + 2 boundaries,
-    // if data and sparse regions are all 1 block long. +2 is if we actually start with a sparse region
-    // The last bool is to make the max idx even, so that realloc activates correctly below if the
-    // max size computed here was anyhow wrong
-    extend_meta = (atomic_block_size / BLK_SIZE + 1) * 2;
-    extend_meta *= sizeof(size_t);
-    fprintf(stderr, "Estimated boundary array max size in bytes: %li\n", extend_meta);
-
-    data_boundaries = malloc(extend_meta);
-    if(data_boundaries == NULL) {
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        DIE("Unable to allocate memory for data_boundaries. Try decreasing atomic block size.\n");
-    }
-    meta_len += extend_meta;
-    meta_max_idx = meta_len / sizeof(size_t);
-    assert( meta_max_idx % 2 == 0);
-    // By convention, we start with sparse_mode off.
-    // For clarity, we explicitely set the first data_boundaries item to 0 as the first data offset
-    // (even if we could implictely skip it)
-    data_boundaries[0] = 0;
-    meta_idx++;
-    fprintf(stderr, "Start reading\n");
-    while ((rb = fread((void *) src, 1, BLK_SIZE, sfp)) > 0) {
-        read_since_last_flush += rb;
-        if(rb < BLK_SIZE || ((read_bytes_keepalive > 0) && (read_since_last_flush >= read_bytes_keepalive))) {
-            if(rb < BLK_SIZE)
-                fprintf(stderr, "Less than %d bytes read (%li bytes), unaligned so not skipping data\n",
-                        BLK_SIZE, rb);
-            else
-                fprintf(stderr, "More than %li bytes read since last flush (%li bytes read). Forcing copy and flush (keepalive safety)\n",
-                        read_bytes_keepalive, read_since_last_flush);
-            copy = 1;
-            force_buffer_flush = 1;
-        }
-        else {
-            force_buffer_flush = 0;
-            if(memcmp(src, zeros, BLK_SIZE) != 0) {
-                copy = 1;
-            }
-            else {
-                copy = 0;
-            }
-        }
-
-        if(!copy) {
-            if(!sparse_on) {
-                if(meta_idx == meta_max_idx-1) {
-
-                    // This section should normally be dead code, if the first upper boundary computed above is correct
-                    // we have reached the end (1 slot left for us) of the data_boundaries,
-                    // we need to realloc some space
-                    fprintf(stderr, "Data_boundaries memory needs extension. Etending by %li bytes\n", extend_meta);
-                    meta_len += extend_meta;
-                    meta_max_idx = meta_len / sizeof(size_t);
-
-                    data_boundaries = realloc(
-                        data_boundaries, meta_len);
-                    if(data_boundaries == NULL) {
-                        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-                        DIE("Unable to extend meta. Memory allocation error. Try decreasing atomic block size.\n");
-                    }
-                    fprintf(stderr, "data_boundaries size is now %li bytes\n",
-                            meta_len);
-                }
-                data_boundaries[meta_idx] = relative_offset; // End a data range, start a new sparse range
-                relative_offset = 0;
-                meta_idx++;
-                sparse_on = 1;
-            }
-            relative_offset += rb;
-        }
-        else {
-            if(sparse_on) {
-                sparse_on = 0;
-                // If we are on a copy case, then we are certain meta_idx % 2 == 0 and
-                // meta_idx < meta_max_idx-1. Thus we do not need to realloc
-                data_boundaries[meta_idx] = relative_offset; // Start a new data range
-                relative_offset = 0;
-                meta_idx++;
-            }
-            memcpy(buffer+buf_offset, src, rb);
-            buf_offset += rb;
-            relative_offset += rb;
-            if(force_buffer_flush || buf_offset == atomic_block_size) {
-
-                assert(meta_idx % 2 == 1);
-
-                if(flush_block(buffer, buf_offset, &footer, dfp, meta_idx,
-                               data_boundaries, relative_offset, random_size, random_buf)) {
-                    clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-                    DIE("Flush block error\n");
-                }
-
-                // Increment data cluster number for stats
-                data_cluster_nb += (meta_idx + 1) / 2;
-                atomic_blocks++;
-
-                // Reset all counters, prepare for a new atomic block
-                buf_offset = 0;
-                read_since_last_flush = 0;
-                meta_idx = 1;
-
-                relative_offset = 0;
-
-            }
-        }
-
-        footer.read += rb;
-
-        if(footer.read % FIVE_GIB == 0) {
-            if(footer.read > 0) {
-                footer.ratio = ((double) footer.written / (double) footer.read);
-            }
-            fprintf(stderr, "Read %li, written %li, compression ratio %.5lf, data cluster number %li, atomic blocks %li\n",
-                    footer.read, footer.written, footer.ratio, data_cluster_nb, atomic_blocks);
+    if(sig_path != NULL) {
+        if(sfs_sig_create(&sig, sig_path, opts.granularity) != 0) {
+            clean_all(&reader, dfp, &sig, opts.base);
+            DIE("Unable to create the signature file\n");
         }
-
+        opts.sig = &sig;
     }
 
-    if(rb < 0) {
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        DIE("Unepxected error while reading from input\n");
+    opts.source_fd = reader.fd;
+    if(sfs_encoder_open(&enc, &opts, dfp) != SFS_OK) {
+        clean_all(&reader, dfp, NULL, NULL);
+        exit(EXIT_FAILURE);
     }
 
-    // It may happen that the buffer is not empty. In such case we need to flush it
-    // one last time
-    if(buf_offset > 0) {
-        fprintf(stderr, "Flushing last buffer to output\n");
-        /* If we were not in a copy case, relative_offset contains the number of zeros
-         * at the end of file. This number is redundant with the final footer read size.
-         * Thanks to the footer.read number we will know, when inflating, how many zeros
-         * we have to set in the end of file.
-         * It will just be discarded anyway because meta_idx % 2 == 0 (see flush block)
-         * So we may as well call flush block with relative offset-1
-         */
-        if(flush_block(buffer, buf_offset, &footer, dfp, meta_idx,
-                       data_boundaries, relative_offset, random_size, random_buf)) {
-            clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-            DIE("Flush block error\n");
-        }
-
-        atomic_blocks++;
-        data_cluster_nb += meta_idx / 2 + (meta_idx % 2 != 0);
+    fprintf(stderr, "Start reading\n");
+    if(sfs_encoder_run(&enc, &reader) != SFS_OK) {
+        sfs_encoder_close(&enc);
+        clean_all(&reader, dfp, NULL, NULL);
+        exit(EXIT_FAILURE);
     }
 
-    footer.atomic_blocks = atomic_blocks;
-
     fprintf(stderr, "Finished reading file !\n");
+    if(reader.skipped > 0)
+        fprintf(stderr, "%li bytes of source holes skipped without reading them\n", reader.skipped);
 
-    if(footer.read > 0) {
-        footer.ratio = ((double) footer.written/(double) footer.read);
-    }
-
-    //Push next block: -1 marks the start of the final footer
-    buf_offset = -1L;
-    written = fwrite(&buf_offset, sizeof(size_t), 1, dfp);
-    if(written != 1) {
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        DIE("Error declaring final footer\n");
-    }
-    footer.written += sizeof(size_t);
-
-    footer.written += sizeof(sfs_footer_t);
-    written = fwrite((void *) &footer, sizeof(sfs_footer_t), 1, dfp);
-    if(written != 1) {
-        clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
-        DIE("Unable to write final footer correctly\n");
+    if(sfs_encoder_finish(&enc) != SFS_OK) {
+        sfs_encoder_close(&enc);
+        clean_all(&reader, dfp, NULL, NULL);
+        exit(EXIT_FAILURE);
     }
 
     fprintf(stderr, "Read: %li, written %li, compression ratio %.5lf, number of atomic_blocks %li, "
-            "data cluster number %li\n", footer.read, footer.written, footer.ratio,
-            atomic_blocks, data_cluster_nb);
-
-    clean_all(sfp, dfp, buffer, data_boundaries, random_buf);
+            "data cluster number %li\n", enc.footer.read, enc.footer.written, enc.footer.ratio,
+            enc.atomic_blocks, enc.data_cluster_nb);
+
+    sfs_encoder_close(&enc);
+    clean_all(&reader, dfp, NULL, NULL);
+    if(opts.stats != NULL) {
+        sfs_stats_finish(opts.stats);
+        sfs_stats_destroy(opts.stats);
+    }
     fprintf(stderr, "Sparse file stripper compression done!\n");
 
     exit(EXIT_SUCCESS);
 }
-
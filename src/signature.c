@@ -0,0 +1,119 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <signature.h>
+#include <sfs.h>
+
+
+int sfs_sig_create(sfs_sig_t *sig, const char *path, size_t granularity) {
+    memset(sig, 0, sizeof(sfs_sig_t));
+    sig->hdr.magic = SFS_SIG_MAGIC;
+    sig->hdr.granularity = granularity;
+    sig->fp = fopen(path, "wb");
+    if(sig->fp == NULL)
+        return -1;
+    // Rewritten once the source is read
+    if(fwrite(&sig->hdr, sizeof(sfs_sig_header_t), 1, sig->fp) != 1)
+        return -1;
+    return 0;
+}
+
+
+int sfs_sig_append(sfs_sig_t *sig, const u_int64_t *hashes, size_t count) {
+    if(fwrite(hashes, sizeof(u_int64_t), count, sig->fp) != count) {
+        fprintf(stderr, "Unable to write signatures\n");
+        return -1;
+    }
+    sig->hdr.n += count;
+    return 0;
+}
+
+
+int sfs_sig_finish(sfs_sig_t *sig, size_t size) {
+    int rc = 0;
+
+    sig->hdr.size = size;
+    if(fseeko(sig->fp, 0, SEEK_SET) != 0 || fwrite(&sig->hdr, sizeof(sfs_sig_header_t), 1, sig->fp) != 1)
+        rc = -1;
+    if(fclose(sig->fp) != 0)
+        rc = -1;
+    sig->fp = NULL;
+    if(rc != 0)
+        fprintf(stderr, "Unable to write the signature file\n");
+    return rc;
+}
+
+
+int sfs_sig_open(sfs_sig_t *sig, const char *path) {
+    struct stat st;
+    FILE *fp;
+
+    memset(sig, 0, sizeof(sfs_sig_t));
+    fp = fopen(path, "rb");
+    if(fp == NULL) {
+        fprintf(stderr, "Unable to open the signature file\n");
+        return -1;
+    }
+    // The granularity is checked before being divided by
+    if(fread(&sig->hdr, sizeof(sfs_sig_header_t), 1, fp) != 1 || sig->hdr.magic != SFS_SIG_MAGIC ||
+       sig->hdr.granularity < MIN_GRANULARITY || sig->hdr.granularity > MAX_GRANULARITY ||
+       (sig->hdr.granularity & (sig->hdr.granularity - 1)) != 0 ||
+       sig->hdr.n != (sig->hdr.size + sig->hdr.granularity - 1) / sig->hdr.granularity) {
+        fprintf(stderr, "Invalid or incomplete signature file\n");
+        close_all_files(1, fp);
+        return -1;
+    }
+    sig->map_len = sizeof(sfs_sig_header_t) + sig->hdr.n * sizeof(u_int64_t);
+    if(fstat(fileno(fp), &st) != 0 || (size_t) st.st_size < sig->map_len) {
+        fprintf(stderr, "Truncated signature file\n");
+        close_all_files(1, fp);
+        return -1;
+    }
+    sig->map = mmap(NULL, sig->map_len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    close_all_files(1, fp);
+    if(sig->map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map the signature file\n");
+        sig->map = NULL;
+        return -1;
+    }
+    sig->hashes = (const u_int64_t *) ((char *) sig->map + sizeof(sfs_sig_header_t));
+    return 0;
+}
+
+
+int sfs_sig_match(const sfs_sig_t *sig, size_t g, u_int64_t hash) {
+    // A last granule shorter than the granularity never matches a whole one
+    if(g >= sig->hdr.size / sig->hdr.granularity)
+        return 0;
+    return sig->hashes[g] == hash;
+}
+
+
+void sfs_sig_close(sfs_sig_t *sig) {
+    if(sig->map != NULL)
+        munmap(sig->map, sig->map_len);
+    sig->map = NULL;
+    sig->hashes = NULL;
+    close_all_files(1, sig->fp);
+    sig->fp = NULL;
+}
@@ -0,0 +1,228 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stats.h>
+
+static const char *zero_method_keys[STATS_ZERO_METHODS] = {
+    "punch", "zero_range", "blkzeroout"
+};
+
+
+u_int64_t sfs_stats_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void sfs_stats_add(sfs_stats_t *st, int counter, u_int64_t v) {
+    if(st != NULL)
+        __atomic_fetch_add(&st->counters[counter], v, __ATOMIC_RELAXED);
+}
+
+
+void sfs_stats_set(sfs_stats_t *st, int counter, u_int64_t v) {
+    if(st != NULL)
+        __atomic_store_n(&st->counters[counter], v, __ATOMIC_RELAXED);
+}
+
+
+u_int64_t sfs_stats_start(sfs_stats_t *st) {
+    return st != NULL ? sfs_stats_clock() : 0;
+}
+
+
+void sfs_stats_time(sfs_stats_t *st, int counter, u_int64_t start) {
+    if(st != NULL)
+        __atomic_fetch_add(&st->counters[counter], sfs_stats_clock() - start, __ATOMIC_RELAXED);
+}
+
+
+void sfs_stats_zero(sfs_stats_t *st, int method, u_int64_t start) {
+    u_int64_t us;
+    int b = 0;
+
+    if(st == NULL || method >= STATS_ZERO_METHODS)
+        return;
+    for(us=(sfs_stats_clock() - start)/1000; us>0 && b<STATS_LATENCY_BUCKETS-1; us>>=1)
+        b++;
+    __atomic_fetch_add(&st->zero_latency[method][b], 1, __ATOMIC_RELAXED);
+}
+
+
+void sfs_stats_block(sfs_stats_t *st, size_t size) {
+    size_t b;
+
+    if(st == NULL)
+        return;
+    sfs_stats_add(st, SFS_STAT_BLOCKS, 1);
+    sfs_stats_add(st, SFS_STAT_BLOCK_DATA, size);
+    if(st->block_capacity == 0)
+        return;
+    b = size * STATS_FILL_BUCKETS / st->block_capacity;
+    if(b >= STATS_FILL_BUCKETS)
+        b = STATS_FILL_BUCKETS - 1;
+    __atomic_fetch_add(&st->block_fill[b], 1, __ATOMIC_RELAXED);
+}
+
+
+// Append an array of n counters to the line
+static size_t stats_array(char *line, size_t len, const u_int64_t *a, size_t n) {
+    size_t i;
+
+    for(i=0; i<n && len<STATS_LINE_SIZE; i++)
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "%s%lu", i > 0 ? "," : "[",
+                        __atomic_load_n(&a[i], __ATOMIC_RELAXED));
+    if(len < STATS_LINE_SIZE)
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "]");
+    return len;
+}
+
+
+static void stats_emit(sfs_stats_t *st, u_int64_t now, int final) {
+    char line[STATS_LINE_SIZE];
+    u_int64_t c[SFS_STAT_COUNTERS], zeros;
+    double interval = (now - st->last) / 1e9;
+    size_t len, done, i;
+    ssize_t wb;
+    int m;
+
+    for(i=0; i<SFS_STAT_COUNTERS; i++)
+        c[i] = __atomic_load_n(&st->counters[i], __ATOMIC_RELAXED);
+    len = snprintf(line, STATS_LINE_SIZE,
+                   "{\"tool\":\"%s\",\"final\":%s,\"elapsed\":%.3f,\"read\":%lu,\"stripped\":%lu,"
+                   "\"written\":%lu,\"read_rate\":%.0f,\"written_rate\":%.0f,\"read_wait\":%.6f,"
+                   "\"write_wait\":%.6f,\"scan\":%.6f,\"zero_fallbacks\":%lu,\"zero_written\":%lu,"
+                   "\"blocks\":%lu,\"block_data\":%lu,\"unchanged\":%lu,\"zero_calls\":{",
+                   st->tool, final ? "true" : "false", (now - st->start) / 1e9, c[SFS_STAT_READ],
+                   c[SFS_STAT_STRIPPED], c[SFS_STAT_WRITTEN],
+                   interval > 0 ? (c[SFS_STAT_READ] - st->last_read) / interval : 0,
+                   interval > 0 ? (c[SFS_STAT_WRITTEN] - st->last_written) / interval : 0,
+                   c[SFS_STAT_READ_NS] / 1e9, c[SFS_STAT_WRITE_NS] / 1e9, c[SFS_STAT_SCAN_NS] / 1e9,
+                   c[SFS_STAT_ZERO_FALLBACKS], c[SFS_STAT_ZERO_WRITTEN], c[SFS_STAT_BLOCKS],
+                   c[SFS_STAT_BLOCK_DATA], c[SFS_STAT_UNCHANGED]);
+    for(m=0; m<STATS_ZERO_METHODS && len<STATS_LINE_SIZE; m++) {
+        for(zeros=0, i=0; i<STATS_LATENCY_BUCKETS; i++)
+            zeros += __atomic_load_n(&st->zero_latency[m][i], __ATOMIC_RELAXED);
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "%s\"%s\":%lu", m > 0 ? "," : "",
+                        zero_method_keys[m], zeros);
+    }
+    if(len < STATS_LINE_SIZE)
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "},\"zero_latency_us\":{");
+    for(m=0; m<STATS_ZERO_METHODS && len<STATS_LINE_SIZE; m++) {
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "%s\"%s\":", m > 0 ? "," : "",
+                        zero_method_keys[m]);
+        len = stats_array(line, len, st->zero_latency[m], STATS_LATENCY_BUCKETS);
+    }
+    if(len < STATS_LINE_SIZE)
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "},\"block_fill\":");
+    len = stats_array(line, len, st->block_fill, STATS_FILL_BUCKETS);
+    if(len < STATS_LINE_SIZE)
+        len += snprintf(line + len, STATS_LINE_SIZE - len, "}\n");
+    if(len >= STATS_LINE_SIZE)
+        return;
+
+    // A single write per line, so that lines from both tools sharing a fd stay whole
+    for(done=0; done<len; done+=wb) {
+        wb = write(st->fd, line + done, len - done);
+        if(wb <= 0)
+            return;
+    }
+    st->last = now;
+    st->last_read = c[SFS_STAT_READ];
+    st->last_written = c[SFS_STAT_WRITTEN];
+}
+
+
+// Emit the periodic lines, even when the hot paths are stalled
+static void *stats_timer(void *arg) {
+    sfs_stats_t *st = arg;
+    struct timespec deadline;
+    u_int64_t now;
+
+    pthread_mutex_lock(&st->lock);
+    while(!st->stop) {
+        deadline.tv_sec = st->next / 1000000000ULL;
+        deadline.tv_nsec = st->next % 1000000000ULL;
+        if(pthread_cond_timedwait(&st->wake, &st->lock, &deadline) != ETIMEDOUT)
+            continue;
+        now = sfs_stats_clock();
+        if(now >= st->next) {
+            stats_emit(st, now, 0);
+            st->next = now + STATS_INTERVAL_NS;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+
+int sfs_stats_init(sfs_stats_t *st, const char *tool, int fd, size_t block_capacity) {
+    pthread_condattr_t attr;
+
+    memset(st, 0, sizeof(sfs_stats_t));
+    if(fcntl(fd, F_GETFD) == -1) {
+        fprintf(stderr, "Invalid stats file descriptor %d\n", fd);
+        return -1;
+    }
+    st->fd = fd;
+    st->tool = tool;
+    st->block_capacity = block_capacity;
+    st->start = sfs_stats_clock();
+    st->last = st->start;
+    st->next = st->start + STATS_INTERVAL_NS;
+    pthread_mutex_init(&st->lock, NULL);
+    // The deadlines are sfs_stats_clock() times
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if(pthread_create(&st->timer, NULL, stats_timer, st) != 0) {
+        fprintf(stderr, "Unable to start the stats thread\n");
+        pthread_cond_destroy(&st->wake);
+        pthread_mutex_destroy(&st->lock);
+        return -1;
+    }
+    return 0;
+}
+
+
+void sfs_stats_finish(sfs_stats_t *st) {
+    if(st == NULL)
+        return;
+    pthread_mutex_lock(&st->lock);
+    st->stop = 1;
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->lock);
+    pthread_join(st->timer, NULL);
+    stats_emit(st, sfs_stats_clock(), 1);
+}
+
+
+void sfs_stats_destroy(sfs_stats_t *st) {
+    if(st == NULL)
+        return;
+    pthread_cond_destroy(&st->wake);
+    pthread_mutex_destroy(&st->lock);
+}
@@ -0,0 +1,159 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <uring.h>
+
+
+int sfs_uring_init(sfs_uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(sfs_uring_t));
+    memset(&p, 0, sizeof(struct io_uring_params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->fd < 0)
+        return -1;
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto fail;
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    sfs_uring_exit(ring);
+    return -1;
+}
+
+
+struct io_uring_sqe *sfs_uring_get_sqe(sfs_uring_t *ring) {
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+
+    idx = ring->sq_local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->pending++;
+    return sqe;
+}
+
+
+int sfs_uring_submit(sfs_uring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->pending;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while(to_submit > 0 || wait_nr > 0) {
+        rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                     wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "io_uring submission failed: %s\n", strerror(errno));
+            return -1;
+        }
+        ring->inflight += rc;
+        ring->pending -= rc;
+        to_submit -= rc;
+        // The wait was done along with the last submission
+        if(to_submit == 0)
+            break;
+    }
+    return 0;
+}
+
+
+int sfs_uring_peek(sfs_uring_t *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+    return 1;
+}
+
+
+int sfs_uring_wait(sfs_uring_t *ring, struct io_uring_cqe *cqe) {
+    while(!sfs_uring_peek(ring, cqe)) {
+        if(ring->inflight == 0 && ring->pending == 0) {
+            fprintf(stderr, "io_uring: waiting for a completion while nothing is in flight\n");
+            return -1;
+        }
+        if(sfs_uring_submit(ring, 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+void sfs_uring_exit(sfs_uring_t *ring) {
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if(ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if(ring->fd > 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(sfs_uring_t));
+    ring->fd = -1;
+}
@@ -0,0 +1,264 @@
+/* Copyright 2022 OVHcloud
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Zero detection kernels.
+ *
+ * Every kernel checks a block by OR-ing wide words together and testing the
+ * accumulator every few words, so that dense data (the common case being a
+ * non-zero byte early in the block) exits quickly while real zero blocks are
+ * scanned at memory bandwidth. The SIMD kernels are compiled with per function
+ * target attributes, so that no specific compiler flag is needed and the binary
+ * still runs on CPUs lacking them: the kernel is picked at runtime (CPUID).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zeroscan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZS_X86 1
+#endif
+
+
+static inline int zs_is_zero_generic(const unsigned char *p, size_t len) {
+    u_int64_t w0, w1, w2, w3;
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32) {
+        // memcpy keeps us safe from unaligned accesses, compilers turn it into plain loads
+        memcpy(&w0, p + i, 8);
+        memcpy(&w1, p + i + 8, 8);
+        memcpy(&w2, p + i + 16, 8);
+        memcpy(&w3, p + i + 24, 8);
+        if(w0 | w1 | w2 | w3)
+            return 0;
+    }
+    for(; i < len; i++) {
+        if(p[i])
+            return 0;
+    }
+    return 1;
+}
+
+
+#define ZS_DEFINE_SCAN(isa, attr)                                               \
+attr static size_t zs_scan_##isa(const unsigned char *buf, size_t nblk,        \
+                                 size_t blk_size, sfs_run_t *runs) {            \
+    size_t i, n = 0;                                                            \
+    u_int8_t zero;                                                              \
+    for(i=0; i<nblk; i++) {                                                     \
+        zero = zs_is_zero_##isa(buf + i * blk_size, blk_size);                  \
+        if(n > 0 && runs[n-1].zero == zero) {                                   \
+            runs[n-1].len += blk_size;                                          \
+        }                                                                       \
+        else {                                                                  \
+            runs[n].len = blk_size;                                             \
+            runs[n].zero = zero;                                                \
+            n++;                                                                \
+        }                                                                       \
+    }                                                                           \
+    return n;                                                                   \
+}
+
+static int zs_supported_generic(void) {
+    return 1;
+}
+
+ZS_DEFINE_SCAN(generic, )
+
+
+#ifdef ZS_X86
+
+__attribute__((target("sse2")))
+static inline int zs_is_zero_sse2(const unsigned char *p, size_t len) {
+    __m128i acc;
+    size_t i = 0;
+
+    for(; i + 64 <= len; i += 64) {
+        acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i)),
+                         _mm_loadu_si128((const __m128i *) (p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i + 32)),
+                         _mm_loadu_si128((const __m128i *) (p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+            return 0;
+    }
+    return zs_is_zero_generic(p + i, len - i);
+}
+
+static int zs_supported_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+ZS_DEFINE_SCAN(sse2, __attribute__((target("sse2"))))
+
+
+__attribute__((target("avx2")))
+static inline int zs_is_zero_avx2(const unsigned char *p, size_t len) {
+    __m256i acc;
+    size_t i = 0;
+
+    for(; i + 128 <= len; i += 128) {
+        acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + i)),
+                            _mm256_loadu_si256((const __m256i *) (p + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + i + 64)),
+                            _mm256_loadu_si256((const __m256i *) (p + i + 96))));
+        if(!_mm256_testz_si256(acc, acc))
+            return 0;
+    }
+    return zs_is_zero_generic(p + i, len - i);
+}
+
+static int zs_supported_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+ZS_DEFINE_SCAN(avx2, __attribute__((target("avx2"))))
+
+
+__attribute__((target("avx512f")))
+static inline int zs_is_zero_avx512(const unsigned char *p, size_t len) {
+    __m512i acc;
+    size_t i = 0;
+
+    for(; i + 256 <= len; i += 256) {
+        acc = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512((const void *) (p + i)),
+                            _mm512_loadu_si512((const void *) (p + i + 64))),
+            _mm512_or_si512(_mm512_loadu_si512((const void *) (p + i + 128)),
+                            _mm512_loadu_si512((const void *) (p + i + 192))));
+        if(_mm512_test_epi64_mask(acc, acc) != 0)
+            return 0;
+    }
+    return zs_is_zero_generic(p + i, len - i);
+}
+
+static int zs_supported_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+ZS_DEFINE_SCAN(avx512, __attribute__((target("avx512f"))))
+
+#endif
+
+
+static const zs_kernel_t zs_kernel_generic = { "generic", zs_supported_generic, zs_scan_generic };
+#ifdef ZS_X86
+static const zs_kernel_t zs_kernel_sse2 = { "sse2", zs_supported_sse2, zs_scan_sse2 };
+static const zs_kernel_t zs_kernel_avx2 = { "avx2", zs_supported_avx2, zs_scan_avx2 };
+static const zs_kernel_t zs_kernel_avx512 = { "avx512", zs_supported_avx512, zs_scan_avx512 };
+#endif
+
+// Sorted from the most to the least preferred one
+static const zs_kernel_t * const zs_all_kernels[] = {
+#ifdef ZS_X86
+    &zs_kernel_avx512,
+    &zs_kernel_avx2,
+    &zs_kernel_sse2,
+#endif
+    &zs_kernel_generic,
+    NULL
+};
+
+static const zs_kernel_t *zs_current = NULL;
+
+
+const zs_kernel_t * const *zs_kernels(void) {
+    return zs_all_kernels;
+}
+
+
+int zs_select(const char *name) {
+    int i;
+
+    for(i=0; zs_all_kernels[i] != NULL; i++) {
+        if(strcmp(zs_all_kernels[i]->name, name) == 0) {
+            if(!zs_all_kernels[i]->supported())
+                return -1;
+            zs_current = zs_all_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+void zs_init(void) {
+    int i;
+    char *forced = getenv("SFS_ZEROSCAN");
+
+    if(forced != NULL && *forced != '\0') {
+        if(zs_select(forced) == 0)
+            return;
+        fprintf(stderr, "WARNING: zero scan kernel '%s' unknown or not supported "
+                "by this CPU. Ignoring\n", forced);
+    }
+
+    for(i=0; zs_all_kernels[i] != NULL; i++) {
+        if(zs_all_kernels[i]->supported()) {
+            zs_current = zs_all_kernels[i];
+            return;
+        }
+    }
+}
+
+
+const char *zs_kernel_name(void) {
+    if(zs_current == NULL)
+        zs_init();
+    return zs_current->name;
+}
+
+
+size_t zs_scan(const void *buf, size_t len, size_t blk_size, sfs_run_t *runs) {
+    if(zs_current == NULL)
+        zs_init();
+    return zs_current->scan((const unsigned char *) buf, len / blk_size, blk_size, runs);
+}
+
+
+int zs_is_zero(const void *buf, size_t len) {
+    sfs_run_t run;
+    size_t body;
+
+    if(zs_current == NULL)
+        zs_init();
+
+    // Reuse the kernel on a single block covering the 64 bytes multiple part
+    body = len & ~((size_t) 63);
+    if(body > 0) {
+        zs_current->scan((const unsigned char *) buf, 1, body, &run);
+        if(!run.zero)
+            return 0;
+    }
+    return zs_is_zero_generic((const unsigned char *) buf + body, len - body);
+}
+
+
+int zs_is_pattern(const void *buf, size_t len, u_int64_t *word) {
+    // Comparing the buffer with itself shifted by one word checks every word
+    // against the previous one, at memcmp speed
+    if(len < 16 || len % 8 != 0 || memcmp(buf, (const char *) buf + 8, len - 8) != 0)
+        return 0;
+    memcpy(word, buf, 8);
+    return 1;
+}
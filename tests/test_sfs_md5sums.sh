@@ -4,6 +4,7 @@ set -e -o pipefail -x -u
 
 BINDIR=${BINDIR:-"/tmp/sparse-file-stripper/build/bin"}
 SFSZ_PARAMS=${SFSZ_PARAMS:-""}
+SFSUZ_PARAMS=${SFSUZ_PARAMS:-""}
 
 # Setup
 TESTDIR=$(mktemp -d)
@@ -41,7 +42,7 @@ function run_test () {
     ls -alh $TESTDIR
 
     echo "Inflating to pre existing file matching size"
-    $BINDIR/sfsuz $TESTDIR/data1.cbz $TESTDIR/datadst1
+    $BINDIR/sfsuz ${SFSUZ_PARAMS} $TESTDIR/data1.cbz $TESTDIR/datadst1
     check=$(compute_md5 $TESTDIR/datadst1)
     if [[ "$check" != "$witness" ]];then
         echo "ERROR $TESTDIR/datadst1 and $TESTDIR/data1 md5 sums differ ($check != $witness)"
@@ -49,7 +50,7 @@ function run_test () {
     fi
 
     echo "Inflating to pre existing file not matching size"
-    $BINDIR/sfsuz $TESTDIR/data1.cbz $TESTDIR/datadst2
+    $BINDIR/sfsuz ${SFSUZ_PARAMS} $TESTDIR/data1.cbz $TESTDIR/datadst2
     check=$(compute_md5 $TESTDIR/datadst2)
     if [[ "$check" == "$witness" ]];then
         echo "ERROR $TESTDIR/datadst2 and $TESTDIR/data1 md5 sums should not be equal ($witness)"
@@ -65,7 +66,7 @@ function run_test () {
     fi
 
     echo "Inflating to non existing file"
-    $BINDIR/sfsuz $TESTDIR/data1.cbz $TESTDIR/datadst3
+    $BINDIR/sfsuz ${SFSUZ_PARAMS} $TESTDIR/data1.cbz $TESTDIR/datadst3
     check=$(compute_md5 $TESTDIR/datadst3)
     if [[ "$check" != "$witness" ]];then
         echo "ERROR $TESTDIR/datadst3 and $TESTDIR/data1 md5 sums differ ($check != $witness)"
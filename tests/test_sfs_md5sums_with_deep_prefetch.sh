@@ -0,0 +1,5 @@
+#!/bin/bash
+
+export SFSUZ_PARAMS="-p 8"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_md5sums.sh
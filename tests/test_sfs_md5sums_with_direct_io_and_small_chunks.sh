@@ -0,0 +1,5 @@
+#!/bin/bash
+
+export SFSZ_PARAMS="-d -c 8192"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_md5sums.sh
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+export SFSUZ_PARAMS="-m 65536"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_md5sums_with_keepalive.sh
@@ -7,11 +7,33 @@ SFS_ATOMIC_SIZE=${SFS_ATOMIC_SIZE:-""}
 TESTSIZE=${TESTSIZE:-104857600}
 EXPECTED_ATOMIC_BLOCKS=${EXPECTED_ATOMIC_BLOCKS:-1}
 SFSZ_PARAMS=${SFSZ_PARAMS:-""}
+SFSUZ_PARAMS=${SFSUZ_PARAMS:-""}
+# Also fill 50-60% with a repeated byte (0xFF, like erased flash)
+PATTERN_AREA=${PATTERN_AREA:-""}
+# Also copy 10-20% to 60-70%, for deduplication
+DUPLICATE_AREA=${DUPLICATE_AREA:-""}
+# Also restore 25-45% on its own with sfsuz --range
+RANGE=${RANGE:-""}
+# Also back up 1% changed against the first backup signatures, and apply it with sfsuz --onto-base
+INCREMENTAL=${INCREMENTAL:-""}
+# Also verify the backup with sfs_stats --verify
+VERIFY=${VERIFY:-""}
+# Also restore the backup read from a pipe
+PIPED=${PIPED:-""}
+# Write the backup to a pipe, read slowly, rather than to a file
+PIPED_BACKUP=${PIPED_BACKUP:-""}
+# Filter the backup pipe through that command first (stdin to stdout)
+PIPE_READER=${PIPE_READER:-"cat"}
+# Also change 2% of the restored image, in a sparse and a dense area, and restore it again with sfsuz --diff
+DIFF=${DIFF:-""}
+# Back up in that many shards, restored one by one in reverse order
+SHARDS=${SHARDS:-""}
 if [[ -n "$SFS_ATOMIC_SIZE" ]];then
     SFSZ_PARAMS="${SFSZ_PARAMS} -b ${SFS_ATOMIC_SIZE}"
 fi
 
 testdir=$(mktemp -d)
+sigs=${testdir}/backup.sig
 
 function tear_down () {
     rm -rf $testdir
@@ -50,6 +72,19 @@ dd if=/dev/zero of=$src bs=${sparse_chunk_size} seek=${seek_offset1} count=1 ifl
 seek_offset2=$(echo "${sparse_chunk_size} * 8" | bc)
 dd if=/dev/zero of=$src bs=${sparse_chunk_size} seek=${seek_offset2} count=1 iflag=fullblock conv=notrunc oflag=seek_bytes
 
+if [[ -n "$PATTERN_AREA" ]];then
+    # Pattern area 50-60%
+    seek_offset3=$(echo "${sparse_chunk_size} * 5" | bc)
+    dd if=/dev/zero bs=${sparse_chunk_size} count=1 iflag=fullblock | tr '\0' '\377' | \
+        dd of=$src bs=${sparse_chunk_size} seek=${seek_offset3} count=1 iflag=fullblock conv=notrunc oflag=seek_bytes
+fi
+
+if [[ -n "$DUPLICATE_AREA" ]];then
+    # Duplicate area 60-70%
+    seek_offset4=$(echo "${sparse_chunk_size} * 6" | bc)
+    dd if=$src of=$src bs=${sparse_chunk_size} skip=${sparse_chunk_size} seek=${seek_offset4} count=1 iflag=fullblock,skip_bytes conv=notrunc oflag=seek_bytes
+fi
+
 echo "Source image prepared"
 
 echo "Test directory $testdir listing"
@@ -64,12 +99,24 @@ witness=$(chksum)
 echo checksum witness $witness
 
 backup=${testdir}/backup.img
+backups=$backup
 
 echo "Creating backup"
 
-cmd="${BINDIR}/sfsz ${SFSZ_PARAMS} ${src} $backup"
-echo "SFSZ COMMAND: $cmd"
-$cmd
+if [[ -n "$SHARDS" ]];then
+    cmd="${BINDIR}/sfsz ${SFSZ_PARAMS} --shards ${SHARDS} ${src} ${testdir}/backup.%d.img"
+    echo "SFSZ COMMAND: $cmd"
+    $cmd
+    backups=$(ls -r ${testdir}/backup.*.img)
+elif [[ -n "$PIPED_BACKUP" ]];then
+    cmd="${BINDIR}/sfsz ${SFSZ_PARAMS} ${INCREMENTAL:+--signatures $sigs} ${src} -"
+    echo "SFSZ COMMAND: $cmd | $PIPE_READER | dd of=$backup"
+    $cmd | $PIPE_READER | dd of=$backup bs=4096 iflag=fullblock
+else
+    cmd="${BINDIR}/sfsz ${SFSZ_PARAMS} ${INCREMENTAL:+--signatures $sigs} ${src} $backup"
+    echo "SFSZ COMMAND: $cmd"
+    $cmd
+fi
 
 check=$(chksum)
 if [[ "$check" != "$witness" ]];then
@@ -81,7 +128,10 @@ echo "######################################################"
 echo "OK: ${src} checksum after backup"
 echo "######################################################"
 
-atomic_blocks=$($BINDIR/sfs_stats $backup | grep -oP '^.*atomic_blocks=\K\d+(?=.*)$')
+atomic_blocks=0
+for b in $backups; do
+    atomic_blocks=$((atomic_blocks + $($BINDIR/sfs_stats $b | grep -oP '^.*atomic_blocks=\K\d+(?=.*)$')))
+done
 
 if [[ "${atomic_blocks}" != "${EXPECTED_ATOMIC_BLOCKS}" ]];then
     echo "ERROR: Unexpected number of atomic blocks: ${atomic_blocks} != ${EXPECTED_ATOMIC_BLOCKS}"
@@ -89,9 +139,19 @@ if [[ "${atomic_blocks}" != "${EXPECTED_ATOMIC_BLOCKS}" ]];then
 fi
 
 echo "######################################################"
-echo "OK: expected number of atomic blocks for $backup"
+echo "OK: expected number of atomic blocks for $backups"
 echo "######################################################"
 
+if [[ -n "$VERIFY" ]];then
+    for b in $backups; do
+        $BINDIR/sfs_stats --verify $b
+    done
+
+    echo "######################################################"
+    echo "OK: $backups verified"
+    echo "######################################################"
+fi
+
 echo "Filling source with random data"
 dd if=/dev/urandom of=${src} bs=$TESTSIZE count=1 iflag=fullblock conv=notrunc
 
@@ -106,7 +166,9 @@ echo "OK: $src different checksum after random erase"
 echo "######################################################"
 
 echo 'Restoring backup'
-${BINDIR}/sfsuz $backup ${src}
+for b in $backups; do
+    ${BINDIR}/sfsuz ${SFSUZ_PARAMS} $b ${src}
+done
 check=$(chksum)
 if [[ "$check" != "$witness" ]];then
     echo "UNEXPECTED checksum on $src after restore: $witness != $check"
@@ -116,3 +178,92 @@ fi
 echo "######################################################"
 echo "OK: ${src} checksum after restore"
 echo "######################################################"
+
+if [[ -n "$DIFF" ]];then
+    change_len=$(echo "(${TESTSIZE} * 0.01) / 1" | bc)
+    for change_offset in $(echo "(${TESTSIZE} * 0.05) / 1; (${TESTSIZE} * 0.15) / 1" | bc);do
+        dd if=/dev/urandom of=$src bs=${change_len} seek=${change_offset} count=1 iflag=fullblock conv=notrunc oflag=seek_bytes
+    done
+    echo 'Restoring backup again with --diff'
+    for b in $backups; do
+        ${BINDIR}/sfsuz ${SFSUZ_PARAMS} --diff $b ${src}
+    done
+    check=$(chksum)
+    if [[ "$check" != "$witness" ]];then
+        echo "UNEXPECTED checksum on $src after diff restore: $witness != $check"
+        false
+    fi
+
+    echo "######################################################"
+    echo "OK: ${src} checksum after diff restore"
+    echo "######################################################"
+fi
+
+if [[ -n "$RANGE" ]];then
+    range_offset=$(echo "(${TESTSIZE} * 0.25) / 1" | bc)
+    range_len=$(echo "(${TESTSIZE} * 0.2) / 1" | bc)
+    part=${testdir}/part.img
+    echo "Restoring range ${range_offset}:${range_len}"
+    ${BINDIR}/sfsuz ${SFSUZ_PARAMS} --range ${range_offset}:${range_len} $backup ${part}
+    witness=$(dd if=$src bs=${range_len} skip=${range_offset} count=1 iflag=skip_bytes,fullblock | md5sum | awk '{print $1}')
+    check=$(md5sum $part | awk '{print $1}')
+    if [[ "$check" != "$witness" ]];then
+        echo "UNEXPECTED checksum on $part after range restore: $witness != $check"
+        false
+    fi
+
+    echo "######################################################"
+    echo "OK: ${part} checksum after range restore"
+    echo "######################################################"
+fi
+
+if [[ -n "$PIPED" ]];then
+    piped=${testdir}/piped.img
+    echo "Restoring backup from a pipe"
+    cat $backup | ${BINDIR}/sfsuz ${SFSUZ_PARAMS} - ${piped}
+    witness=$(chksum)
+    check=$(md5sum $piped | awk '{print $1}')
+    if [[ "$check" != "$witness" ]];then
+        echo "UNEXPECTED checksum on $piped after restore from a pipe: $witness != $check"
+        false
+    fi
+
+    echo "######################################################"
+    echo "OK: ${piped} checksum after restore from a pipe"
+    echo "######################################################"
+fi
+
+if [[ -n "$INCREMENTAL" ]];then
+    new=${testdir}/new.img
+    incr=${testdir}/incr.img
+    cp $src $new
+    change_len=$(echo "(${TESTSIZE} * 0.01) / 1" | bc)
+    change_offset=$(echo "(${TESTSIZE} * 0.45) / 1" | bc)
+    dd if=/dev/urandom of=$new bs=${change_len} seek=${change_offset} count=1 iflag=fullblock conv=notrunc oflag=seek_bytes
+    witness=$(md5sum $new | awk '{print $1}')
+    # A base with a zero granularity (bytes 8-15 of the header) is refused, not divided by
+    cp $sigs ${testdir}/broken.sig
+    dd if=/dev/zero of=${testdir}/broken.sig bs=8 seek=1 count=1 conv=notrunc
+    rc=0
+    ${BINDIR}/sfsz ${SFSZ_PARAMS} --base ${testdir}/broken.sig $new $incr || rc=$?
+    if [[ $rc -ne 1 ]];then
+        echo "UNEXPECTED exit code $rc with a zero granularity base"
+        false
+    fi
+    echo "Creating incremental backup"
+    ${BINDIR}/sfsz ${SFSZ_PARAMS} --base $sigs $new $incr
+    if [[ $(stat -c %s $incr) -gt $(echo "${change_len} * 2" | bc) ]];then
+        echo "UNEXPECTED incremental backup size: $(stat -c %s $incr) bytes for ${change_len} bytes changed"
+        false
+    fi
+    ${BINDIR}/sfsuz ${SFSUZ_PARAMS} --onto-base $incr ${src}
+    check=$(chksum)
+    if [[ "$check" != "$witness" ]];then
+        echo "UNEXPECTED checksum on $src after incremental restore: $witness != $check"
+        false
+    fi
+
+    echo "######################################################"
+    echo "OK: ${src} checksum after incremental restore"
+    echo "######################################################"
+fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+BINDIR=${BINDIR:-"/tmp/sparse-file-stripper/build/bin"}
+
+# Codecs are optional at build time (make ZSTD=1 LZ4=1): each one built in is tested on
+# its own, and without any of them the test exits with the usual "skipped" code rather
+# than passing
+function built_in () {
+    ! ${BINDIR}/sfsz -z $1 2>&1 | grep -q "Unknown codec"
+}
+
+tested=0
+export SFSUZ_PARAMS="-p 4"
+
+if built_in zstd; then
+    SFSZ_PARAMS="-z zstd -t 4" $(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh || exit 1
+    tested=1
+fi
+
+# With a LZ4HC level
+if built_in lz4; then
+    SFSZ_PARAMS="-z lz4:9 -t 4" $(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh || exit 1
+    tested=1
+fi
+
+if [[ $tested -eq 0 ]]; then
+    echo "SKIPPED: sfsz built without zstd nor lz4 (make ZSTD=1 LZ4=1)"
+    exit 77
+fi
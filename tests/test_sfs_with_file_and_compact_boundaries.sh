@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Odd size: the last data range is not a multiple of the granularity
+export TESTSIZE=104856886
+export SFSZ_PARAMS="-e -C -k 3145728"
+export EXPECTED_ATOMIC_BLOCKS=34
+export VERIFY=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+export SFSZ_PARAMS="-D 16777216"
+export DUPLICATE_AREA=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
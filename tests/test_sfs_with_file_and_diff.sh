@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Restored again over a slightly changed image, writing only what differs
+export SFSZ_PARAMS="-f"
+export SFSUZ_PARAMS="-u 8"
+export PATTERN_AREA=1
+export DIFF=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
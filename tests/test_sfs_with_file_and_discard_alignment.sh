@@ -0,0 +1,40 @@
+#!/bin/bash
+
+set -e -o pipefail -x -u
+
+BINDIR=${BINDIR:-"/tmp/sparse-file-stripper/build/bin"}
+
+# Setup
+TESTDIR=$(mktemp -d)
+
+function tear_down () {
+    echo "Test tear down"
+    rm -rf $TESTDIR
+}
+
+trap 'tear_down' EXIT
+
+# A hole from 1 MiB + 4 KiB to 3 MiB + 16 KiB, restored on a destination whose discard
+# granularity is 64 KiB and whose first aligned boundary is at 12 KiB: only
+# [1 MiB + 12 KiB, 3 MiB + 12 KiB[ is zeroed, the 8 KiB and 4 KiB edges are written
+function run_test () {
+    dd if=/dev/urandom of=$TESTDIR/src bs=1M count=4
+    dd if=/dev/zero of=$TESTDIR/src bs=4096 seek=257 count=515 conv=notrunc
+    witness=$(md5sum $TESTDIR/src | awk '{print $1}')
+
+    $BINDIR/sfsz $TESTDIR/src $TESTDIR/src.sfs
+    SFS_DISCARD=65536:12288 $BINDIR/sfsuz --stats-json $TESTDIR/stats.json $TESTDIR/src.sfs $TESTDIR/dst
+    check=$(md5sum $TESTDIR/dst | awk '{print $1}')
+    if [[ "$check" != "$witness" ]];then
+        echo "ERROR $TESTDIR/dst and $TESTDIR/src md5 sums differ ($check != $witness)"
+        false
+    fi
+    written=$(tail -1 $TESTDIR/stats.json | grep -oP '"zero_written":\K\d+')
+    if [[ "$written" != "12288" ]];then
+        echo "ERROR unexpected zeros written around the aligned part of the hole: $written != 12288"
+        false
+    fi
+    echo TEST OK
+}
+
+run_test
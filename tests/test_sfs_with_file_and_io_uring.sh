@@ -0,0 +1,6 @@
+#!/bin/bash
+
+export SFSZ_PARAMS="-u 8 -c 1048576"
+export SFSUZ_PARAMS="-u 32"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
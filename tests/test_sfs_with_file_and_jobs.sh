@@ -0,0 +1,5 @@
+#!/bin/bash
+
+export SFSZ_PARAMS="-j 4 -c 1048576"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
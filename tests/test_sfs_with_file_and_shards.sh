@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Three shards read with direct I/O, the last one ending unaligned
+export TESTSIZE=104857000
+export SFSZ_PARAMS="-d -C -i"
+export SHARDS=3
+export EXPECTED_ATOMIC_BLOCKS=3
+export SFSUZ_PARAMS="-u 8"
+export VERIFY=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
@@ -0,0 +1,5 @@
+#!/bin/bash
+
+export SFSZ_PARAMS="-g 512"
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Atomic blocks bigger than the pipe, their buffer being reused while the pipe is read
+export SFSZ_PARAMS="--vmsplice -C -b 16777216"
+export EXPECTED_ATOMIC_BLOCKS=5
+export PIPED_BACKUP=1
+export VERIFY=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# The backup pipe spliced into another pipe, held there while sfsz goes on: the pages
+# vmspliced must not be written again
+testdir=$(mktemp -d)
+trap "rm -rf $testdir" EXIT
+cat > ${testdir}/splice_reader.py <<'PY'
+import fcntl, os, sys, time
+r, w = os.pipe()
+fcntl.fcntl(w, 1031, 1 << 20)  # F_SETPIPE_SZ
+fcntl.fcntl(r, fcntl.F_SETFL, os.O_NONBLOCK)
+held = 0
+def drain():
+    global held
+    time.sleep(0.005)
+    while True:
+        try:
+            data = os.read(r, 1 << 20)
+        except BlockingIOError:
+            held = 0
+            return
+        sys.stdout.buffer.write(data)
+while True:
+    try:
+        n = os.splice(0, w, 1 << 20, flags=os.SPLICE_F_NONBLOCK)
+    except BlockingIOError:
+        if held >= 1 << 19:
+            drain()
+        else:
+            time.sleep(0.0002)
+        continue
+    if n == 0:
+        drain()
+        break
+    held += n
+PY
+
+export SFSZ_PARAMS="--vmsplice -C -b 16777216"
+export EXPECTED_ATOMIC_BLOCKS=5
+export PIPED_BACKUP=1
+export PIPE_READER="python3 ${testdir}/splice_reader.py"
+export VERIFY=1
+
+$(dirname "${BASH_SOURCE[0]}")/test_sfs_with_file.sh
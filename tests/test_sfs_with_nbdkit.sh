@@ -0,0 +1,56 @@
+#!/bin/bash
+
+set -e -o pipefail -x -u
+
+BINDIR=${BINDIR:-"/tmp/sparse-file-stripper/build/bin"}
+# Built by make nbdkit
+PLUGIN=${PLUGIN:-"${BINDIR}/../nbdkit-sfs-plugin.so"}
+SFSZ_PARAMS=${SFSZ_PARAMS:-""}
+
+if ! command -v nbdkit >/dev/null || ! command -v qemu-img >/dev/null || [[ ! -f $PLUGIN ]];then
+    echo "nbdkit, qemu-img or the sfs plugin missing, skipping"
+    exit 0
+fi
+
+# Setup
+TESTDIR=$(mktemp -d)
+
+function tear_down () {
+    echo "Test tear down"
+    rm -rf $TESTDIR
+}
+
+trap 'tear_down' EXIT
+
+function compute_md5 () {
+    md5sum $1 | awk '{print $1}'
+}
+
+# Serve a backup through NBD and convert it back to a file, holes being reported by block status
+function run_test () {
+    truncate -s 64M $TESTDIR/data1
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=4096 count=500 seek=1000 conv=notrunc
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=1000 count=3 seek=30001 conv=notrunc
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=1M count=3 seek=40 conv=notrunc
+    witness=$(compute_md5 $TESTDIR/data1)
+
+    $BINDIR/sfsz ${SFSZ_PARAMS} -b 1048576 $TESTDIR/data1 $TESTDIR/data1.sfs
+
+    nbdkit -U - $PLUGIN file=$TESTDIR/data1.sfs cache=2 \
+        --run "qemu-img convert -f raw -O raw \$nbd $TESTDIR/datadst1"
+    check=$(compute_md5 $TESTDIR/datadst1)
+    if [[ "$check" != "$witness" ]];then
+        echo "ERROR $TESTDIR/datadst1 and $TESTDIR/data1 md5 sums differ ($check != $witness)"
+        false
+    fi
+
+    # The holes are not even written
+    allocated=$(du -k $TESTDIR/datadst1 | awk '{print $1}')
+    if [[ $allocated -gt 16384 ]];then
+        echo "ERROR $TESTDIR/datadst1 holes were written (${allocated} KiB allocated)"
+        false
+    fi
+    echo TEST OK
+}
+
+run_test
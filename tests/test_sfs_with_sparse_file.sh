@@ -0,0 +1,48 @@
+#!/bin/bash
+
+set -e -o pipefail -x -u
+
+BINDIR=${BINDIR:-"/tmp/sparse-file-stripper/build/bin"}
+SFSZ_PARAMS=${SFSZ_PARAMS:-""}
+
+# Setup
+TESTDIR=$(mktemp -d)
+
+function tear_down () {
+    echo "Test tear down"
+    rm -rf $TESTDIR
+}
+
+trap 'tear_down' EXIT
+
+function compute_md5 () {
+    md5sum $1 | awk '{print $1}'
+}
+
+# Test the backup of a sparse source file, whose holes and unwritten extents are
+# skipped without being read, and with unaligned holes edges
+function run_test () {
+    fallocate -l 16M $TESTDIR/data1 || truncate -s 16M $TESTDIR/data1
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=4096 count=5 seek=1000 conv=notrunc
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=1000 count=3 seek=9001 conv=notrunc
+    truncate -s 40000714 $TESTDIR/data1
+    dd if=/dev/urandom of=$TESTDIR/data1 bs=4096 count=1 seek=8000 conv=notrunc
+    witness=$(compute_md5 $TESTDIR/data1)
+
+    $BINDIR/sfsz ${SFSZ_PARAMS} -k 3000000 $TESTDIR/data1 $TESTDIR/data1.sfs
+    cat $TESTDIR/data1 | $BINDIR/sfsz ${SFSZ_PARAMS} -k 3000000 - $TESTDIR/data1.stdin.sfs
+    if ! cmp $TESTDIR/data1.sfs $TESTDIR/data1.stdin.sfs;then
+        echo "ERROR backups of the sparse file and of its content through a pipe differ"
+        false
+    fi
+
+    $BINDIR/sfsuz $TESTDIR/data1.sfs $TESTDIR/datadst1
+    check=$(compute_md5 $TESTDIR/datadst1)
+    if [[ "$check" != "$witness" ]];then
+        echo "ERROR $TESTDIR/datadst1 and $TESTDIR/data1 md5 sums differ ($check != $witness)"
+        false
+    fi
+    echo TEST OK
+}
+
+run_test